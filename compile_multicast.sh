@@ -3,6 +3,11 @@ rm -rf bin
 mkdir bin
 
 gcc src/icd/* src/lib/* -o bin/icd -std=c99 -I inc/ -lpthread -lnfnetlink -lnetfilter_queue -lm -Wfatal-errors -D IPRP_MULTICAST
-gcc src/isd/* src/lib/* -o bin/isd -std=c99 -I inc/ -lpthread -lnfnetlink -lnetfilter_queue -Wfatal-errors -D IPRP_MULTICAST
+gcc src/isd/* src/lib/* -o bin/isd -std=c99 -D_GNU_SOURCE -I inc/ -lpthread -lnfnetlink -lnetfilter_queue -Wfatal-errors -D IPRP_MULTICAST
 gcc src/ird/* src/lib/* -o bin/ird -std=c99 -I inc/ -lpthread -lnfnetlink -lnetfilter_queue -Wfatal-errors -D IPRP_MULTICAST
-gcc src/imd/* src/lib/* -o bin/imd -std=c99 -I inc/ -lpthread -lnfnetlink -lnetfilter_queue -Wfatal-errors -D IPRP_MULTICAST
\ No newline at end of file
+gcc src/imd/* src/lib/* -o bin/imd -std=c99 -I inc/ -lpthread -lnfnetlink -lnetfilter_queue -Wfatal-errors -D IPRP_MULTICAST
+
+# tc sender program of the bpf ISD engine
+if command -v clang >/dev/null; then
+	clang -O2 -g -target bpf -mcpu=v3 -I inc/ -c src/bpf/isd_tc.c -o bin/isd_tc.o
+fi
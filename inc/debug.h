@@ -40,6 +40,7 @@ typedef enum {
 	ISD_MAIN = (1 << 8),
 	ISD_PB = (1 << 9),
 	ISD_HANDLE = (1 << 10),
+	ISD_TX = (1 << 11),
 
 	IMD_MAIN = (1 << 16),
 	IMD_AS = (1 << 17),
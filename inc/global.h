@@ -7,7 +7,9 @@
 #ifndef __IPRP_GLOBAL_
 #define __IPRP_GLOBAL_
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 #include <pthread.h>
@@ -16,11 +18,27 @@
 
 #include "debug.h"
 
-#define IPRP_PKTBUF_SIZE 4096
+#define IPRP_MAX_PACKET_SIZE 65535 // Datagrams are reassembled before the queues, and copies fragmented after the ISD
+#define IPRP_PKTBUF_SIZE (IPRP_MAX_PACKET_SIZE + 512) // Queue messages carry the packet and its attributes
 #define IPRP_NFQUEUE_MAX_LENGTH 100
+#define IPRP_NFQUEUE_RCVBUF (4 * 1024 * 1024) // Netlink receive buffer of a queue (holds some packets of the largest size)
+#define IPRP_COPY_PACKET 0xffff // Queues copy whole packets to userspace
+#define IPRP_COPY_HEADERS 28 // or only the IP and UDP headers
+#define IPRP_VERDICT_BATCH_SIZE 64
+#define IPRP_VERDICT_BATCH_USEC 1000
 #define IPRP_SNSID_SIZE 20
 
-#define IPRP_VERSION 1
+#define IPRP_VERSION 4 // Highest version understood (announced in the CAP messages)
+#define IPRP_VERSION_FULL 1 // Data packets with the full header
+#define IPRP_VERSION_COMPACT 2 // Data packets with the compact header (receivers of version 2 or later)
+#define IPRP_VERSION_AGGREGATE 3 // Compact packets carrying several datagrams (receivers of version 3 or later)
+#define IPRP_VERSION_FEC 4 // Packets protected by parity packets instead of duplicated (receivers of version 4 or later)
+#define IPRP_COMPACT_LINK 0x01 // The link description follows the compact header
+#define IPRP_COMPACT_AGGREGATE 0x02 // The payload is a sequence of datagrams, each preceded by its size (16 bits, network order)
+#define IPRP_COMPACT_FEC 0x04 // The packet is sent on a single path, a parity packet protects it
+#define IPRP_COMPACT_PARITY 0x08 // The payload is the parity of the packets it lists (no sequence number)
+#define IPRP_FEC_MAX_GROUP 8 // Packets protected by a parity packet
+#define IPRP_FEC_MAX_SIZE 1392 // Largest protected payload (the parity packet must fit the path MTU)
 #define IPRP_CTL_PORT 1000
 #define IPRP_DATA_PORT 1001
 #define IPRP_MAX_IFACE 16
@@ -52,6 +70,39 @@ typedef struct {
 	char hmac[160];
 }__attribute__((packed)) iprp_header_t;
 
+/* Compact header (the receiver finds the link from the flow ID and the source address of the path) */
+typedef struct {
+	uint8_t version;
+	uint8_t flags;
+	uint16_t flow_id;
+	uint32_t seq_nb;
+}__attribute__((packed)) iprp_compact_header_t;
+
+/* Link description sent after the compact header of some packets, so that the receiver learns the flow ID */
+typedef struct {
+	struct in_addr src_addr; // The SNSID is rebuilt from the source address, port and reboot counter
+	uint16_t src_port;
+	uint16_t reboot;
+	uint16_t dest_port;
+#ifndef IPRP_MULTICAST
+	struct in_addr dest_addr;
+#endif
+}__attribute__((packed)) iprp_compact_link_t;
+
+/* Parity packet payload: the protected packets, followed by the XOR of their payloads (padded with zeros) */
+typedef struct {
+	uint32_t seq_nb;
+	uint16_t size;
+	uint8_t flags; // Compact header flags of the packet
+	uint8_t pad;
+}__attribute__((packed)) iprp_fec_member_t;
+
+typedef struct {
+	uint8_t nb_members;
+	uint8_t pad[3];
+	iprp_fec_member_t members[];
+}__attribute__((packed)) iprp_parity_header_t;
+
 typedef struct {
 	iprp_ind_t ind;
 	struct in_addr addr;
@@ -72,16 +123,26 @@ typedef struct {
 
 void sockaddr_fill(struct sockaddr_in *sockaddr, struct in_addr addr, uint16_t port);
 iprp_ind_bitmap_t ind_match(iprp_host_t *sender, iprp_ind_bitmap_t receiver_inds);
+void snsid_fill(unsigned char *snsid, struct in_addr src_addr, uint16_t src_port, uint16_t reboot);
 
 /* NFQueue */
 typedef struct {
 	struct nfq_handle *handle;
 	struct nfq_q_handle *queue;
 	int fd;
+	// Pending verdicts (successive packets with the same verdict)
+	uint32_t batch_verdict;
+	uint32_t batch_id; // Last packet of the batch
+	unsigned int batch_count;
+	struct timespec batch_start; // Arrival of the first packet of the batch
 } iprp_queue_t;
 
-int queue_setup(iprp_queue_t *nfq, int queue_id, nfq_callback *callback);
+int queue_setup(iprp_queue_t *nfq, int queue_id, nfq_callback *callback, void *data, uint16_t copy_range);
 int get_and_handle(struct nfq_handle *handle, int queue_fd);
+int get_and_handle_buf(struct nfq_handle *handle, int queue_fd, char *buf, size_t buf_size);
+bool queue_empty(int queue_fd);
+int verdict_batch(iprp_queue_t *nfq, uint32_t packet_id, uint32_t verdict);
+int verdict_flush(iprp_queue_t *nfq);
 
 /* Time */
 void *time_routine(void* arg);
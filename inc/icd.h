@@ -10,6 +10,7 @@
 #include "global.h"
 #include "peerbase.h"
 #include "activesenders.h"
+#include "pathstats.h"
 #ifdef IPRP_MULTICAST
  #include "senderifaces.h"
 #endif
@@ -26,6 +27,49 @@
 #define IPRP_BACKOFF_D 10
 #define IPRP_BACKOFF_LAMBDA 2.5
 
+/* ISD queues (one worker thread per queue, balanced by iptables) */
+#ifndef IPRP_ISD_QUEUES
+ #define IPRP_ISD_QUEUES 1
+#endif
+#ifndef IPRP_ISD_CPU_FANOUT
+ #define IPRP_ISD_CPU_FANOUT 0 // Balance by sending CPU instead of by flow hash (needed to spread a single flow)
+#endif
+
+/* IRD queues (one worker thread per queue, balanced by iptables) */
+#ifndef IPRP_IRD_QUEUES
+ #define IPRP_IRD_QUEUES 1
+#endif
+#define IPRP_MAX_QUEUE_NUMBER 65535
+
+/* ISD transmit engine */
+#ifndef IPRP_ISD_ENGINE
+ #define IPRP_ISD_ENGINE "batch" // "batch" (sendmmsg from the workers), "paths" (one transmit thread per interface), "uring" (io_uring), "raw" (raw sockets), "xdp" (AF_XDP) or "bpf" (tc program)
+#endif
+
+#ifndef IPRP_ISD_GSO
+ #define IPRP_ISD_GSO 0 // Coalesce bursts of same-size copies with UDP GSO (batch engine, Linux 4.18 or later)
+#endif
+
+#ifndef IPRP_ISD_TXTIME
+ #define IPRP_ISD_TXTIME 0 // Send all copies of a packet at the same departure time with SO_TXTIME (batch engine, fq qdisc, Linux 4.20 or later)
+#endif
+
+#ifndef IPRP_ISD_AGGREGATE_USEC
+ #define IPRP_ISD_AGGREGATE_USEC 0 // Hold small payloads up to this many microseconds to send them in one frame (unicast, 0 to disable)
+#endif
+
+/* Path subset (the sender only uses the paths needed to meet a delivery target) */
+#ifndef IPRP_SUBSET_TARGET
+ #define IPRP_SUBSET_TARGET 0 // Probability that at least one copy of a packet arrives, e.g. 0.99999 (0 to always use all the paths)
+#endif
+#define IPRP_SUBSET_MIN_PACKETS 100 // Packets the receivers must have measured before the subset changes
+
+/* Forward error correction (each packet on a single path, one XOR parity packet per group of packets) */
+#ifndef IPRP_FEC_GROUP
+ #define IPRP_FEC_GROUP 0 // Packets per parity packet, at most IPRP_FEC_MAX_GROUP (0 to duplicate the packets)
+#endif
+#define IPRP_FEC_FILE "fec.txt" // Lines "<destination port> <group>" setting the group of the flows to some ports
+
 /* Control messages */
 typedef enum {
 	IPRP_CAP,
@@ -42,6 +86,8 @@ typedef struct {
 	iprp_ind_bitmap_t inds;
 	uint16_t src_port;
 	uint16_t dest_port;
+	int nb_paths;
+	iprp_path_stats_t paths[IPRP_MAX_INDS]; // Measured by the receiver over its last period
 } iprp_capmsg_t;
 
 #ifdef IPRP_MULTICAST
@@ -66,14 +112,27 @@ typedef struct {
 } iprp_ctlmsg_t;
 
 /* ICD Structures */
+#define IPRP_ICD_MAX_RECEIVERS 16 // Receivers of a flow whose version is known (the oldest one is replaced)
+
+typedef struct {
+	struct in_addr addr; // Source of its CAP messages
+	iprp_version_t version;
+	time_t last_cap;
+} iprp_icd_receiver_t;
+
 typedef struct {
 	iprp_link_t link;
 	iprp_ind_bitmap_t inds;
+	iprp_ind_bitmap_t active_inds; // Paths in use (the receivers report a high enough delivery without the other ones)
 #ifndef IPRP_MULTICAST
 	struct in_addr dest_addr[IPRP_MAX_INDS];
 #endif	
-	uint16_t queue_id;
-	pid_t isd_pid;
+	iprp_version_t version; // Lowest version announced by the receivers still present
+	iprp_icd_receiver_t receivers[IPRP_ICD_MAX_RECEIVERS];
+	int nb_receivers;
+	uint8_t fec_group;
+	uint16_t flow_id;
+	bool marked; // The packet marking rule of the flow is installed
 	time_t last_cap;
 } iprp_icd_base_t;
 
@@ -81,7 +140,11 @@ typedef struct {
 	uint16_t ird;
 	uint16_t imd;
 	uint16_t ird_imd;
-} iprp_icd_recv_queues_t;
+	uint16_t isd; // First queue of the ISD range
+} iprp_icd_queues_t;
+
+/* Path subset */
+void subset_update(iprp_icd_base_t *base, iprp_capmsg_t *msg);
 
 /* Control flow routines */
 void* control_routine(void *arg);
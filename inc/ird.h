@@ -9,6 +9,8 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <linux/ip.h>
 
 #include "global.h"
 
@@ -17,24 +19,142 @@
 #ifdef IPRP_MULTICAST
  #define IRD_SI_T_CACHE 3
 #endif
-#define IPRP_DD_MAX_LOST_PACKETS 1024
+#define IPRP_DD_MAX_LOST_PACKETS 1024 // Sequence numbers remembered below the highest one (multiple of 32)
+#define IPRP_DD_WORDS (IPRP_DD_MAX_LOST_PACKETS / 32)
+#define IRD_MAX_WORKERS 16
+#define IRD_LINKS_OFFLINE 0 // Version of a worker between two packets
+#define IRD_LINKS_SYNC_USEC 100
+#define IRD_ARRIVALS 256 // Packets whose first arrival is remembered to measure the delay of the paths (power of two)
+#define IRD_FEC_PACKETS 64 // Protected packets kept to rebuild a lost one from its parity (power of two)
+#define IRD_FEC_PARITIES 8 // Parity packets waiting for more packets of their group
+#define IRD_TABLE_MIN_SIZE 64 // Initial slots of the link tables (power of two)
+#define IRD_TABLE_MIGRATE 4 // Slots moved by each operation while a link table grows
+#define IRD_FEC_PARITY_SIZE (sizeof(iprp_parity_header_t) + IPRP_FEC_MAX_GROUP * sizeof(iprp_fec_member_t) + IPRP_FEC_MAX_SIZE)
+
+/* Worker (one per queue) */
+typedef struct {
+	int id;
+	int queue_id;
+	pthread_t thread;
+	iprp_queue_t nfq;
+} iprp_ird_worker_t;
+
+/* Version of the links seen by a worker (on its own cache line, it is written for each packet) */
+typedef struct {
+	uint32_t version __attribute__((aligned(64))); // IRD_LINKS_OFFLINE between packets
+} iprp_ird_reader_t;
 
 /* Thread routines */
+void handle_init(int nb_workers);
 void* handle_routine(void* arg);
 void* si_routine(void* arg);
 
+/* Link table structures (open addressing, linear probing) */
+typedef struct {
+	uint64_t hash;
+	void *elem;
+} iprp_ird_slot_t;
+
+typedef struct iprp_ird_slots iprp_ird_slots_t;
+struct iprp_ird_slots {
+	size_t size; // Power of two
+	iprp_ird_slots_t *next; // Next retired slots
+	iprp_ird_slot_t slots[];
+};
+
+// The workers look up the tables without locking, while one thread at a time modifies them
+typedef struct {
+	iprp_ird_slots_t *slots;
+	size_t count; // Elements in the slots
+	size_t used; // Slots with an element or a removed element
+	// Slots being copied to the current ones after a growth (NULL if none)
+	iprp_ird_slots_t *old_slots;
+	size_t migrated;
+	uint32_t version; // Number of growths, lookups that raced with one are retried
+	iprp_ird_slots_t *retired; // Slots not used anymore, freed once no worker reads them
+} iprp_ird_table_t;
+
+typedef bool (*table_match_t)(void *elem, const void *key);
+
+/* Link table functions */
+void table_init(iprp_ird_table_t *table);
+void *table_get(iprp_ird_table_t *table, uint64_t hash, table_match_t match, const void *key);
+void table_put(iprp_ird_table_t *table, uint64_t hash, void *elem);
+void table_remove(iprp_ird_table_t *table, uint64_t hash, void *elem);
+iprp_ird_slots_t *table_retired(iprp_ird_table_t *table);
+void table_free(iprp_ird_slots_t *slots);
+uint64_t hash_bytes(const void *data, size_t size);
+
+/* Path statistics structures */
+typedef struct {
+	uint32_t seq_nb;
+	uint64_t time; // us
+} iprp_ird_arrival_t;
+
+typedef struct {
+	uint32_t addr; // Source address of the copies
+	uint32_t received;
+	uint64_t total_delay; // Lag behind the first copies (us)
+} iprp_ird_path_t;
+
+/* Forward error correction structures */
+typedef struct {
+	uint32_t seq_nb;
+	uint16_t size;
+	char data[IPRP_FEC_MAX_SIZE];
+} iprp_ird_fec_packet_t;
+
+typedef struct {
+	size_t size; // 0 if the slot is free
+	char data[IRD_FEC_PARITY_SIZE];
+} iprp_ird_parity_t;
+
+typedef struct {
+	iprp_ird_fec_packet_t packets[IRD_FEC_PACKETS];
+	iprp_ird_parity_t parities[IRD_FEC_PARITIES];
+	int next_parity; // Slot replaced when all are in use
+	unsigned long recovered;
+} iprp_ird_fec_t;
+
 /* Receiver link structure */
 typedef struct {
 	// Info (fixed) vars
 	struct in_addr src_addr;
 	uint16_t src_port;
 	unsigned char snsid[20];
-	// State (variable) vars
-	uint32_t list_sn[IPRP_DD_MAX_LOST_PACKETS];
+	uint16_t dest_port;
+#ifndef IPRP_MULTICAST
+	struct in_addr dest_addr;
+#endif
+	// Compact headers (the link is found from the flow ID and the source address of the path)
+	uint16_t flow_id;
+	uint32_t path_addrs[IPRP_MAX_INDS];
+	int nb_path_addrs;
+	// State (variable) vars, updated by the workers without locking
+	uint64_t window[IPRP_DD_WORDS]; // Block of 32 sequence numbers of each word: block number (high half), received packets (low half), 256 bytes in all
 	uint32_t high_sn;
 	time_t last_seen;
+	pthread_mutex_t mutex; // New paths and parity recovery
+	bool expired; // Removed from the tables, freed once no worker uses it
+	// Path statistics (since the last time they were stored)
+	uint32_t period_sn; // Highest sequence number when the period started
+	iprp_ird_path_t paths[IPRP_MAX_INDS];
+	int nb_paths;
+	iprp_ird_arrival_t arrivals[IRD_ARRIVALS];
+	// Forward error correction (once the link sends protected packets)
+	iprp_ird_fec_t *fec;
 } iprp_receiver_link_t;
 
+/* Handling functions */
+bool split_frame(struct iphdr *ip_header, iprp_receiver_link_t *link, char **payload, size_t *payload_size);
+void deliver_datagram(struct iphdr *ip_header, iprp_receiver_link_t *link, char *datagram, size_t size);
+bool is_fresh_packet(uint32_t seq_nb, iprp_receiver_link_t *link);
+bool is_received(uint32_t seq_nb, iprp_receiver_link_t *link);
+
+/* Forward error correction functions */
+void fec_store(struct iphdr *ip_header, iprp_receiver_link_t *link, uint32_t seq_nb, char *payload, size_t payload_size);
+void fec_parity(struct iphdr *ip_header, iprp_receiver_link_t *link, char *payload, size_t payload_size);
+
 #ifdef IPRP_MULTICAST
  /* SSM-specific structures */
  #ifndef MCAST_JOIN_SOURCE_GROUP
@@ -8,23 +8,392 @@
 #define __IPRP_ISD_
 
 #include <stdbool.h>
+#include <time.h>
 #include <pthread.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
 
 #include "global.h"
 #include "peerbase.h"
 
 #define IPRP_T_ISD_ALLOW 2
+#define IPRP_ISD_BATCH_SIZE 64
+#define IPRP_ISD_POOL_SIZE 64
+#define IPRP_ISD_MAX_WORKERS 16
+#define IPRP_T_ISD_STATS 10
+#define IPRP_PB_OFFLINE 0
+#define IPRP_PB_SYNC_USEC 100
+#define IPRP_ISD_RING_SIZE 64 // Power of two
+#define IPRP_ISD_URING_DEPTH 256
+#define IPRP_ISD_GSO_SEGMENTS 64 // Kernel limit of segments per send
+#define IPRP_ISD_GSO_MAX_SIZE 1472 // Largest coalesced datagram (must fit the path MTU once segmented)
+#define IPRP_MAX_UDP_PAYLOAD 65507
+#define IPRP_ISD_RAW_MAX_SIZE 1472 // Largest copy sent on raw sockets (bigger copies need fragmentation)
+#define IPRP_IP_DF 0x4000 // Don't fragment flag
+#define IPRP_ISD_XDP_FRAMES 4096
+#define IPRP_ISD_XDP_FRAME_SIZE 2048
+#define IPRP_ISD_XDP_RING 1024 // Power of two
+#define IPRP_ISD_XDP_NEIGHBOURS 16
+#define IPRP_T_ISD_NEIGHBOUR 10 // Neighbour entries are read again from the ARP table after 10 seconds
+#define IPRP_ISD_BPF_OBJECT "bin/isd_tc.o"
+#define IPRP_ISD_LINK_FIRST 8 // Compact headers carry the link description in the first packets of a flow
+#define IPRP_ISD_LINK_PERIOD 64 // and then once every 64 packets
+#define IPRP_ISD_TXTIME_LEAD 200000 // Nanoseconds between the handling of a packet and the departure of its copies
+#define IPRP_ISD_TXTIME_SAMPLE 20000000 // Nanoseconds between two packets whose departure is measured
+#define IPRP_ISD_TXTIME_TRACK 1024 // Power of two
+#define IPRP_ISD_AGG_FLOWS 8 // Frames open at the same time in a worker
+#define IPRP_ISD_AGG_BUFS 16 // Frame buffers of a worker (sent frames keep theirs until their copies are sent)
+#define IPRP_ISD_AGG_MAX_PAYLOAD 256 // Largest payload held in a frame
+#define IPRP_ISD_AGG_MAX_SIZE 1400 // Largest frame payload (fits the path MTU with the headers)
+#define IPRP_ISD_FEC_FLOWS 8 // Parity groups open at the same time in a worker
+#define IPRP_ISD_FEC_BUFS 16 // Parity buffers of a worker
+#define IPRP_ISD_FEC_HOLD 5000000 // Nanoseconds before the parity packet of an incomplete group is sent
+
+/* Transmit engines (selected at startup with -e) */
+typedef enum {
+	IPRP_ENGINE_BATCH, // "batch": the workers send the copies of all paths with sendmmsg
+	IPRP_ENGINE_PATHS, // "paths": the workers hand the copies to one transmit thread per interface
+	IPRP_ENGINE_URING, // "uring": the workers submit the copies to their io_uring
+	IPRP_ENGINE_RAW, // "raw": the workers send the copies with their IP and UDP headers on raw sockets
+	IPRP_ENGINE_XDP, // "xdp": like paths, the transmit threads write the copies to an AF_XDP socket
+	IPRP_ENGINE_BPF, // "bpf": a tc program replicates the packets in the kernel, the ISD only fills its maps
+} iprp_isd_engine_t;
+
+#define IPRP_ENGINE_THREADED(engine) ((engine) == IPRP_ENGINE_PATHS || (engine) == IPRP_ENGINE_XDP)
+
+/* IP and UDP headers of a copy sent on a raw socket (28 bytes, no padding) */
+typedef struct {
+	struct iphdr ip;
+	struct udphdr udp;
+} iprp_ipudp_t;
+
+/* iPRP header sent in front of the payload (full, or compact if all receivers of the flow support it) */
+typedef union {
+	iprp_header_t full;
+	struct {
+		iprp_compact_header_t header;
+		iprp_compact_link_t link; // Only sent with IPRP_COMPACT_LINK
+	}__attribute__((packed)) compact;
+} iprp_isd_header_t;
+
+/* Flow table snapshot (immutable once published) */
+typedef struct {
+	uint32_t version;
+	int nb_flows;
+	int16_t flow_index[IPRP_MAX_FLOWS + 1]; // Index of each flow ID in the table (-1 if unknown)
+	iprp_peerbase_t flows[IPRP_MAX_FLOWS];
+	iprp_isd_header_t templates[IPRP_MAX_FLOWS]; // iPRP header of each flow
+	bool compact[IPRP_MAX_FLOWS]; // The flow uses the compact header
+	iprp_ipudp_t raw_templates[IPRP_MAX_FLOWS][IPRP_MAX_INDS]; // IP and UDP headers of each flow and path (raw engine)
+} iprp_isd_snapshot_t;
 
 /* ISD structure */
 typedef struct {
-	iprp_peerbase_t base;
+	// Double-buffered flow table: the workers read the current snapshot without locking,
+	// the peerbase routine fills the other one and publishes it by swapping the pointer
+	iprp_isd_snapshot_t snapshots[2];
+	iprp_isd_snapshot_t *current;
+	uint32_t version; // Version of the current snapshot
+	uint32_t reader_versions[IPRP_ISD_MAX_WORKERS]; // Version seen by each worker (IPRP_PB_OFFLINE between packets)
+	int nb_readers;
+	// Flow state kept across snapshots
+	uint32_t seq_nbs[IPRP_MAX_FLOWS + 1]; // Sequence number of the next packet of each flow ID
+	// First load signaling
 	pthread_mutex_t mutex;
 	pthread_cond_t cond;
 	bool loaded;
 } iprp_isd_peerbase_t;
 
+/* Packet buffer (NFQueue receive buffer and the iPRP header sent in front of its payload) */
+typedef struct {
+	iprp_isd_header_t header;
+	size_t header_size; // Bytes of the header that are sent
+	uint64_t txtime; // Departure time of the copies (SO_TXTIME, monotonic clock)
+	bool sampled; // The departure of the copies is measured
+	char data[IPRP_PKTBUF_SIZE];
+	uint32_t refs; // Copies not sent yet
+} iprp_pktbuf_t;
+
+/* Packet buffer pool (one per handling thread, no allocation once created) */
+typedef struct {
+	iprp_pktbuf_t bufs[IPRP_ISD_POOL_SIZE];
+	unsigned int next; // Buffers are reused in order, as their copies are sent
+	// Usage counters
+	unsigned int high_water;
+	unsigned long gets;
+	unsigned long exhausted;
+} iprp_pktbuf_pool_t;
+
+/* Pool functions */
+iprp_pktbuf_pool_t *pool_create();
+iprp_pktbuf_t *pool_next(iprp_pktbuf_pool_t *pool);
+void pool_take(iprp_pktbuf_pool_t *pool, uint32_t refs);
+void pool_release(iprp_pktbuf_t *buf);
+void pool_log(iprp_pktbuf_pool_t *pool, int worker_id);
+
+/* Departure tracking of a send socket (SO_TXTIME) */
+typedef struct {
+	int socket;
+	pthread_mutex_t mutex; // Held while sending, so that timestamp IDs follow the order of the samples
+	uint32_t next_id; // Timestamp ID of the next measured message
+	struct {
+		uint32_t id;
+		iprp_ind_t ind;
+		uint64_t txtime;
+	} samples[IPRP_ISD_TXTIME_TRACK]; // Measured messages waiting for their timestamp
+	unsigned long missed; // Copies dropped for missing their departure time
+} iprp_isd_txtrack_t;
+
+/* Departure of the measured copies of a path, after their departure time */
+typedef struct {
+	unsigned long samples;
+	int64_t total_delay; // Nanoseconds
+	int64_t max_delay;
+} iprp_isd_departure_t;
+
+/* Send batch (copies waiting to be sent with a single sendmmsg on a socket) */
+typedef struct {
+	int socket;
+	bool gso; // Coalesce consecutive copies of the same size and destination in one message
+	bool raw; // Copies carry their IP and UDP headers
+	uint16_t ip_id; // Identification of the next raw copy
+	unsigned int count; // Messages
+	unsigned int nb_copies; // Copies (several per message with GSO)
+	struct mmsghdr msgs[IPRP_ISD_BATCH_SIZE];
+	struct sockaddr_in addrs[IPRP_ISD_BATCH_SIZE];
+	size_t sizes[IPRP_ISD_BATCH_SIZE]; // Size of the datagrams of each message
+	char controls[IPRP_ISD_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t)) + CMSG_SPACE(sizeof(uint64_t)) + CMSG_SPACE(sizeof(uint32_t))]; // GSO segment size, departure time and timestamp request
+	struct iovec iovs[3 * IPRP_ISD_BATCH_SIZE]; // IP and UDP headers (raw only), iPRP header and payload of each copy, in order
+	iprp_ipudp_t ipudp[IPRP_ISD_BATCH_SIZE];
+	iprp_pktbuf_t *bufs[IPRP_ISD_BATCH_SIZE]; // Released once sent
+	// Departure times (SO_TXTIME) of each message, if tracked
+	iprp_isd_txtrack_t *track;
+	uint64_t txtimes[IPRP_ISD_BATCH_SIZE];
+	bool sampled[IPRP_ISD_BATCH_SIZE];
+	iprp_ind_t inds[IPRP_ISD_BATCH_SIZE];
+} iprp_isd_batch_t;
+
+/* Send functions */
+void batch_init(iprp_isd_batch_t *batch, int socket, bool gso, bool raw);
+int batch_add(iprp_isd_batch_t *batch, iprp_ind_t ind, iprp_pktbuf_t *buf, char *payload, size_t payload_size, struct sockaddr_in *addr, iprp_ipudp_t *raw_template);
+
+/* Departure time functions */
+int txtime_setup(iprp_isd_txtrack_t *track, int socket);
+void txtime_qdisc(iprp_iface_t *iface);
+uint64_t txtime_now();
+void txtime_sent(iprp_isd_txtrack_t *track, iprp_isd_batch_t *batch, unsigned int count);
+void txtime_collect(iprp_isd_txtrack_t *track);
+void txtime_log();
+
+/* Raw socket functions */
+void raw_template(iprp_ipudp_t *template, struct in_addr src_addr, struct in_addr dest_addr);
+void raw_fill(iprp_ipudp_t *ipudp, iprp_ipudp_t *template, size_t size, uint16_t id);
+int batch_flush(iprp_isd_batch_t *batch);
+
+/* Copy handed to a transmit thread */
+typedef struct {
+	iprp_pktbuf_t *buf;
+	char *payload;
+	size_t payload_size;
+	struct sockaddr_in addr;
+	iprp_ipudp_t ipudp; // IP and UDP headers template (xdp engine)
+} iprp_isd_copy_t;
+
+/* Transmit ring (single producer: a worker, single consumer: the transmit thread of a path) */
+typedef struct {
+	iprp_isd_copy_t copies[IPRP_ISD_RING_SIZE];
+	uint32_t head __attribute__((aligned(64))); // Next slot written by the worker
+	uint32_t tail __attribute__((aligned(64))); // Next slot read by the transmit thread
+} iprp_isd_ring_t;
+
+/* Ethernet address of a neighbour (read from the ARP table) */
+typedef struct {
+	uint32_t addr;
+	bool known;
+	unsigned char mac[6];
+	time_t checked;
+} iprp_isd_neighbour_t;
+
+/* Interface and neighbour functions */
+int iface_lookup(struct in_addr addr, char *ifname, unsigned char *mac, unsigned int *mtu);
+bool neigh_lookup(const char *ifname, uint32_t addr, unsigned char *mac);
+
+/* AF_XDP socket of a path (transmit only, copy mode) */
+typedef struct {
+	int fd;
+	char ifname[IF_NAMESIZE];
+	unsigned char mac[6];
+	// Frames (UMEM) not used by the kernel
+	char *umem;
+	uint64_t free_frames[IPRP_ISD_XDP_FRAMES];
+	unsigned int nb_free;
+	// Transmit ring (shared with the kernel)
+	uint32_t *tx_producer;
+	uint32_t *tx_consumer;
+	struct xdp_desc *tx_descs;
+	// Completion ring (shared with the kernel)
+	uint32_t *cq_producer;
+	uint32_t *cq_consumer;
+	uint64_t *cq_addrs;
+	uint16_t ip_id; // Identification of the next copy
+	// Next hops
+	iprp_isd_neighbour_t neighbours[IPRP_ISD_XDP_NEIGHBOURS];
+	int nb_neighbours;
+	// Copies sent through the UDP socket instead (unknown neighbour, full ring, too big)
+	unsigned long fallbacks;
+} iprp_isd_xsk_t;
+
+/* AF_XDP functions */
+int xsk_setup(iprp_isd_xsk_t *xsk, struct in_addr addr);
+bool xsk_send(iprp_isd_xsk_t *xsk, iprp_isd_copy_t *copy);
+void xsk_kick(iprp_isd_xsk_t *xsk);
+
+/* Path (transmit thread of one interface) */
+typedef struct {
+	iprp_ind_t ind;
+	bool started;
+	pthread_t thread;
+	int socket;
+	iprp_isd_xsk_t *xsk; // Used first if set (xdp engine)
+	iprp_isd_ring_t *rings; // One ring per worker
+	// Wakeup of the idle thread
+	int event_fd;
+	bool sleeping;
+	// Drop accounting
+	unsigned long sent;
+	unsigned long ring_drops; // Ring full (counted by the workers)
+	unsigned long send_drops; // Socket buffer full or send error
+} iprp_isd_path_t;
+
+/* Transmit thread functions */
+void tx_start(iprp_isd_path_t *path, iprp_iface_t *iface);
+bool tx_push(iprp_isd_path_t *path, int worker_id, iprp_isd_copy_t *copy);
+void tx_kick();
+
+/* io_uring of a worker (one send request per copy, on the registered sockets) */
+typedef struct {
+	int fd;
+	// Submission queue (shared with the kernel)
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned int pending; // Requests written but not submitted yet
+	// Completion queue (shared with the kernel)
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+	// Copies in flight (the kernel reads their message until completion)
+	struct msghdr msgs[IPRP_ISD_URING_DEPTH];
+	struct iovec iovs[IPRP_ISD_URING_DEPTH][2];
+	struct sockaddr_in addrs[IPRP_ISD_URING_DEPTH];
+	iprp_pktbuf_t *bufs[IPRP_ISD_URING_DEPTH];
+	unsigned int free_slots[IPRP_ISD_URING_DEPTH];
+	unsigned int nb_free;
+	// Completion counters
+	unsigned long sent;
+	unsigned long errors;
+} iprp_isd_uring_t;
+
+/* io_uring functions */
+int uring_setup(iprp_isd_uring_t *ring, int *sockets, int nb_sockets);
+int uring_add(iprp_isd_uring_t *ring, iprp_ind_t ind, iprp_pktbuf_t *buf, char *payload, size_t payload_size, struct sockaddr_in *addr);
+int uring_submit(iprp_isd_uring_t *ring, bool wait);
+
+/* tc program functions (bpf engine) */
+void bpf_attach(iprp_iface_t *iface);
+bool bpf_publish(iprp_isd_snapshot_t *snapshot);
+void bpf_reset_seq(uint16_t flow_id);
+void bpf_log();
+
+/* Frame of a flow, holding small payloads until it is full or its hold time is over */
+typedef struct {
+	uint16_t flow_id;
+	iprp_pktbuf_t *buf; // The datagrams are written in the data of the buffer
+	size_t size;
+	uint64_t deadline; // Monotonic clock (nanoseconds)
+} iprp_isd_frame_t;
+
+/* Aggregation frames of a worker */
+typedef struct {
+	iprp_pktbuf_t bufs[IPRP_ISD_AGG_BUFS];
+	iprp_isd_frame_t frames[IPRP_ISD_AGG_FLOWS];
+	int nb_frames;
+	// Counters
+	unsigned long payloads;
+	unsigned long sent;
+} iprp_isd_aggregator_t;
+
+/* Parity group of a flow (forward error correction) */
+typedef struct {
+	uint16_t flow_id;
+	iprp_pktbuf_t *buf; // The parity packet is written in the data of the buffer
+	size_t size; // Longest payload of the group
+	uint64_t deadline; // Monotonic clock (nanoseconds)
+} iprp_isd_group_t;
+
+/* Parity groups of a worker */
+typedef struct {
+	iprp_pktbuf_t bufs[IPRP_ISD_FEC_BUFS];
+	iprp_isd_group_t groups[IPRP_ISD_FEC_FLOWS];
+	int nb_groups;
+	uint8_t next_paths[IPRP_MAX_FLOWS + 1]; // Path of the next packet of each flow ID (round robin)
+	// Counters
+	unsigned long packets;
+	unsigned long parities;
+} iprp_isd_fec_t;
+
+/* Worker (handling thread of one queue of the balanced range) */
+typedef struct {
+	int id;
+	uint16_t queue_id;
+	pthread_t thread;
+	iprp_queue_t nfq;
+	// Pending copies (one batch per outgoing socket) and their buffers
+	iprp_isd_batch_t batches[IPRP_MAX_INDS];
+	iprp_isd_batch_t raw_batches[IPRP_MAX_INDS];
+	iprp_isd_uring_t *uring;
+	iprp_pktbuf_pool_t *pool;
+	iprp_pktbuf_t *current_buf; // Buffer receiving the packet being handled
+	uint64_t last_sample; // Departure time of the last measured packet
+	iprp_isd_aggregator_t *aggregator; // If aggregation is enabled
+	iprp_isd_fec_t *fec; // Once a flow is protected by parity packets
+} iprp_isd_worker_t;
+
+/* Handling functions */
+size_t packet_payload(struct nfq_data *packet, char* *payload);
+void header_fill(iprp_isd_worker_t *worker, iprp_pktbuf_t *pktbuf, iprp_isd_snapshot_t *snapshot, int flow);
+void packet_verdict(iprp_isd_worker_t *worker, struct nfq_data *packet, uint16_t flow_id);
+void send_packet(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_isd_snapshot_t *snapshot, int flow, char *payload, size_t payload_size);
+void queue_copies(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_isd_snapshot_t *snapshot, int flow, iprp_ind_bitmap_t inds, char *payload, size_t payload_size);
+void flush_copies(iprp_isd_worker_t *worker);
+void wait_copies(iprp_isd_worker_t *worker);
+iprp_pktbuf_t *spare_buf(iprp_isd_worker_t *worker, iprp_pktbuf_t *bufs, int nb_bufs);
+uint64_t clock_ns(clockid_t clock);
+
+/* Aggregation functions */
+iprp_isd_aggregator_t *aggregator_create();
+bool aggregate_add(iprp_isd_worker_t *worker, struct nfq_data *packet, iprp_isd_snapshot_t *snapshot, int flow);
+uint64_t aggregate_expire(iprp_isd_worker_t *worker, uint64_t now, bool *sent);
+void aggregate_log(iprp_isd_aggregator_t *aggregator, int worker_id);
+
+/* Forward error correction functions */
+bool fec_protects(iprp_peerbase_t *base, size_t payload_size);
+void fec_send(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_isd_snapshot_t *snapshot, int flow, char *payload, size_t payload_size);
+uint64_t fec_expire(iprp_isd_worker_t *worker, uint64_t now, bool *sent);
+void fec_log(iprp_isd_fec_t *fec, int worker_id);
+
+/* Peerbase functions */
+iprp_isd_snapshot_t *pb_enter(int reader);
+void pb_leave(int reader);
+
 /* Threads routines */
 void* pb_routine(void* arg);
 void* handle_routine(void *arg);
+void* tx_routine(void *arg);
 
 #endif /* __IPRP_ISD_ */
\ No newline at end of file
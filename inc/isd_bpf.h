@@ -0,0 +1,48 @@
+/**\file isd_bpf.h
+ * Maps shared by the ISD and its tc sender program
+ *
+ * Only kernel types are used, so that the program can include this header.
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+
+#ifndef __IPRP_ISD_BPF_
+#define __IPRP_ISD_BPF_
+
+#include <linux/types.h>
+
+#define IPRP_BPF_MAX_FLOWS 1024 // IPRP_MAX_FLOWS
+#define IPRP_BPF_MAX_PATHS 16 // IPRP_MAX_INDS
+#define IPRP_BPF_HEADER_MAX 256 // Power of two, bigger than the iPRP header
+#define IPRP_BPF_PIN_PATH "/sys/fs/bpf/tc/globals/"
+
+/* Statistics (indices in the stats map) */
+enum {
+	IPRP_BPF_REPLICATED, // Packets sent as iPRP copies
+	IPRP_BPF_PASSED, // Marked packets sent unchanged (GSO or too big for a path)
+	IPRP_BPF_NB_STATS
+};
+
+/* Path of a flow (addresses in network order) */
+struct iprp_bpf_path {
+	__u32 ifindex;
+	__u32 saddr;
+	__u32 daddr;
+	__u8 smac[6];
+	__u8 dmac[6];
+};
+
+/* Flow (value of the flows map, keyed by the packet mark) */
+struct iprp_bpf_flow {
+	__u32 flow_id; // Index in the sequence numbers map
+	__u32 nb_paths;
+	__u32 mtu; // Smallest MTU of the paths
+	__u32 allow_period; // Seconds between two packets sent unchanged as well (multicast, 0 for none)
+	__u16 dest_port; // iPRP data port (network order)
+	__u16 header_size;
+	__u16 seq_offset; // Offset of the sequence number in the header
+	__u8 header[IPRP_BPF_HEADER_MAX]; // iPRP header template
+	struct iprp_bpf_path paths[IPRP_BPF_MAX_PATHS];
+};
+
+#endif /* __IPRP_ISD_BPF_ */
\ No newline at end of file
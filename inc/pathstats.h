@@ -0,0 +1,47 @@
+/**\file pathstats.h
+ * Header file for path statistics file-related stuff
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+
+#ifndef __IPRP_PATHSTATS_
+#define __IPRP_PATHSTATS_
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "global.h"
+
+#define IPRP_PS_FILE "files/pathstats.iprp"
+
+/**
+ The path statistics file is the communication medium between the IRD and ICD.
+ The IRD measures the loss and delay of each path of the links it receives, and stores them periodically.
+ The ICD sends the statistics of each sender in its CAP messages, so that the sender can leave out the paths it does not need.
+*/
+
+/* Statistics of one path of a link, over the last period */
+typedef struct {
+	struct in_addr path_addr; // Source address of the copies (interface of the sender)
+	uint32_t packets; // Packets sent on the link (from the sequence numbers)
+	uint32_t received; // Copies received on the path
+	uint32_t delay; // Mean lag of the copies behind the first copy of their packet (us)
+} iprp_path_stats_t;
+
+/* Entry structure */
+typedef struct {
+	// Link information
+	struct in_addr src_addr;
+	uint16_t src_port;
+	uint16_t dest_port;
+
+	// Paths information
+	int nb_paths;
+	iprp_path_stats_t paths[IPRP_MAX_INDS];
+} iprp_link_stats_t;
+
+/* Disk functions */
+void pathstats_store(const char* path, const int count, const iprp_link_stats_t* links);
+int pathstats_load(const char *path, int* count, iprp_link_stats_t** links);
+
+#endif /* __IPRP_PATHSTATS_ */
\ No newline at end of file
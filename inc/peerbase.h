@@ -9,28 +9,36 @@
 
 #include "global.h"
 
-#define IPRP_PEERBASE_PATH_LENGTH 57
+#define IPRP_PB_FILE "files/peerbases.iprp"
 #define IPRP_T_PB_CACHE 3
+#define IPRP_MAX_FLOWS 1024
+#define IPRP_FLOW_MARK 0x1a000000 // Packet mark of iPRP flows (the flow ID is in the lower bits)
+#define IPRP_FLOW_MARK_MASK 0xffff0000
+#define IPRP_FLOW_ID_MASK 0x0000ffff
 
 /**
- The peerbase is the medium of communication between the ICD and the ISDs.
- Each instance of the ISD has its own peerbase.
- The ICD writes the information it gets from the CAP messages it receives into the peerbase.
- The ISD reads this data and configures its outgoing interfaces accordingly.
+ The peerbase is the medium of communication between the ICD and the ISD.
+ There is one peerbase per iPRP flow, identified by its flow ID.
+ The ICD writes the information it gets from the CAP messages it receives into the peerbases.
+ It marks the packets of each flow with the flow ID, and stores all the peerbases in a single file.
+ The ISD reads this data and configures the outgoing interfaces of each flow accordingly.
 */
 
 /* Peerbase structure */
 typedef struct {
+	uint16_t flow_id;
 	iprp_link_t link;
 	iprp_host_t host;
 	iprp_ind_bitmap_t inds;
 #ifndef IPRP_MULTICAST
 	struct in_addr dest_addr[IPRP_MAX_INDS];
 #endif
+	iprp_version_t version; // Data header understood by all receivers
+	uint8_t fec_group; // Packets per parity packet (0 to duplicate the packets)
 } iprp_peerbase_t;
 
 /* Disk functions */
-int peerbase_store(const char* path, iprp_peerbase_t *base);
-int peerbase_load(const char* path, iprp_peerbase_t *base);
+void peerbases_store(const char* path, const int count, const iprp_peerbase_t* bases);
+int peerbases_load(const char* path, int* count, iprp_peerbase_t** bases);
 
 #endif /* __IPRP_SENDER_ */
\ No newline at end of file
@@ -0,0 +1,202 @@
+/**\file bpf/isd_tc.c
+ * tc egress sender program (bpf engine of the ISD)
+ *
+ * The program replaces the ISD for the flows configured in its maps: it inserts the iPRP header of the flow
+ * in marked packets and clones them to each path, so that the packets never go through userspace.
+ * The maps are pinned by name when tc loads the program, the ISD fills them from the peerbases.
+ *
+ * Build with: clang -O2 -g -target bpf -mcpu=v3 -I inc/ -c src/bpf/isd_tc.c -o bin/isd_tc.o
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "isd_bpf.h"
+
+/* Program definitions (no libbpf needed) */
+#define SEC(name) __attribute__((section(name), used))
+#define __uint(name, val) int (*name)[val]
+#define __type(name, val) typeof(val) *name
+#define LIBBPF_PIN_BY_NAME 1
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+ #define bpf_htons(x) __builtin_bswap16(x)
+#else
+ #define bpf_htons(x) (x)
+#endif
+#define bpf_ntohs(x) bpf_htons(x)
+
+static void *(*bpf_map_lookup_elem)(void *map, const void *key) = (void *) BPF_FUNC_map_lookup_elem;
+static long (*bpf_skb_load_bytes)(const void *skb, __u32 offset, void *to, __u32 len) = (void *) BPF_FUNC_skb_load_bytes;
+static long (*bpf_skb_store_bytes)(void *skb, __u32 offset, const void *from, __u32 len, __u64 flags) = (void *) BPF_FUNC_skb_store_bytes;
+static long (*bpf_skb_adjust_room)(void *skb, __s32 len_diff, __u32 mode, __u64 flags) = (void *) BPF_FUNC_skb_adjust_room;
+static long (*bpf_clone_redirect)(void *skb, __u32 ifindex, __u64 flags) = (void *) BPF_FUNC_clone_redirect;
+static __u64 (*bpf_ktime_get_ns)(void) = (void *) BPF_FUNC_ktime_get_ns;
+
+/* Flows, keyed by packet mark */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__uint(max_entries, IPRP_BPF_MAX_FLOWS);
+	__type(key, __u32);
+	__type(value, struct iprp_bpf_flow);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} iprp_flows SEC(".maps");
+
+/* Sequence number of the next packet of each flow ID */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, IPRP_BPF_MAX_FLOWS + 1);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} iprp_seq_nbs SEC(".maps");
+
+/* Time at which the last packet of each flow ID was sent unchanged (multicast) */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, IPRP_BPF_MAX_FLOWS + 1);
+	__type(key, __u32);
+	__type(value, __u64);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} iprp_allowed SEC(".maps");
+
+/* Statistics */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, IPRP_BPF_NB_STATS);
+	__type(key, __u32);
+	__type(value, __u64);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} iprp_stats SEC(".maps");
+
+char _license[] SEC("license") = "GPL";
+
+/**
+ Increments the given statistic
+*/
+static __always_inline void count(__u32 stat) {
+	__u64 *value = bpf_map_lookup_elem(&iprp_stats, &stat);
+	if (value) {
+		__sync_fetch_and_add(value, 1);
+	}
+}
+
+/**
+ Computes the checksum of an IP header without options
+*/
+static __always_inline __u16 ip_checksum(struct iphdr *header) {
+	__u32 checksum = 0;
+	__u16 *halfwords = (__u16 *) header;
+
+	#pragma unroll
+	for (int i = 0; i < sizeof(struct iphdr) / 2; ++i) {
+		checksum += halfwords[i];
+	}
+	checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	checksum = (checksum & 0xFFFF) + (checksum >> 16);
+
+	return (__u16) ~checksum;
+}
+
+/**
+ Sends the copies of a marked packet
+
+ The iPRP header of the flow is inserted between the UDP header and the payload, with the next sequence number of the flow.
+ For each path, the addresses are then rewritten and the packet is cloned to the interface of the path.
+ The original packet is dropped. Packets of unknown flows, GSO packets and packets too big for the paths are left unchanged.
+*/
+SEC("tc")
+int iprp_send(struct __sk_buff *skb) {
+	// Find flow
+	__u32 mark = skb->mark;
+	struct iprp_bpf_flow *flow = bpf_map_lookup_elem(&iprp_flows, &mark);
+	if (!flow || flow->nb_paths == 0) {
+		return TC_ACT_OK;
+	}
+
+	// Get headers (UDP over IP without options)
+	struct iphdr ip;
+	struct udphdr udp;
+	if (skb->protocol != bpf_htons(ETH_P_IP)
+		|| bpf_skb_load_bytes(skb, ETH_HLEN, &ip, sizeof(ip))
+		|| ip.ihl != 5 || ip.protocol != IPPROTO_UDP
+		|| bpf_skb_load_bytes(skb, ETH_HLEN + sizeof(ip), &udp, sizeof(udp))) {
+		return TC_ACT_OK;
+	}
+
+	__u32 header_size = flow->header_size;
+	if (header_size == 0 || header_size >= IPRP_BPF_HEADER_MAX) {
+		return TC_ACT_OK;
+	}
+	if (skb->gso_segs > 1 || skb->len - ETH_HLEN + header_size > flow->mtu) {
+		count(IPRP_BPF_PASSED);
+		return TC_ACT_OK;
+	}
+
+	// Get sequence number (0 is never used)
+	__u32 flow_id = flow->flow_id;
+	__u32 *next_seq = bpf_map_lookup_elem(&iprp_seq_nbs, &flow_id);
+	if (!next_seq) {
+		return TC_ACT_OK;
+	}
+	__u32 seq = __sync_fetch_and_add(next_seq, 1);
+	if (seq == 0) {
+		seq = __sync_fetch_and_add(next_seq, 1);
+	}
+
+	// Copies go out unmarked, so that they are not replicated again on the egress of their interface
+	skb->mark = 0;
+
+	// Let the packet through unchanged from time to time if needed (like the verdict of the NFQueue ISD)
+	if (flow->allow_period) {
+		__u64 now = bpf_ktime_get_ns();
+		__u64 *allowed = bpf_map_lookup_elem(&iprp_allowed, &flow_id);
+		if (allowed && now - *allowed >= (__u64) flow->allow_period * 1000000000ULL) {
+			*allowed = now;
+			bpf_clone_redirect(skb, skb->ifindex, 0);
+		}
+	}
+
+	// Make room after the IP header, and write the UDP header followed by the iPRP header in it
+	if (bpf_skb_adjust_room(skb, header_size, BPF_ADJ_ROOM_NET, 0)) {
+		return TC_ACT_OK;
+	}
+	__u32 offset = ETH_HLEN + sizeof(struct iphdr);
+	udp.dest = flow->dest_port;
+	udp.len = bpf_htons(bpf_ntohs(udp.len) + header_size);
+	udp.check = 0;
+	if (bpf_skb_store_bytes(skb, offset, &udp, sizeof(udp), 0)
+		|| bpf_skb_store_bytes(skb, offset + sizeof(udp), flow->header, header_size, 0)
+		|| bpf_skb_store_bytes(skb, offset + sizeof(udp) + (flow->seq_offset & (IPRP_BPF_HEADER_MAX - 1)), &seq, sizeof(seq), 0)) {
+		return TC_ACT_SHOT;
+	}
+	ip.tot_len = bpf_htons(bpf_ntohs(ip.tot_len) + header_size);
+
+	// Send copies
+	#pragma unroll
+	for (int i = 0; i < IPRP_BPF_MAX_PATHS; ++i) {
+		if (i >= flow->nb_paths) {
+			break;
+		}
+		struct iprp_bpf_path *path = &flow->paths[i];
+
+		ip.saddr = path->saddr;
+		ip.daddr = path->daddr;
+		ip.check = 0;
+		ip.check = ip_checksum(&ip);
+		if (bpf_skb_store_bytes(skb, ETH_HLEN, &ip, sizeof(ip), 0)
+			|| bpf_skb_store_bytes(skb, 0, path->dmac, ETH_ALEN, 0)
+			|| bpf_skb_store_bytes(skb, ETH_ALEN, path->smac, ETH_ALEN, 0)) {
+			return TC_ACT_SHOT;
+		}
+		bpf_clone_redirect(skb, path->ifindex, 0);
+	}
+	count(IPRP_BPF_REPLICATED);
+
+	return TC_ACT_SHOT;
+}
\ No newline at end of file
@@ -7,18 +7,22 @@
 
 #include <errno.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 
 #include "icd.h"
 #include "activesenders.h"
+#include "pathstats.h"
 
 extern time_t curr_time;
 extern iprp_host_t this;
 
 /* Function prototypes */
 int get_active_senders(iprp_active_sender_t **senders);
-void send_cap(iprp_active_sender_t *sender, int socket);
+void send_cap(iprp_active_sender_t *sender, iprp_link_stats_t *stats, int socket);
+iprp_link_stats_t *find_stats(iprp_active_sender_t *sender, iprp_link_stats_t *links, int count);
 #ifdef IPRP_MULTICAST
 int backoff();
 // Function def in control.c
@@ -30,7 +34,7 @@ bool in_sender_ifaces(struct in_addr group_addr, struct in_addr src_addr);
  
  The active senders routine initializes the active sender file (to avoid reading an unexisting file).
  It then sets up a socket to send the CAP messages.
- Then periodically after a backoff period, it sends CAP messages to all active senders.
+ Then periodically after a backoff period, it sends CAP messages to all active senders, with the path statistics of the IRD.
 */
 void* as_routine(void* arg) {
 	DEBUG("In routine");
@@ -40,6 +44,10 @@ void* as_routine(void* arg) {
 	activesenders_store(IPRP_AS_FILE, 0, NULL);
 	DEBUG("Active senders list initialized");
 
+	// Initialize path statistics
+	pathstats_store(IPRP_PS_FILE, 0, NULL);
+	DEBUG("Path statistics initialized");
+
 	// Create sender socket
 	int sendcap_socket;
 	if ((sendcap_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
@@ -53,6 +61,15 @@ void* as_routine(void* arg) {
 		int count = get_active_senders(&senders);
 		DEBUG("Active senders retrieved");
 
+		// Get path statistics
+		iprp_link_stats_t *stats;
+		int nb_stats;
+		int err;
+		if ((err = pathstats_load(IPRP_PS_FILE, &nb_stats, &stats))) {
+			ERR("Unable to get path statistics", err);
+		}
+		DEBUG("Path statistics retrieved");
+
 		// Send CAP messages
 		for (int i = 0; i < count; ++i) {
 		#ifdef IPRP_MULTICAST
@@ -61,10 +78,11 @@ void* as_routine(void* arg) {
 				break;
 			}
 		#endif
-			send_cap(&senders[i], sendcap_socket);			
+			send_cap(&senders[i], find_stats(&senders[i], stats, nb_stats), sendcap_socket);
 			DEBUG("CAP sent");
 		}
 		LOG("All CAPs sent");
+		free(stats);
 
 	#ifndef IPRP_MULTICAST
 		sleep(IPRP_TCAP);
@@ -87,10 +105,24 @@ int get_active_senders(iprp_active_sender_t **senders) {
 	return count;
 }
 
+/**
+ Finds the path statistics of a given sender (NULL if none)
+*/
+iprp_link_stats_t *find_stats(iprp_active_sender_t *sender, iprp_link_stats_t *links, int count) {
+	for (int i = 0; i < count; ++i) {
+		if (links[i].src_addr.s_addr == sender->src_addr.s_addr
+			&& links[i].src_port == sender->src_port
+			&& links[i].dest_port == sender->dest_port) {
+			return &links[i];
+		}
+	}
+	return NULL;
+}
+
 /**
  Creates and sends a CAP message to a given sender
 */
-void send_cap(iprp_active_sender_t *sender, int socket) {
+void send_cap(iprp_active_sender_t *sender, iprp_link_stats_t *stats, int socket) {
 	// Create message
 	iprp_capmsg_t cap;
 	cap.iprp_version = IPRP_VERSION;
@@ -102,6 +134,11 @@ void send_cap(iprp_active_sender_t *sender, int socket) {
 	cap.inds = ind_match(&this, -1);
 	cap.src_port = sender->src_port;
 	cap.dest_port = sender->dest_port;
+	cap.nb_paths = 0;
+	if (stats) {
+		cap.nb_paths = stats->nb_paths;
+		memcpy(cap.paths, stats->paths, sizeof(cap.paths));
+	}
 
 	// Create message wrapper
 	iprp_ctlmsg_t msg;
@@ -41,8 +41,9 @@ int socket_setup();
 iprp_icd_base_t *peerbase_query(iprp_capmsg_t *msg);
 iprp_icd_base_t *create_base(iprp_capmsg_t *msg, struct in_addr *src, iprp_ind_bitmap_t matching_inds);
 void snsid(iprp_link_t *link);
-uint16_t get_queue_number();
-pid_t isd_startup();
+uint16_t get_flow_id();
+uint8_t get_fec_group(uint16_t dest_port);
+void version_update(iprp_icd_base_t *base, iprp_capmsg_t *msg, struct in_addr *source);
 
 /**
  Dispatch incoming control messages
@@ -94,7 +95,8 @@ void* control_routine(void *arg) {
 /**
  Handle incoming CAP messages
 
- For each received CAP message, the handler updates or creates the corresponding peerbase.
+ For each received CAP message, the handler updates or creates the corresponding peerbase,
+ and chooses the paths of the flow from the statistics of the receiver.
  It then sends an ACK message in response.
 */
 void handle_cap(iprp_capmsg_t *msg, struct in_addr *source) {
@@ -106,8 +108,14 @@ void handle_cap(iprp_capmsg_t *msg, struct in_addr *source) {
 		// The link is present in the peer base
 		DEBUG("Receiver found in peer base");
 		
-		// Update the peerbase
+		// Update the peerbase (new paths are used at once if all the paths are in use)
+		bool all_inds = (base->active_inds == base->inds);
 		base->inds |= ind_match(&this, msg->inds);
+		if (all_inds) {
+			base->active_inds = base->inds;
+		}
+		version_update(base, msg, source);
+		subset_update(base, msg);
 		base->last_cap = curr_time;
 		DEBUG("Peer base updated");
 	} else {
@@ -119,11 +127,12 @@ void handle_cap(iprp_capmsg_t *msg, struct in_addr *source) {
 		if ((matching_inds = ind_match(&this, msg->inds)) != 0) {
 			DEBUG("IND matching successful");
 
-			// Create sender link structure
+			// Create sender link structure (refused if all the flow IDs are in use)
 			base = create_base(msg, source, matching_inds);
-
-			list_append(&peerbases, base);
-			DEBUG("Link inserted into peer base");
+			if (base) {
+				list_append(&peerbases, base);
+				DEBUG("Link inserted into peer base");
+			}
 		}
 	}
 
@@ -296,8 +305,16 @@ iprp_sender_ifaces_t *create_sender_ifaces(iprp_ackmsg_t *msg) {
 
 /**
  Creates the peerbase for the given CAP message
+
+ Returns NULL if there is no flow ID left for it.
 */
 iprp_icd_base_t *create_base(iprp_capmsg_t *msg, struct in_addr *src, iprp_ind_bitmap_t matching_inds) {
+	uint16_t flow_id = get_flow_id();
+	if (!flow_id) {
+		LOG("No flow ID left, flow to port %d refused", msg->dest_port);
+		return NULL;
+	}
+
 	iprp_icd_base_t *base = malloc(sizeof(iprp_icd_base_t));
 	if (!base) {
 		ERR("Unable to allocate ICD base", errno);
@@ -311,6 +328,7 @@ iprp_icd_base_t *create_base(iprp_capmsg_t *msg, struct in_addr *src, iprp_ind_b
 	snsid(link);
 
 	base->inds = matching_inds;
+	base->active_inds = matching_inds;
 	printf("Bye\n");
 #ifndef IPRP_MULTICAST
 	printf("Hello\n");
@@ -319,47 +337,125 @@ iprp_icd_base_t *create_base(iprp_capmsg_t *msg, struct in_addr *src, iprp_ind_b
 		base->dest_addr[msg->receiver.ifaces[i].ind] = msg->receiver.ifaces[i].addr;
 	}
 #endif
-	base->isd_pid = -1;
-	base->queue_id = get_queue_number();
+	base->fec_group = get_fec_group(msg->dest_port);
+	base->flow_id = flow_id;
+	base->version = IPRP_VERSION;
+	base->nb_receivers = 0;
+	version_update(base, msg, src);
+	base->marked = false;
 	base->last_cap = curr_time;
 
 	return base;
 }
 
+/**
+ Records the version announced in a CAP message, and sets the version of the flow to the lowest one of its receivers
+
+ Receivers not heard from for IPRP_PB_TEXP seconds are forgotten, so that the version goes back up once
+ the receivers announce a higher one again.
+*/
+void version_update(iprp_icd_base_t *base, iprp_capmsg_t *msg, struct in_addr *source) {
+	iprp_icd_receiver_t *receiver = NULL;
+	for (int i = 0; i < base->nb_receivers; ) {
+		iprp_icd_receiver_t *current = &base->receivers[i];
+		if (curr_time - current->last_cap > IPRP_PB_TEXP) {
+			*current = base->receivers[--base->nb_receivers];
+			continue;
+		}
+		if (current->addr.s_addr == source->s_addr) {
+			receiver = current;
+		}
+		++i;
+	}
+
+	if (!receiver) {
+		if (base->nb_receivers < IPRP_ICD_MAX_RECEIVERS) {
+			receiver = &base->receivers[base->nb_receivers++];
+		} else {
+			receiver = &base->receivers[0];
+			for (int i = 1; i < base->nb_receivers; ++i) {
+				if (base->receivers[i].last_cap < receiver->last_cap) {
+					receiver = &base->receivers[i];
+				}
+			}
+		}
+		receiver->addr = *source;
+	}
+	receiver->version = msg->iprp_version;
+	receiver->last_cap = curr_time;
+
+	iprp_version_t version = IPRP_VERSION;
+	for (int i = 0; i < base->nb_receivers; ++i) {
+		if (base->receivers[i].version < version) {
+			version = base->receivers[i].version;
+		}
+	}
+	if (version != base->version) {
+		LOG("Flow %u: version %u", base->flow_id, version);
+	}
+	base->version = version;
+}
+
 /**
  Fills in the SNSID for a given link
 */
 void snsid(iprp_link_t *link) {
-	for (int i = 0; i < 16/sizeof(link->src_addr); ++i) {
-		memcpy(&link->snsid[4*i], &link->src_addr, sizeof(link->src_addr));
-	}
-	memcpy(&link->snsid[16], &link->src_port, sizeof(link->src_port));
-	memcpy(&link->snsid[18], &reboot_counter, sizeof(reboot_counter));
+	snsid_fill((unsigned char *) link->snsid, link->src_addr, link->src_port, reboot_counter);
 	reboot_counter++;
 }
 
 /**
- Returns an unused netfilter queue number
+ Returns an unused flow ID (between 1 and IPRP_MAX_FLOWS), or 0 if they are all in use
+
+ The search starts from a random ID, so that a reused ID is unlikely to match a flow that just expired.
 */
-uint16_t get_queue_number() {
-	bool ok = false;
-	uint16_t num;
+uint16_t get_flow_id() {
+	bool used[IPRP_MAX_FLOWS + 1] = { false };
+	list_elem_t *iterator = peerbases.head;
+	while(iterator) {
+		iprp_icd_base_t *base = iterator->elem;
+		if (base->flow_id >= 1 && base->flow_id <= IPRP_MAX_FLOWS) {
+			used[base->flow_id] = true;
+		}
+		iterator = iterator->next;
+	}
 
 	srand(curr_time);
-	while(!ok) {
-		num = (uint16_t) (rand() % 1024);
-		list_elem_t *iterator = peerbases.head;
-		while(iterator) {
-			iprp_icd_base_t *base = iterator->elem;
-			if (base->queue_id == num) {
-				ok = false;
+	int start = rand() % IPRP_MAX_FLOWS;
+	for (int i = 0; i < IPRP_MAX_FLOWS; ++i) {
+		uint16_t id = (uint16_t) ((start + i) % IPRP_MAX_FLOWS) + 1;
+		if (!used[id]) {
+			return id;
+		}
+	}
+	return 0;
+}
+
+/**
+ Returns the number of packets per parity packet of the flows to the given port
+
+ The FEC file overrides the default group of some destination ports, it is optional.
+*/
+uint8_t get_fec_group(uint16_t dest_port) {
+	int group = IPRP_FEC_GROUP;
+
+	FILE *fec_file = fopen(IPRP_FEC_FILE, "r");
+	if (fec_file) {
+		unsigned short port;
+		int port_group;
+		while (fscanf(fec_file, "%hu %d", &port, &port_group) == 2) {
+			if (port == dest_port) {
+				group = port_group;
 				break;
 			}
-			iterator = iterator->next;
 		}
-
-		ok = true;
+		fclose(fec_file);
 	}
 
-	return num;
+	if (group < 0) {
+		group = 0;
+	} else if (group > IPRP_FEC_MAX_GROUP) {
+		group = IPRP_FEC_MAX_GROUP;
+	}
+	return group;
 }
\ No newline at end of file
@@ -25,11 +25,15 @@ pthread_t time_thread;
 /* Global variables */
 iprp_host_t this; /** Information about the current machine */
 
+/* Function prototypes */
+bool in_isd_queues(iprp_icd_queues_t *queues, uint16_t queue);
+bool in_ird_queues(iprp_icd_queues_t *queues, uint16_t queue);
+
 /**
  Control daemon entry point
 
  The ICD first parses the arguments given to it to create the structure representing the current host.
- It then assigns the specific receiver-side netfilter queue numbers to transmit to the IRD and IMD.
+ It then assigns the netfilter queue numbers to transmit to the IRD, IMD and ISD.
  It finally launches all the ICD routines and then waits forever.
 */
 int main(int argc, char const *argv[]) {
@@ -49,20 +53,23 @@ int main(int argc, char const *argv[]) {
 
 	// Seed random generator
 	srand(time(NULL));
-	iprp_icd_recv_queues_t recv_queues;
+	iprp_icd_queues_t queues;
 	do {
-		recv_queues.ird = rand() % 65535;
-		recv_queues.imd = rand() % 65535;
-		recv_queues.ird_imd = rand() % 65535;
-	} while (recv_queues.ird == recv_queues.imd || recv_queues.ird == recv_queues.ird_imd || recv_queues.imd == recv_queues.ird_imd);
-	DEBUG("Receiver-side queue numbers assigned");
+		queues.ird = rand() % (IPRP_MAX_QUEUE_NUMBER - IPRP_IRD_QUEUES + 1);
+		queues.imd = rand() % IPRP_MAX_QUEUE_NUMBER;
+		queues.ird_imd = rand() % IPRP_MAX_QUEUE_NUMBER;
+		queues.isd = rand() % (IPRP_MAX_QUEUE_NUMBER - IPRP_ISD_QUEUES + 1);
+	} while (queues.imd == queues.ird_imd || in_ird_queues(&queues, queues.imd) || in_ird_queues(&queues, queues.ird_imd)
+		|| in_isd_queues(&queues, queues.imd) || in_isd_queues(&queues, queues.ird_imd)
+		|| (queues.ird < queues.isd + IPRP_ISD_QUEUES && queues.isd < queues.ird + IPRP_IRD_QUEUES));
+	DEBUG("Queue numbers assigned");
 
 	if ((err = pthread_create(&time_thread, NULL, time_routine, NULL))) {
 		ERR("Unable to setup time thread", err);
 	}
 	DEBUG("Time thread setup");
 
-	if ((err = pthread_create(&ports_thread, NULL, ports_routine, &recv_queues))) {
+	if ((err = pthread_create(&ports_thread, NULL, ports_routine, &queues))) {
 		ERR("Unable to setup ports thread", err);
 	}
 	DEBUG("Ports thread setup");
@@ -80,7 +87,7 @@ int main(int argc, char const *argv[]) {
 	DEBUG("Active senders thread setup");
 
 	// Setup sendcap routine
-	if ((err = pthread_create(&pb_thread, NULL, pb_routine, NULL)) != 0) {
+	if ((err = pthread_create(&pb_thread, NULL, pb_routine, &queues)) != 0) {
 		ERR("Unable to setup peerbase thread", err);
 	}
 	DEBUG("Peerbase thread created");
@@ -100,4 +107,18 @@ int main(int argc, char const *argv[]) {
 	/* Should not reach this part */
 	LOG("Last man standing at the end of the apocalypse");
 	return EXIT_FAILURE;
+}
+
+/**
+ Returns whether the given queue number is in the ISD range
+*/
+bool in_isd_queues(iprp_icd_queues_t *queues, uint16_t queue) {
+	return queue >= queues->isd && queue < queues->isd + IPRP_ISD_QUEUES;
+}
+
+/**
+ Returns whether the given queue number is in the IRD range
+*/
+bool in_ird_queues(iprp_icd_queues_t *queues, uint16_t queue) {
+	return queue >= queues->ird && queue < queues->ird + IPRP_IRD_QUEUES;
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 
@@ -22,30 +23,47 @@ list_t peerbases;
 
 /* Function prototypes */
 void create_peerbase(iprp_peerbase_t* peerbase, iprp_icd_base_t *base);
-pid_t isd_startup(iprp_icd_base_t *base);
+void flow_rule(iprp_link_t *link, uint16_t flow_id, bool create);
+pid_t isd_startup(iprp_icd_queues_t *queues);
 
 /**
- Pushes changes to known peerbases to the ISDs
+ Pushes changes to known peerbases to the ISD
 
  The peerbase routine is executed periodically.
- It first deletes aged, inactive senders.
- It then stores the other peerbases to the disk, allowing the corresponding ISDs to update.
- If necessary, it starts the corresponding ISDs up.
+ It first deletes aged, inactive senders and the marking rules of their flows.
+ It then marks the packets of new flows and stores all peerbases to the disk, allowing the ISD to update.
+ If necessary, it starts the ISD up (a single ISD serves all flows).
 */
 void *pb_routine(void *arg) {
+	iprp_icd_queues_t *queues = (iprp_icd_queues_t *) arg;
+	pid_t isd_pid = -1;
+
 	list_init(&peerbases);
+	peerbases_store(IPRP_PB_FILE, 0, NULL);
 	DEBUG("Peerbases initialized");
 
 	while(true) {
+		list_lock(&peerbases);
+
+		// Room for the fresh peerbases and the aged ones
+		size_t size = list_size(&peerbases);
+		iprp_peerbase_t *fresh = calloc(size + 1, sizeof(iprp_peerbase_t));
+		iprp_peerbase_t *aged = calloc(size + 1, sizeof(iprp_peerbase_t));
+		bool *new_flow = calloc(size + 1, sizeof(bool));
+		if (!fresh || !aged || !new_flow) {
+			ERR("Unable to allocate peerbases", errno);
+		}
+		int nb_fresh = 0, nb_aged = 0;
+
 		list_elem_t *iterator = peerbases.head;
 		while(iterator) {
-			// Fine grain lock, as always
-			list_lock(&peerbases);
-
 			iprp_icd_base_t *base = (iprp_icd_base_t *) iterator->elem;
 
 			// Delete aged entry
 			if (curr_time - base->last_cap > IPRP_PB_TEXP) {
+				if (base->marked) {
+					create_peerbase(&aged[nb_aged++], base);
+				}
 				list_elem_t *to_delete = iterator;
 				iterator = iterator->next;
 				free(to_delete->elem);
@@ -56,36 +74,44 @@ void *pb_routine(void *arg) {
 			iterator = iterator->next;
 			DEBUG("Fresh entry");
 
-			// List stuff over, the rest doesn't need locking
-			list_unlock(&peerbases);
-
 			// Fresh entry, create peerbase
-			iprp_peerbase_t peerbase;
-			create_peerbase(&peerbase, base);
-			DEBUG("Peerbase created");
-
-			// Fresh entry, we store it on disk
-			char snsid_str[2 * IPRP_SNSID_SIZE + 1];
-			for (int i = 0; i < IPRP_SNSID_SIZE; ++i) {
-				snprintf(&snsid_str[2*i], 3, "%02x", base->link.snsid[i]);
-			}
-			char path[IPRP_PEERBASE_PATH_LENGTH];
-			snprintf(path, IPRP_PEERBASE_PATH_LENGTH, "files/base_%s.iprp", snsid_str);
-			int err;
-			if ((err = peerbase_store(path, &peerbase))) {
-				ERR("Unable to store peerbase", err);
+			new_flow[nb_fresh] = !base->marked;
+			base->marked = true;
+			create_peerbase(&fresh[nb_fresh++], base);
+		}
+
+		// List stuff over, the rest doesn't need locking
+		list_unlock(&peerbases);
+
+		// Stop marking the packets of aged flows
+		for (int i = 0; i < nb_aged; ++i) {
+			flow_rule(&aged[i].link, aged[i].flow_id, false);
+		}
+
+		// Store all peerbases on disk before marking the packets of new flows
+		peerbases_store(IPRP_PB_FILE, nb_fresh, fresh);
+		DEBUG("Peerbases stored");
+
+		for (int i = 0; i < nb_fresh; ++i) {
+			if (new_flow[i]) {
+				flow_rule(&fresh[i].link, fresh[i].flow_id, true);
+				DEBUG("Flow %u marked", fresh[i].flow_id);
 			}
-			DEBUG("Peerbase stored");
+		}
 
-			// Launch ISD
-			if (base->isd_pid == -1) {
-				if ((base->isd_pid = isd_startup(base)) == -1) {
-					ERR("Unable to start ISD", errno);
-				}
-				DEBUG("ISD started")
+		// Launch ISD
+		if (nb_fresh > 0 && isd_pid == -1) {
+			if ((isd_pid = isd_startup(queues)) == -1) {
+				ERR("Unable to start ISD", errno);
 			}
+			DEBUG("ISD started")
 		}
 
+		free(fresh);
+		free(aged);
+		free(new_flow);
+
+		LOG("Peerbases pushed");
 		sleep(IPRP_T_PB_CACHE);
 	}
 }
@@ -94,43 +120,87 @@ void *pb_routine(void *arg) {
  Fills a peerbase structure with an ICD-specific peerbase
 */
 void create_peerbase(iprp_peerbase_t* peerbase, iprp_icd_base_t *base) {
+	memset(peerbase, 0, sizeof(iprp_peerbase_t)); // Stable padding, so that the ISD only sees actual changes
+	peerbase->flow_id = base->flow_id;
 	peerbase->link = base->link;
 	peerbase->host = this;
-	peerbase->inds = base->inds;
+	peerbase->inds = base->active_inds;
 #ifndef IPRP_MULTICAST
 	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
 		peerbase->dest_addr[i] = base->dest_addr[i];
 	}
 #endif
+	peerbase->version = base->version;
+	peerbase->fec_group = base->fec_group;
 }
 
 /**
- Start an ISD for the given base
+ Creates or deletes the iptables rule marking the packets of the given flow with its flow ID
 */
-pid_t isd_startup(iprp_icd_base_t *base) {
+void flow_rule(iprp_link_t *link, uint16_t flow_id, bool create) {
+	char dest_addr[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &link->dest_addr, dest_addr, INET_ADDRSTRLEN);
+
+	// Marking rules go before the ISD queue rule
+	char shell[200];
+	snprintf(shell, 200, "iptables -t mangle -%s POSTROUTING -p udp -d %s --dport %d --sport %d -j MARK --set-mark 0x%x", create ? "I" : "D", dest_addr, link->dest_port, link->src_port, IPRP_FLOW_MARK | flow_id);
+	if (system(shell) == -1) {
+		ERR("Unable to update flow marking rule", errno);
+	}
+}
+
+/**
+ Starts the ISD
+
+ All marked packets are sent to the ISD queue range, where the ISD finds their flow from the mark.
+ With the bpf engine, there is no queue: the ISD program finds the flow from the mark at the egress of the interfaces.
+*/
+pid_t isd_startup(iprp_icd_queues_t *queues) {
 	pid_t pid = fork();
 	if (!pid) { // Child side
-		// Create NFqueue
-		char dest_addr[INET_ADDRSTRLEN];
-		inet_ntop(AF_INET, &base->link.dest_addr, dest_addr, INET_ADDRSTRLEN);
-		char shell[120];
-		snprintf(shell, 120, "iptables -t mangle -A POSTROUTING -p udp -d %s --dport %d --sport %d -j NFQUEUE --queue-num %d", dest_addr, base->link.dest_port, base->link.src_port, base->queue_id);
-		if (system(shell) == -1) {
-			ERR("Unable to create nfqueue for ISD", errno);
+		// Create NFqueue (the tc program of the bpf engine sees the marked packets directly)
+		if (strcmp(IPRP_ISD_ENGINE, "bpf")) {
+			char target[64];
+			if (IPRP_ISD_QUEUES > 1) {
+				snprintf(target, 64, "--queue-balance %d:%d%s", queues->isd, queues->isd + IPRP_ISD_QUEUES - 1, IPRP_ISD_CPU_FANOUT ? " --queue-cpu-fanout" : "");
+			} else {
+				snprintf(target, 64, "--queue-num %d", queues->isd);
+			}
+			char shell[200];
+			snprintf(shell, 200, "iptables -t mangle -A POSTROUTING -p udp -m mark --mark 0x%x/0x%x -j NFQUEUE %s", IPRP_FLOW_MARK, IPRP_FLOW_MARK_MASK, target);
+			if (system(shell) == -1) {
+				ERR("Unable to create nfqueue for ISD", errno);
+			}
+			DEBUG("NFQueue created for ISD");
 		}
-		DEBUG("NFQueue created for ISD");
 
 		// Launch sender
-		printf("Queue ID %d\n", base->queue_id);
 		char queue_id[16];
-		sprintf(queue_id, "%d", base->queue_id);
-		char snsid_str[2 * IPRP_SNSID_SIZE + 1];
-		for (int i = 0; i < IPRP_SNSID_SIZE; ++i) {
-			snprintf(&snsid_str[2*i], 3, "%02x", base->link.snsid[i]);
+		sprintf(queue_id, "%d", queues->isd);
+		char nb_queues[16];
+		sprintf(nb_queues, "%d", IPRP_ISD_QUEUES);
+		char *args[16];
+		int nb_args = 0;
+		args[nb_args++] = "isd";
+		args[nb_args++] = "-e";
+		args[nb_args++] = IPRP_ISD_ENGINE;
+		if (IPRP_ISD_GSO) {
+			args[nb_args++] = "-g";
+		}
+		if (IPRP_ISD_TXTIME) {
+			args[nb_args++] = "-t";
+		}
+		char hold[16];
+		if (IPRP_ISD_AGGREGATE_USEC > 0) {
+			sprintf(hold, "%d", IPRP_ISD_AGGREGATE_USEC);
+			args[nb_args++] = "-a";
+			args[nb_args++] = hold;
 		}
-		char base_path[IPRP_PEERBASE_PATH_LENGTH];
-		snprintf(base_path, IPRP_PEERBASE_PATH_LENGTH, "files/base_%s.iprp", snsid_str);
-		if (execl(IPRP_ISD_BINARY_LOC, "isd", queue_id, base_path, NULL) == -1) {
+		args[nb_args++] = queue_id;
+		args[nb_args++] = IPRP_PB_FILE;
+		args[nb_args++] = nb_queues;
+		args[nb_args] = NULL;
+		if (execv(IPRP_ISD_BINARY_LOC, args) == -1) {
 			ERR("Unable to launch sender deamon", errno);
 		}
 	} else {
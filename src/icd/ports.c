@@ -19,7 +19,7 @@
 size_t get_monitored_ports(uint16_t **table);
 bool find_port_in_array(uint16_t port, uint16_t* array, size_t array_size);
 bool find_port_in_list(uint16_t port, list_t *list);
-void iptables_rule(uint16_t port, uint16_t queue_num, bool create);
+void iptables_rule(uint16_t port, uint16_t queue_num, int nb_queues, bool create);
 pid_t ird_launch(uint16_t queue_num, uint16_t imd_queue_num);
 pid_t imd_launch(uint16_t queue_num, uint16_t ird_queue_num);
 void proc_shutdown(pid_t pid);
@@ -32,7 +32,7 @@ void proc_shutdown(pid_t pid);
  If needed, it then launches or shuts down the IRD and IMD.
 */
 void* ports_routine(void* arg) {
-	iprp_icd_recv_queues_t *queue_nums = (iprp_icd_recv_queues_t *) arg;
+	iprp_icd_queues_t *queue_nums = (iprp_icd_queues_t *) arg;
 	DEBUG("In routine");
 
 	// Initialize monitored ports cache
@@ -60,7 +60,7 @@ void* ports_routine(void* arg) {
 				iterator = next;
 
 				// Delete iptables rule
-				iptables_rule(port, queue_nums->imd, false);
+				iptables_rule(port, queue_nums->imd, 1, false);
 				DEBUG("Port %u deleted from list", port);
 			} else {
 				iterator = iterator->next;
@@ -76,7 +76,7 @@ void* ports_routine(void* arg) {
 				list_append(&monitored_ports, (void*) new_ports[i]);
 
 				// Create iptables rule
-				iptables_rule(new_ports[i], queue_nums->imd, true);
+				iptables_rule(new_ports[i], queue_nums->imd, 1, true);
 				DEBUG("Port %u added to list", new_ports[i]);
 			} else {
 				DEBUG("Port %u already in list", new_ports[i]);
@@ -177,11 +177,18 @@ bool find_port_in_list(uint16_t port, list_t *list) {
 }
 
 /**
- Creates or deletes an iptables rule redirecting all traffic through the given port to the given queue
+ Creates or deletes an iptables rule redirecting all traffic through the given port to the given queue range
 */
-void iptables_rule(uint16_t port, uint16_t queue_num, bool create) {
-	char buf[100];
-	snprintf(buf, 100, "sudo iptables -t mangle -%s PREROUTING -p udp --dport %d -j NFQUEUE --queue-num %d", create ? "A" : "D", port, queue_num);
+void iptables_rule(uint16_t port, uint16_t queue_num, int nb_queues, bool create) {
+	char target[32];
+	if (nb_queues > 1) {
+		uint16_t last_queue = queue_num + nb_queues - 1;
+		snprintf(target, 32, "--queue-balance %d:%d", queue_num, last_queue);
+	} else {
+		snprintf(target, 32, "--queue-num %d", queue_num);
+	}
+	char buf[128];
+	snprintf(buf, 128, "sudo iptables -t mangle -%s PREROUTING -p udp --dport %d -j NFQUEUE %s", create ? "A" : "D", port, target);
 	system(buf);
 }
 
@@ -192,7 +199,7 @@ pid_t ird_launch(uint16_t queue_num, uint16_t imd_queue_num) {
 	pid_t pid = fork();
 	if (!pid) { // Child side
 		// Create NFqueue
-		iptables_rule(IPRP_DATA_PORT, queue_num, true);
+		iptables_rule(IPRP_DATA_PORT, queue_num, IPRP_IRD_QUEUES, true);
 		DEBUG("NFQueue created for IRD");
 		
 		// Launch receiver
@@ -200,7 +207,9 @@ pid_t ird_launch(uint16_t queue_num, uint16_t imd_queue_num) {
 		sprintf(queue_id_str, "%d", queue_num);
 		char imd_queue_id_str[16];
 		sprintf(imd_queue_id_str, "%d", imd_queue_num);
-		if (execl(IPRP_IRD_BINARY_LOC, "ird", queue_id_str, imd_queue_id_str, NULL) == -1) {
+		char nb_queues_str[16];
+		sprintf(nb_queues_str, "%d", IPRP_IRD_QUEUES);
+		if (execl(IPRP_IRD_BINARY_LOC, "ird", queue_id_str, imd_queue_id_str, nb_queues_str, NULL) == -1) {
 			ERR("Unable to launch receiver deamon", errno);
 		}
 	} else {
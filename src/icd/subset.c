@@ -0,0 +1,106 @@
+/**\file icd/subset.c
+ * Path subset selection from the statistics of the receivers
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ICD_CTL
+
+#include <stdint.h>
+
+#include "icd.h"
+
+extern iprp_host_t this;
+
+/* Function prototypes */
+int path_ind(struct in_addr path_addr);
+
+/**
+ Updates the paths in use by the given flow from the statistics of a CAP message
+
+ While all the paths are in use, the least lossy ones (then the fastest ones) are kept until the loss probability
+ of their product meets the delivery target. Losses are assumed independent between the paths.
+ While a subset is in use, all the paths are enabled again at once if the subset does not meet the target anymore,
+ so that the next subset is chosen from fresh statistics of every path.
+ Statistics over too few packets are ignored. With several receivers, any of them can enable all the paths again.
+ Flows protected by parity packets keep all their paths (each packet only goes on one path).
+*/
+void subset_update(iprp_icd_base_t *base, iprp_capmsg_t *msg) {
+	if (IPRP_SUBSET_TARGET <= 0 || base->fec_group > 0) {
+		base->active_inds = base->inds;
+		return;
+	}
+
+	// Get the loss and delay of each path (paths without copies are lost)
+	double loss[IPRP_MAX_INDS];
+	uint32_t delay[IPRP_MAX_INDS];
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		loss[i] = 1.0;
+		delay[i] = UINT32_MAX;
+	}
+	uint32_t packets = 0;
+	for (int i = 0; i < msg->nb_paths && i < IPRP_MAX_INDS; ++i) {
+		iprp_path_stats_t *path = &msg->paths[i];
+		int ind = path_ind(path->path_addr);
+		if (ind < 0 || ind >= IPRP_MAX_INDS || path->packets == 0) {
+			continue;
+		}
+		loss[ind] = (path->received < path->packets) ? 1.0 - (double) path->received / path->packets : 0.0;
+		delay[ind] = path->delay;
+		if (path->packets > packets) {
+			packets = path->packets;
+		}
+	}
+	if (packets < IPRP_SUBSET_MIN_PACKETS) {
+		return;
+	}
+	double allowed = 1.0 - IPRP_SUBSET_TARGET;
+
+	if (base->active_inds != base->inds) {
+		// Check the subset in use
+		double lost = 1.0;
+		for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+			if (base->active_inds & (1 << i)) {
+				lost *= loss[i];
+			}
+		}
+		if (lost > allowed) {
+			base->active_inds = base->inds;
+			LOG("Flow %u: loss rose to %g, all paths enabled", base->flow_id, lost);
+		}
+		return;
+	}
+
+	// Add the best remaining path until the target is met
+	iprp_ind_bitmap_t subset = 0;
+	double lost = 1.0;
+	while (lost > allowed && subset != base->inds) {
+		int best = -1;
+		for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+			if (!(base->inds & (1 << i)) || (subset & (1 << i))) {
+				continue;
+			}
+			if (best == -1 || loss[i] < loss[best] || (loss[i] == loss[best] && delay[i] < delay[best])) {
+				best = i;
+			}
+		}
+		subset |= (1 << best);
+		lost *= loss[best];
+	}
+
+	if (subset != base->active_inds) {
+		base->active_inds = subset;
+		LOG("Flow %u: paths %x in use (expected loss %g)", base->flow_id, subset, lost);
+	}
+}
+
+/**
+ Returns the IND of the interface with the given address (-1 if none)
+*/
+int path_ind(struct in_addr path_addr) {
+	for (int i = 0; i < this.nb_ifaces; ++i) {
+		if (this.ifaces[i].addr.s_addr == path_addr.s_addr) {
+			return this.ifaces[i].ind;
+		}
+	}
+	return -1;
+}
\ No newline at end of file
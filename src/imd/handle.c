@@ -21,7 +21,8 @@ extern list_t active_senders;
 /* Function prototypes */
 int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data);
 int ird_handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data);
-int global_handle(struct nfq_q_handle *queue, struct nfq_data *packet, bool iprp_message);
+int global_handle(iprp_queue_t *nfq, struct nfq_data *packet, bool iprp_message);
+void handle_loop(iprp_queue_t *nfq);
 iprp_active_sender_t *activesenders_find_entry(const struct in_addr src_addr, const struct in_addr dest_addr, const uint16_t src_port, const uint16_t dest_port);
 iprp_active_sender_t *activesenders_create_entry(const struct in_addr src_addr, const struct in_addr dest_addr, const uint16_t src_port, const uint16_t dest_port, const bool iprp_enabled);
 
@@ -38,26 +39,17 @@ void* handle_routine(void* arg) {
 
 	// Setup NFQueue
 	iprp_queue_t nfq;
-	queue_setup(&nfq, queue_id, handle_packet);
+	queue_setup(&nfq, queue_id, handle_packet, &nfq, IPRP_COPY_HEADERS);
 	DEBUG("NFQueue setup (%d)", queue_id);
 
 	// Handle outgoing packets
-	while (true) {
-		// Get packet
-		int err = get_and_handle(nfq.handle, nfq.fd);
-		if (err) {
-			if (err == IPRP_ERR) {
-				ERR("Unable to retrieve packet from IMD queue", errno);
-			}
-			DEBUG("Error %d while handling packet", err);
-		}
-		DEBUG("Packet handled");
-	}
+	handle_loop(&nfq);
+	return NULL;
 }
 int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data) {
 	DEBUG("Handling packet");
 
-	return global_handle(queue, packet, false);
+	return global_handle((iprp_queue_t *) data, packet, false);
 }
 
 /**
@@ -71,26 +63,43 @@ void* ird_handle_routine(void* arg) {
 
 	// Setup NFQueue
 	iprp_queue_t nfq;
-	queue_setup(&nfq, queue_id, ird_handle_packet);
+	queue_setup(&nfq, queue_id, ird_handle_packet, &nfq, IPRP_COPY_HEADERS);
 	DEBUG("IRD NFQueue setup (%d)", queue_id);
 
 	// Handle outgoing packets
+	handle_loop(&nfq);
+	return NULL;
+}
+int ird_handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data) {
+	DEBUG("Handling packet");
+
+	return global_handle((iprp_queue_t *) data, packet, true);
+}
+
+/**
+ Handles the packets of the given queue forever
+
+ Verdicts are batched, the pending ones are sent as soon as the queue is drained.
+*/
+void handle_loop(iprp_queue_t *nfq) {
 	while (true) {
 		// Get packet
-		int err = get_and_handle(nfq.handle, nfq.fd);
+		int err = get_and_handle(nfq->handle, nfq->fd);
 		if (err) {
 			if (err == IPRP_ERR) {
-				ERR("Unable to retrieve packet from IMD-IRD queue", errno);
+				ERR("Unable to retrieve packet from IMD queue", errno);
 			}
 			DEBUG("Error %d while handling packet", err);
 		}
 		DEBUG("Packet handled");
-	}
-}
-int ird_handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data) {
-	DEBUG("Handling packet");
 
-	return global_handle(queue, packet, true);
+		// Send the pending verdicts once the queue has been drained
+		if (nfq->batch_count > 0 && queue_empty(nfq->fd)) {
+			if (verdict_flush(nfq) == -1) {
+				ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+			}
+		}
+	}
 }
 
 /**
@@ -100,8 +109,8 @@ int ird_handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, stru
  It then accepts the packet if it is an iPRP packet, or if no session is established yet.
  Otherwise it rejects the packet (if the packet is a non-iPRP packet sent from an iPRP host).
 */
-int global_handle(struct nfq_q_handle *queue, struct nfq_data *packet, bool iprp_message) {
-	// Get packet payload
+int global_handle(iprp_queue_t *nfq, struct nfq_data *packet, bool iprp_message) {
+	// Get packet payload (the IMD queues only copy the IP and UDP headers)
 	int bytes;
 	unsigned char *buf;
 	if ((bytes = nfq_get_payload(packet, &buf)) == -1) {
@@ -168,7 +177,7 @@ int global_handle(struct nfq_q_handle *queue, struct nfq_data *packet, bool iprp
 #else
 	uint32_t verdict = (iprp_message || !entry->iprp_enabled) ? NF_ACCEPT : NF_DROP;
 #endif
-	if (nfq_set_verdict(queue, ntohl(nfq_header->packet_id), verdict, bytes, buf) == -1) {
+	if (verdict_batch(nfq, ntohl(nfq_header->packet_id), verdict) == -1) {
 		ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
 	}
 	LOG((verdict == NF_ACCEPT) ? "Packet accepted" : "Packet dropped");
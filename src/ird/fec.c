@@ -0,0 +1,184 @@
+/**\file ird/fec.c
+ * Recovery of the lost packets of a link from its parity packets
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE IRD_HANDLE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "ird.h"
+
+/* Function prototypes */
+iprp_ird_fec_t *fec_get(iprp_receiver_link_t *link);
+void packet_keep(iprp_ird_fec_t *fec, uint32_t seq_nb, char *payload, size_t payload_size);
+void parities_retry(struct iphdr *ip_header, iprp_receiver_link_t *link);
+bool parity_recover(struct iphdr *ip_header, iprp_receiver_link_t *link, iprp_ird_parity_t *parity);
+void recovered_deliver(struct iphdr *ip_header, iprp_receiver_link_t *link, uint8_t flags, char *payload, size_t payload_size);
+
+/**
+ Keeps a fresh protected packet of the given link, and retries the parity packets waiting for it
+
+ Called by the workers without the link list locked (links_enter keeps the link): the recovery state of the link
+ is only used under its mutex. The packet is marked received before it is kept here, so a parity packet handled
+ meanwhile by another worker waits for it, and is retried now.
+*/
+void fec_store(struct iphdr *ip_header, iprp_receiver_link_t *link, uint32_t seq_nb, char *payload, size_t payload_size) {
+	if (payload_size > IPRP_FEC_MAX_SIZE) {
+		return;
+	}
+	pthread_mutex_lock(&link->mutex);
+	packet_keep(fec_get(link), seq_nb, payload, payload_size);
+	parities_retry(ip_header, link);
+	pthread_mutex_unlock(&link->mutex);
+}
+
+/**
+ Handles a parity packet of the given link
+
+ If a single packet of the group is missing, it is rebuilt and delivered at once. If several are missing,
+ the parity waits for more packets of the group (the oldest waiting parity is replaced when all slots are in use).
+ Called by the workers without the link list locked: the recovery state of the link is only used under its mutex.
+*/
+void fec_parity(struct iphdr *ip_header, iprp_receiver_link_t *link, char *payload, size_t payload_size) {
+	if (payload_size < sizeof(iprp_parity_header_t) || payload_size > IRD_FEC_PARITY_SIZE) {
+		LOG("Malformed parity packet dropped");
+		return;
+	}
+	pthread_mutex_lock(&link->mutex);
+	iprp_ird_fec_t *fec = fec_get(link);
+
+	iprp_ird_parity_t *parity = &fec->parities[fec->next_parity];
+	memcpy(parity->data, payload, payload_size);
+	parity->size = payload_size;
+	if (parity_recover(ip_header, link, parity)) {
+		parity->size = 0;
+		parities_retry(ip_header, link); // The rebuilt packet may complete other groups
+	} else {
+		fec->next_parity = (fec->next_parity + 1) % IRD_FEC_PARITIES;
+	}
+	pthread_mutex_unlock(&link->mutex);
+}
+
+/**
+ Returns the recovery state of the given link, allocating it on first use
+*/
+iprp_ird_fec_t *fec_get(iprp_receiver_link_t *link) {
+	if (!link->fec) {
+		if (!(link->fec = malloc(sizeof(iprp_ird_fec_t)))) {
+			ERR("Unable to allocate parity state", errno);
+		}
+		memset(link->fec, 0, sizeof(iprp_ird_fec_t));
+	}
+	return link->fec;
+}
+
+/**
+ Keeps a protected packet, in place of the oldest one
+*/
+void packet_keep(iprp_ird_fec_t *fec, uint32_t seq_nb, char *payload, size_t payload_size) {
+	iprp_ird_fec_packet_t *packet = &fec->packets[seq_nb & (IRD_FEC_PACKETS - 1)];
+	packet->seq_nb = seq_nb;
+	packet->size = payload_size;
+	memcpy(packet->data, payload, payload_size);
+}
+
+/**
+ Retries the waiting parity packets of the given link, until none of them can rebuild a packet
+*/
+void parities_retry(struct iphdr *ip_header, iprp_receiver_link_t *link) {
+	iprp_ird_fec_t *fec = link->fec;
+	bool done = false;
+	while (!done) {
+		done = true;
+		for (int i = 0; i < IRD_FEC_PARITIES; ++i) {
+			iprp_ird_parity_t *parity = &fec->parities[i];
+			if (parity->size > 0 && parity_recover(ip_header, link, parity)) {
+				parity->size = 0;
+				done = false;
+			}
+		}
+	}
+}
+
+/**
+ Rebuilds the lost packet of the group of the given parity, if possible
+
+ Returns true once the parity is not needed anymore: the group is complete, its lost packet was rebuilt,
+ or it cannot be rebuilt (malformed parity, or received packets of the group not kept anymore).
+ A received packet not kept yet is still being handled by another worker: the parity waits for it.
+*/
+bool parity_recover(struct iphdr *ip_header, iprp_receiver_link_t *link, iprp_ird_parity_t *parity) {
+	iprp_ird_fec_t *fec = link->fec;
+	iprp_parity_header_t *header = (iprp_parity_header_t *) parity->data;
+	size_t members_size = sizeof(iprp_parity_header_t) + header->nb_members * sizeof(iprp_fec_member_t);
+	if (header->nb_members == 0 || header->nb_members > IPRP_FEC_MAX_GROUP || members_size > parity->size) {
+		LOG("Malformed parity packet dropped");
+		return true;
+	}
+	char *data = parity->data + members_size;
+	size_t data_size = parity->size - members_size;
+
+	// Find the missing packet
+	iprp_fec_member_t *missing = NULL;
+	bool waiting = false;
+	for (int i = 0; i < header->nb_members; ++i) {
+		iprp_fec_member_t *member = &header->members[i];
+		if (member->size > data_size) {
+			LOG("Malformed parity packet dropped");
+			return true;
+		}
+		if (is_received(member->seq_nb, link)) {
+			iprp_ird_fec_packet_t *packet = &fec->packets[member->seq_nb & (IRD_FEC_PACKETS - 1)];
+			if ((int32_t) (packet->seq_nb - member->seq_nb) > 0) {
+				return true; // Too old, replaced by a newer packet
+			} else if (packet->seq_nb != member->seq_nb) {
+				waiting = true; // Not kept yet
+			}
+		} else if (missing) {
+			return false; // Several packets missing, wait for more
+		} else {
+			missing = member;
+		}
+	}
+	if (!missing) {
+		return true;
+	} else if (waiting) {
+		return false;
+	}
+
+	// The lost packet is the XOR of the parity and the other packets
+	for (int i = 0; i < header->nb_members; ++i) {
+		iprp_fec_member_t *member = &header->members[i];
+		if (member == missing) {
+			continue;
+		}
+		iprp_ird_fec_packet_t *packet = &fec->packets[member->seq_nb & (IRD_FEC_PACKETS - 1)];
+		size_t size = (packet->size < missing->size) ? packet->size : missing->size;
+		for (size_t j = 0; j < size; ++j) {
+			data[j] ^= packet->data[j];
+		}
+	}
+
+	if (is_fresh_packet(missing->seq_nb, link)) {
+		packet_keep(fec, missing->seq_nb, data, missing->size);
+		recovered_deliver(ip_header, link, missing->flags, data, missing->size);
+		fec->recovered++;
+		LOG("Lost packet rebuilt from parity (%lu so far)", fec->recovered);
+	}
+	return true;
+}
+
+/**
+ Delivers a rebuilt packet to the application, splitting it if it is an aggregated frame
+*/
+void recovered_deliver(struct iphdr *ip_header, iprp_receiver_link_t *link, uint8_t flags, char *payload, size_t payload_size) {
+	if ((flags & IPRP_COMPACT_AGGREGATE) && !split_frame(ip_header, link, &payload, &payload_size)) {
+		LOG("Malformed frame dropped");
+		return;
+	}
+	deliver_datagram(ip_header, link, payload, payload_size);
+}
\ No newline at end of file
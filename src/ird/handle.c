@@ -4,64 +4,105 @@
  * \author Loic Ottet (loic.ottet@epfl.ch)
  */
 #define IPRP_FILE IRD_HANDLE
+#define _POSIX_C_SOURCE 200112L // clock_gettime is not part of C99 (_DEFAULT_SOURCE would redefine the SSM structures)
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
 #include <linux/ip.h>
 #include <linux/udp.h>
 #include <pthread.h>
 
 #include "ird.h"
+#include "pathstats.h"
 
 extern time_t curr_time;
 extern int imd_queue_id;
 
-/* State information about peers */
+/* State information about peers (the list lock is taken to add, bind and remove links, the workers read them without locking) */
 list_t receiver_links;
+iprp_ird_table_t links_by_snsid; // Links by SNSID (full headers and link descriptions)
+iprp_ird_table_t links_by_path; // Links by flow ID and path source address (compact headers)
+int split_socket; // Delivers the datagrams of aggregated frames but the last one
 pthread_t cleanup_thread;
 void* cleanup_routine(void* arg);
 
+/* Links in use by the workers (the links and table slots removed are freed once no worker uses them) */
+uint32_t links_version = IRD_LINKS_OFFLINE + 1;
+iprp_ird_reader_t readers[IRD_MAX_WORKERS];
+int nb_readers;
+
 /* Function prototypes */
 int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data);
-uint16_t ip_checksum(struct iphdr *header, size_t len);
-uint16_t udp_checksum(uint16_t *packet, size_t len, uint32_t src_addr, uint32_t dest_addr);
-char *create_new_packet(struct iphdr *ip_header, struct udphdr *udp_header, iprp_header_t *iprp_header, char *payload, size_t payload_size, struct in_addr src_addr, uint16_t src_port);
-iprp_receiver_link_t *receiver_link_get(iprp_header_t *header);
-iprp_receiver_link_t *receiver_link_create(iprp_header_t *header);
-bool is_fresh_packet(iprp_header_t *packet, iprp_receiver_link_t *link);
+uint16_t checksum_add(uint16_t sum, const void *data, size_t size, size_t offset);
+uint16_t checksum_sub(uint16_t sum, const void *data, size_t size, size_t offset);
+uint16_t checksum_fold(uint64_t checksum);
+uint16_t pseudo_sum(struct iphdr *ip_header, uint16_t udp_len);
+char *create_new_packet(struct iphdr *ip_header, struct udphdr *udp_header, iprp_receiver_link_t *link, void *iprp_header, char *payload, size_t payload_size);
+void full_header_link(iprp_header_t *header, iprp_compact_link_t *info);
+iprp_receiver_link_t *receiver_link_get(unsigned char *snsid);
+iprp_receiver_link_t *receiver_link_find(uint16_t flow_id, uint32_t path_addr);
+void receiver_link_bind(iprp_receiver_link_t *packet_link, uint16_t flow_id, uint32_t path_addr);
+void receiver_link_unindex(iprp_receiver_link_t *link);
+bool snsid_match(void *elem, const void *key);
+bool path_match(void *elem, const void *key);
+uint64_t path_key(uint16_t flow_id, uint32_t path_addr);
+iprp_receiver_link_t *receiver_link_create(unsigned char *snsid, iprp_compact_link_t *info, uint32_t seq_nb);
+void path_stats_update(iprp_receiver_link_t *link, uint32_t path_addr, uint32_t seq_nb, bool fresh);
+iprp_ird_path_t *path_find(iprp_receiver_link_t *link, int nb_paths, uint32_t path_addr);
+void path_stats_store();
+void links_enter(int reader);
+void links_leave(int reader);
+void links_synchronize();
 
 /**
- Initializes the queue and dispatches the packets to the handle function
+ Initializes the state shared by the workers, and launches the cleanup routine
 */
-void* handle_routine(void* arg) {
-	intptr_t queue_id = (intptr_t) arg;
-	DEBUG("In routine");
-
-	// Setup NFQueue
-	iprp_queue_t nfq;
-	queue_setup(&nfq, queue_id, handle_packet);
-	DEBUG("NFQueue setup");
-
+void handle_init(int nb_workers) {
 	// Initialize link list
 	list_init(&receiver_links);
+	nb_readers = nb_workers;
+	table_init(&links_by_snsid);
+	table_init(&links_by_path);
 	DEBUG("Receiver links list initialized");
 
+	// Create the socket for the datagrams of frames (they are looped back to the application)
+	if ((split_socket = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1) {
+		ERR("Unable to create split socket", errno);
+	}
+	DEBUG("Split socket created");
+
 	// Launch cleanup routine
 	int err;
 	if ((err = pthread_create(&cleanup_thread, NULL, cleanup_routine, NULL))) {
 		ERR("Unable to setup cleanup thread", err);
 	}
 	DEBUG("Cleanup thread created");
+}
+
+/**
+ Initializes the queue of a worker and dispatches the packets to the handle function
+*/
+void* handle_routine(void* arg) {
+	iprp_ird_worker_t *worker = (iprp_ird_worker_t *) arg;
+	DEBUG("In routine (queue %d)", worker->queue_id);
+
+	// Setup NFQueue
+	iprp_queue_t *nfq = &worker->nfq;
+	queue_setup(nfq, worker->queue_id, handle_packet, worker, IPRP_COPY_PACKET);
+	DEBUG("NFQueue setup");
 
 	// Handle outgoing packets
 	while (true) {
 		// Get packet
-		int err = get_and_handle(nfq.handle, nfq.fd);
+		int err = get_and_handle(nfq->handle, nfq->fd);
 		if (err) {
 			if (err == IPRP_ERR) {
 				ERR("Unable to retrieve packet from IRD queue", errno);
@@ -69,6 +110,13 @@ void* handle_routine(void* arg) {
 			DEBUG("Error %d while handling packet", err);
 		}
 		DEBUG("Packet handled");
+
+		// Send the pending verdicts once the queue has been drained
+		if (nfq->batch_count > 0 && queue_empty(nfq->fd)) {
+			if (verdict_flush(nfq) == -1) {
+				ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+			}
+		}
 	}
 }
 
@@ -77,10 +125,17 @@ void* handle_routine(void* arg) {
 
  The handler first creates or updates the receiver link structure for the sender of the packet.
  It then applies the duplicate-discard algorithm to decide whether to keep the packet.
+ The copy is counted in the statistics of its path (loss and delay, reported to the sender by the ICD).
  If the packet is fresh, the handler modifies it as needed and forwards it to the application.
- Otherwise it drops it.
+ The datagrams of an aggregated frame are split: the packet carries the last one, the others are delivered separately.
+ Fresh packets protected by parity packets are kept for a while, parity packets rebuild the lost packet of their group.
+ Otherwise it drops it (drops of successive duplicates are batched).
+ Both full and compact headers are accepted: compact packets are matched to the link whose description
+ was last received with their flow ID from the same source address, and dropped if there is none yet.
 */
 int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data) {
+	iprp_ird_worker_t *worker = (iprp_ird_worker_t *) data;
+	iprp_queue_t *nfq = &worker->nfq;
 	DEBUG("Handling packet");
 
 	// Get payload
@@ -91,65 +146,148 @@ int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct n
 	}
 	DEBUG("Got payload");
 
+	// Get header
+	struct nfqnl_msg_packet_hdr *nfq_header = nfq_get_msg_packet_hdr (packet);
+	if (!nfq_header) {
+		ERR("Unable to retrieve header from received packet", IPRP_ERR_NFQUEUE);
+	}
+	DEBUG("Got header");
+
 	// Get payload headers
 	struct iphdr *ip_header = (struct iphdr *) buf;
 	struct udphdr *udp_header = (struct udphdr *) (buf + sizeof(struct iphdr));
-	iprp_header_t *iprp_header = (iprp_header_t *) (buf + sizeof(struct iphdr) + sizeof(struct udphdr));
-	char *payload = buf + sizeof(struct iphdr) + sizeof(struct udphdr) + sizeof(iprp_header_t);
-	size_t payload_size = bytes - sizeof(struct iphdr) - sizeof(struct udphdr) - sizeof(iprp_header_t);
+	unsigned char *iprp_header = buf + sizeof(struct iphdr) + sizeof(struct udphdr);
+	size_t iprp_size = bytes - sizeof(struct iphdr) - sizeof(struct udphdr);
+
+	// Read sequence number and link description (always present in full headers)
+	uint32_t seq_nb;
+	size_t header_size;
+	unsigned char compact_snsid[IPRP_SNSID_SIZE];
+	unsigned char *snsid = NULL;
+	iprp_compact_link_t info;
+	bool compact = (iprp_header[0] == IPRP_VERSION_COMPACT);
+	bool aggregate = false;
+	bool protected = false;
+	bool parity = false;
+	if (compact) {
+		iprp_compact_header_t *header = (iprp_compact_header_t *) iprp_header;
+		seq_nb = header->seq_nb;
+		header_size = sizeof(iprp_compact_header_t);
+		aggregate = (header->flags & IPRP_COMPACT_AGGREGATE);
+		protected = (header->flags & IPRP_COMPACT_FEC);
+		parity = (header->flags & IPRP_COMPACT_PARITY);
+		if (header->flags & IPRP_COMPACT_LINK) {
+			header_size += sizeof(iprp_compact_link_t);
+			memcpy(&info, header + 1, sizeof(iprp_compact_link_t));
+			snsid_fill(compact_snsid, info.src_addr, info.src_port, info.reboot);
+			snsid = compact_snsid;
+		}
+	} else {
+		iprp_header_t *header = (iprp_header_t *) iprp_header;
+		seq_nb = header->seq_nb;
+		header_size = sizeof(iprp_header_t);
+		full_header_link(header, &info);
+		snsid = header->snsid;
+	}
+	if (iprp_size < header_size) {
+		if (verdict_batch(nfq, ntohl(nfq_header->packet_id), NF_DROP) == -1) {
+			ERR("Unable to set verdict to NF_DROP", IPRP_ERR_NFQUEUE);
+		}
+		DEBUG("Truncated packet dropped");
+		return 0;
+	}
+	char *payload = (char *) iprp_header + header_size;
+	size_t payload_size = iprp_size - header_size;
 	DEBUG("Got packet headers");
 
-	// Lock the whole process to avoid concurrent cleanup work
-	list_lock(&receiver_links);
+	// Keep the links from being freed until the packet is handled
+	links_enter(worker->id);
 
 	// Find receiver link
-	iprp_receiver_link_t *packet_link = receiver_link_get(iprp_header);
+	uint16_t flow_id = ((iprp_compact_header_t *) iprp_header)->flow_id;
+	iprp_receiver_link_t *packet_link = snsid ? receiver_link_get(snsid) : receiver_link_find(flow_id, ip_header->saddr);
+	bool created = false;
+	if (!packet_link && snsid) {
+		// Unknown sender, look again with the list locked (another worker may have created the link meanwhile)
+		list_lock(&receiver_links);
+		if (!(packet_link = receiver_link_get(snsid))) {
+			DEBUG("Unknown sender");
+
+			// Create receiver link
+			packet_link = receiver_link_create(snsid, &info, seq_nb);
+			if (!packet_link) {
+				list_unlock(&receiver_links);
+				ERR("Unable to create receiver link", errno);
+			}
+			DEBUG("Receiver link created");
+
+			// Add to link list
+			list_append(&receiver_links, packet_link);
+			table_put(&links_by_snsid, hash_bytes(snsid, IPRP_SNSID_SIZE), packet_link);
+			DEBUG("Receiver link added to list");
+			created = true;
+		}
+		list_unlock(&receiver_links);
+	}
 	DEBUG("Got the packet link");
 
 	bool fresh;
-	if (!packet_link) {
-		// Unknown sender, we must create the link
-		DEBUG("Unknown sender");
-
-		// Create receiver link
-		packet_link = receiver_link_create(iprp_header);
-		if (!packet_link) {
-			list_unlock(&receiver_links);
-			ERR("Unable to create receiver link", errno);
+	if (parity && packet_link) {
+		// Parity packet, it only rebuilds the lost packet of its group (delivered separately)
+		__atomic_store_n(&packet_link->last_seen, curr_time, __ATOMIC_RELAXED);
+		fec_parity(ip_header, packet_link, payload, payload_size);
+		links_leave(worker->id);
+		if (verdict_batch(nfq, ntohl(nfq_header->packet_id), NF_DROP) == -1) {
+			ERR("Unable to set verdict to NF_DROP", IPRP_ERR_NFQUEUE);
 		}
-		DEBUG("Receiver link created");
-
-		// Add to link list
-		list_append(&receiver_links, packet_link);
-		DEBUG("Receiver link added to list");
-
+		DEBUG("Parity packet handled");
+		return 0;
+	} else if (!packet_link && !snsid) {
+		// Compact header of a flow whose description was not received yet, the link is unknown
+		links_leave(worker->id);
+		if (verdict_batch(nfq, ntohl(nfq_header->packet_id), NF_DROP) == -1) {
+			ERR("Unable to set verdict to NF_DROP", IPRP_ERR_NFQUEUE);
+		}
+		LOG("Packet of unknown compact flow dropped");
+		return 0;
+	} else if (created) {
 		// As it is the first packet we see from this receiver, it is always fresh
 		fresh = true;
 	} else {
 		// Known sender, we apply the duplicate-discard algorithm
 		DEBUG("Known sender");
 
-		// Update the link and decide to keep or drop the packet
-		packet_link->last_seen = curr_time;
-		fresh = is_fresh_packet(iprp_header, packet_link);
+		// Update the link and decide to keep or drop the packet (copies of the packet may be handled by other workers)
+		__atomic_store_n(&packet_link->last_seen, curr_time, __ATOMIC_RELAXED);
+		fresh = is_fresh_packet(seq_nb, packet_link);
 	}
 
-	// The work on the link list is over now, we can allow cleanup work to resume
-	list_unlock(&receiver_links);
-	DEBUG("List unlocked");
-	
-	// Get header
-	struct nfqnl_msg_packet_hdr *nfq_header = nfq_get_msg_packet_hdr (packet);
-	if (!nfq_header) {
-		ERR("Unable to retrieve header from received packet", IPRP_ERR_NFQUEUE);
+	// Measure the path of the copy
+	path_stats_update(packet_link, ip_header->saddr, seq_nb, fresh);
+
+	// Keep the protected packets until their parity is received (before the iPRP header is overwritten)
+	if (fresh && protected) {
+		fec_store(ip_header, packet_link, seq_nb, payload, payload_size);
 	}
-	DEBUG("Got header");
 
-	if (fresh) {
+	// Remember the flow ID of the link for the next compact headers from this path (with the list locked if it changed)
+	if (compact && snsid && receiver_link_find(flow_id, ip_header->saddr) != packet_link) {
+		list_lock(&receiver_links);
+		receiver_link_bind(packet_link, flow_id, ip_header->saddr);
+		list_unlock(&receiver_links);
+	}
+
+	if (fresh && aggregate && !split_frame(ip_header, packet_link, &payload, &payload_size)) {
+		// Frame without any complete datagram
+		if (verdict_batch(nfq, ntohl(nfq_header->packet_id), NF_DROP) == -1) {
+			ERR("Unable to set verdict to NF_DROP", IPRP_ERR_NFQUEUE);
+		}
+		LOG("Malformed frame dropped");
+	} else if (fresh) {
 		// Fresh packet, tranfer to application
 		DEBUG("Fresh packet received");
 
-		char *new_packet = create_new_packet(ip_header, udp_header, iprp_header, payload, payload_size, packet_link->src_addr, packet_link->src_port);
+		char *new_packet = create_new_packet(ip_header, udp_header, packet_link, iprp_header, payload, payload_size);
 		size_t new_packet_size = payload_size + sizeof(struct iphdr) + sizeof(struct udphdr);
 		DEBUG("Packet ready to forward");
 
@@ -166,7 +304,7 @@ int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct n
 		DEBUG("Duplicate packet received");
 		
 		// Drop packet
-		if (nfq_set_verdict(queue, ntohl(nfq_header->packet_id), NF_DROP, bytes, buf) == -1) {
+		if (verdict_batch(nfq, ntohl(nfq_header->packet_id), NF_DROP) == -1) {
 			ERR("Unable to set verdict to NF_DROP", IPRP_ERR_NFQUEUE);
 		}
 		DEBUG("Packet dropped");
@@ -174,224 +312,588 @@ int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct n
 		LOG("Duplicate packet dropped");
 	}
 
+	// The work on the link is over now, it can be freed if it expired
+	links_leave(worker->id);
+
 	return 0;
 }
 
+/**
+ Splits an aggregated frame into its datagrams
+
+ The datagrams but the last one are delivered at once, in order. The payload is then set to the last one,
+ which the packet carries to the application. Returns false if the frame has no complete datagram.
+*/
+bool split_frame(struct iphdr *ip_header, iprp_receiver_link_t *link, char **payload, size_t *payload_size) {
+	char *frame = *payload;
+	size_t frame_size = *payload_size;
+	bool found = false;
+
+	size_t offset = 0;
+	while (offset + sizeof(uint16_t) <= frame_size) {
+		uint16_t size;
+		memcpy(&size, frame + offset, sizeof(uint16_t));
+		size = ntohs(size);
+		char *datagram = frame + offset + sizeof(uint16_t);
+		offset += sizeof(uint16_t) + size;
+		if (offset > frame_size) {
+			break; // Truncated datagram
+		}
+
+		if (found) {
+			deliver_datagram(ip_header, link, *payload, *payload_size);
+		}
+		*payload = datagram;
+		*payload_size = size;
+		found = true;
+	}
+
+	return found;
+}
+
+/**
+ Sends a datagram of a frame to the application, as if it came directly from the sender
+
+ The datagram is sent on a raw socket to the local destination address, so that it is looped back.
+ The kernel fills in the IP checksum. The UDP checksum is left out, as it would take a pass over the datagram.
+*/
+void deliver_datagram(struct iphdr *ip_header, iprp_receiver_link_t *link, char *datagram, size_t size) {
+	char packet[sizeof(struct iphdr) + sizeof(struct udphdr) + IPRP_PKTBUF_SIZE];
+	if (size > IPRP_PKTBUF_SIZE) {
+		return;
+	}
+	struct iphdr *ip = (struct iphdr *) packet;
+	struct udphdr *udp = (struct udphdr *) (packet + sizeof(struct iphdr));
+
+	*ip = *ip_header;
+	ip->ihl = sizeof(struct iphdr) / 4;
+	ip->saddr = link->src_addr.s_addr;
+#ifndef IPRP_MULTICAST
+	ip->daddr = link->dest_addr.s_addr;
+#endif
+	ip->tot_len = htons(sizeof(struct iphdr) + sizeof(struct udphdr) + size);
+	ip->id = 0;
+	ip->check = 0;
+
+	udp->source = htons(link->src_port);
+	udp->dest = htons(link->dest_port);
+	udp->len = htons(sizeof(struct udphdr) + size);
+	udp->check = 0;
+	memcpy(packet + sizeof(struct iphdr) + sizeof(struct udphdr), datagram, size);
+
+	struct sockaddr_in addr;
+	struct in_addr dest_addr = { ip->daddr };
+	sockaddr_fill(&addr, dest_addr, 0);
+	if (sendto(split_socket, packet, ntohs(ip->tot_len), 0, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		DEBUG("Unable to deliver datagram (%d)", errno);
+	}
+}
+
 /**
  Creates the packet to be forwarded to the application
+
+ Both checksums are updated from the received ones (RFC 1624) instead of being computed again.
+ The IP checksum only depends on the changed fields. The UDP checksum of the sender also covers the iPRP header
+ and the other datagrams of the frame: the sum of the payload is found by removing them, along with the old headers,
+ so that the payload is never read. The UDP checksum is left out if the sender did not compute one.
+ The packet is returned from its new start: the headers are moved right before the payload, which is not copied.
 */
-char *create_new_packet(struct iphdr *ip_header, struct udphdr *udp_header, iprp_header_t *iprp_header, char *payload, size_t payload_size, struct in_addr src_addr, uint16_t src_port) {
+char *create_new_packet(struct iphdr *ip_header, struct udphdr *udp_header, iprp_receiver_link_t *link, void *iprp_header, char *payload, size_t payload_size) {
+	struct iphdr old_ip = *ip_header;
+	struct udphdr old_udp = *udp_header;
+
 	// Modify IP header
-	ip_header->saddr = src_addr.s_addr;
+	ip_header->saddr = link->src_addr.s_addr;
 #ifndef IPRP_MULTICAST // No need to change destination address in multicast
-	ip_header->daddr = iprp_header->dest_addr.s_addr;
+	ip_header->daddr = link->dest_addr.s_addr;
 #endif
 	ip_header->tot_len = htons(payload_size + sizeof(struct iphdr) + sizeof(struct udphdr));
-	ip_header->check = 0;
-	ip_header->check = ip_checksum(ip_header, sizeof(struct iphdr));
+	uint16_t sum = ~ntohs(old_ip.check);
+	sum = checksum_sub(sum, &old_ip.tot_len, sizeof(uint16_t), 0);
+	sum = checksum_add(sum, &ip_header->tot_len, sizeof(uint16_t), 0);
+	sum = checksum_sub(sum, &old_ip.saddr, 2 * sizeof(uint32_t), 0);
+	sum = checksum_add(sum, &ip_header->saddr, 2 * sizeof(uint32_t), 0);
+	ip_header->check = htons(~sum);
 
 	// Modify UDP headers
-	udp_header->dest = htons(iprp_header->dest_port);
-	udp_header->source = htons(src_port);
+	udp_header->dest = htons(link->dest_port);
+	udp_header->source = htons(link->src_port);
 	udp_header->len = htons(payload_size + sizeof(struct udphdr));
-	udp_header->check = 0;
-	//udp_header->check = udp_checksum((uint16_t *) udp_header, bytes - sizeof(struct iphdr), ip_header->saddr, ip_header->daddr);
+	if (old_udp.check) {
+		// Sum of the payload at its old offset (datagrams after it are truncated)
+		size_t offset = sizeof(struct udphdr) + (payload - (char *) iprp_header);
+		size_t old_size = ntohs(old_udp.len);
+		sum = ~ntohs(old_udp.check);
+		sum = checksum_sub(sum, &old_udp, offsetof(struct udphdr, check), 0);
+		sum = checksum_sub(sum, iprp_header, offset - sizeof(struct udphdr), sizeof(struct udphdr));
+		if (old_size > offset + payload_size) {
+			sum = checksum_sub(sum, payload + payload_size, old_size - offset - payload_size, offset + payload_size);
+		}
+		sum = checksum_fold(sum + (uint16_t) ~pseudo_sum(&old_ip, old_udp.len));
+		if (offset % 2) {
+			sum = (sum << 8) | (sum >> 8); // The bytes of the words of the payload were swapped
+		}
 
-	// Move payload over IPRP header
-	memmove(iprp_header, payload, payload_size);
-	
-	return (char *) ip_header;
+		// Sum of the new datagram
+		sum = checksum_add(sum, udp_header, offsetof(struct udphdr, check), 0);
+		sum = checksum_fold(sum + pseudo_sum(ip_header, udp_header->len));
+		uint16_t check = ~sum;
+		udp_header->check = htons(check ? check : 0xFFFF); // Zero means no checksum
+	}
+
+	// Move the headers over the iPRP header (and the datagrams before the payload), the payload stays in place
+	char *packet = payload - sizeof(struct iphdr) - sizeof(struct udphdr);
+	memmove(packet, ip_header, sizeof(struct iphdr) + sizeof(struct udphdr));
+
+	return packet;
 }
 
 /**
- Look for the SNSID of the given IPRP header in the list of links
+ Reads the link description contained in a full header
 */
-iprp_receiver_link_t *receiver_link_get(iprp_header_t *header) {
-	iprp_receiver_link_t *packet_link = NULL;
+void full_header_link(iprp_header_t *header, iprp_compact_link_t *info) {
+	memcpy(&info->src_addr, &header->snsid, sizeof(struct in_addr));
+	memcpy(&info->src_port, &header->snsid[16], sizeof(uint16_t));
+	memcpy(&info->reboot, &header->snsid[18], sizeof(uint16_t));
+	info->dest_port = header->dest_port;
+#ifndef IPRP_MULTICAST
+	info->dest_addr = header->dest_addr;
+#endif
+}
 
-	// Look for SNSID in known receiver links
-	list_elem_t *iterator = receiver_links.head;
-	while(iterator != NULL) {
-		// Compare SNSIDs
-		iprp_receiver_link_t *link = (iprp_receiver_link_t *) iterator->elem;
-		bool same = true;
-		for (int i = 0; i < IPRP_SNSID_SIZE; ++i) {
-			if (link->snsid[i] != header->snsid[i]) {
-				same = false;
+/**
+ Look for the given SNSID in the links
+*/
+iprp_receiver_link_t *receiver_link_get(unsigned char *snsid) {
+	return table_get(&links_by_snsid, hash_bytes(snsid, IPRP_SNSID_SIZE), snsid_match, snsid);
+}
+
+/**
+ Look for the link of a compact header in the links
+*/
+iprp_receiver_link_t *receiver_link_find(uint16_t flow_id, uint32_t path_addr) {
+	uint64_t key = path_key(flow_id, path_addr);
+	return table_get(&links_by_path, key, path_match, &key);
+}
+
+/**
+ Associates the given flow ID and path source address to a link
+
+ The path address is removed from the link it was associated to before (flow IDs are reused by the senders).
+*/
+void receiver_link_bind(iprp_receiver_link_t *packet_link, uint16_t flow_id, uint32_t path_addr) {
+	if (packet_link->expired) {
+		return; // Removed by the cleanup routine while its packet was handled
+	}
+	uint64_t key = path_key(flow_id, path_addr);
+	iprp_receiver_link_t *link = table_get(&links_by_path, key, path_match, &key);
+	if (link == packet_link) {
+		return;
+	}
+
+	if (link) {
+		for (int i = 0; i < link->nb_path_addrs; ++i) {
+			if (link->path_addrs[i] == path_addr) {
+				link->path_addrs[i] = link->path_addrs[--link->nb_path_addrs];
 				break;
 			}
 		}
+		table_remove(&links_by_path, key, link);
+	}
 
-		// Found the link
-		if (same) {
-			packet_link = link;
-			break;
+	if (packet_link->flow_id != flow_id) {
+		for (int i = 0; i < packet_link->nb_path_addrs; ++i) {
+			table_remove(&links_by_path, path_key(packet_link->flow_id, packet_link->path_addrs[i]), packet_link);
 		}
+		packet_link->flow_id = flow_id;
+		packet_link->nb_path_addrs = 0;
+	}
+	if (packet_link->nb_path_addrs < IPRP_MAX_INDS) {
+		packet_link->path_addrs[packet_link->nb_path_addrs++] = path_addr;
+		table_put(&links_by_path, key, packet_link);
+	}
+}
 
-		iterator = iterator->next;
+/**
+ Removes a link from the link tables
+*/
+void receiver_link_unindex(iprp_receiver_link_t *link) {
+	table_remove(&links_by_snsid, hash_bytes(link->snsid, IPRP_SNSID_SIZE), link);
+	for (int i = 0; i < link->nb_path_addrs; ++i) {
+		table_remove(&links_by_path, path_key(link->flow_id, link->path_addrs[i]), link);
 	}
+}
 
-	return packet_link;
+/**
+ Returns whether the given link has the given SNSID
+*/
+bool snsid_match(void *elem, const void *key) {
+	return memcmp(((iprp_receiver_link_t *) elem)->snsid, key, IPRP_SNSID_SIZE) == 0;
 }
 
 /**
- Create a receiver link structure with the given IPRP header.
+ Returns whether the given link is associated to the given path key
 */
-iprp_receiver_link_t *receiver_link_create(iprp_header_t *header) {
+bool path_match(void *elem, const void *key) {
+	iprp_receiver_link_t *link = (iprp_receiver_link_t *) elem;
+	uint64_t path = *((const uint64_t *) key);
+	if (link->flow_id != (uint16_t) (path >> 32)) {
+		return false;
+	}
+	for (int i = 0; i < link->nb_path_addrs; ++i) {
+		if (link->path_addrs[i] == (uint32_t) path) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ Returns the key of a path in the link table of compact headers
+*/
+uint64_t path_key(uint16_t flow_id, uint32_t path_addr) {
+	return ((uint64_t) flow_id << 32) | path_addr;
+}
+
+/**
+ Create a receiver link structure with the given SNSID and link description.
+*/
+iprp_receiver_link_t *receiver_link_create(unsigned char *snsid, iprp_compact_link_t *info, uint32_t seq_nb) {
 	iprp_receiver_link_t *packet_link = malloc(sizeof(iprp_receiver_link_t));
 	if (!packet_link) {
 		return NULL;
 	}
 
-	memcpy(&packet_link->src_addr, &header->snsid, sizeof(struct in_addr));
-	memcpy(&packet_link->src_port, &header->snsid[16], sizeof(uint16_t));
+	packet_link->src_addr = info->src_addr;
+	packet_link->src_port = info->src_port;
 	//packet_link->src_addr.s_addr = ntohl(packet_link->src_addr.s_addr);
 	//packet_link->src_port = ntohs(packet_link->src_port);
-	memcpy(&packet_link->snsid, &header->snsid, 20);
-
-	for (int i = 0; i < IPRP_DD_MAX_LOST_PACKETS; ++i) {
-		packet_link->list_sn[i] = 0;
+	memcpy(&packet_link->snsid, snsid, IPRP_SNSID_SIZE);
+	packet_link->dest_port = info->dest_port;
+#ifndef IPRP_MULTICAST
+	packet_link->dest_addr = info->dest_addr;
+#endif
+	packet_link->flow_id = 0;
+	packet_link->nb_path_addrs = 0;
+
+	// Packets before the first one are not delivered
+	uint32_t first = seq_nb / 32;
+	for (int i = 0; i < IPRP_DD_WORDS; ++i) {
+		uint32_t back = (first % IPRP_DD_WORDS + IPRP_DD_WORDS - i) % IPRP_DD_WORDS;
+		if (first < back) {
+			packet_link->window[i] = 0;
+		} else if (back == 0) {
+			packet_link->window[i] = ((uint64_t) first << 32) | ((2ULL << (seq_nb % 32)) - 1);
+		} else {
+			packet_link->window[i] = ((uint64_t) (first - back) << 32) | 0xFFFFFFFF;
+		}
 	}
-	packet_link->high_sn = header->seq_nb;
+	packet_link->high_sn = seq_nb;
 	packet_link->last_seen = curr_time;
+	pthread_mutex_init(&packet_link->mutex, NULL);
+	packet_link->expired = false;
+
+	packet_link->period_sn = seq_nb - 1;
+	packet_link->nb_paths = 0;
+	memset(packet_link->arrivals, 0, sizeof(packet_link->arrivals));
+	packet_link->fec = NULL;
 
 	return packet_link;
 }
 
 /**
  Duplicate-discard algorithm
+
+ The sequence numbers are grouped in blocks of 32, each word of the window holds the received packets of one block,
+ tagged with its block number. A packet is recorded with a compare-and-swap on its word, which also takes the word over
+ from an older block, so the workers handling the copies of a packet agree on a single fresh one without locking.
+ The window covers the last IPRP_DD_WORDS blocks: between 993 and 1024 sequence numbers below the highest one.
 */
-bool is_fresh_packet(iprp_header_t *packet, iprp_receiver_link_t *link) {
-	if (packet->seq_nb == link->high_sn) {
-		// Duplicate packet
+bool is_fresh_packet(uint32_t seq_nb, iprp_receiver_link_t *link) {
+	uint32_t high_sn = __atomic_load_n(&link->high_sn, __ATOMIC_ACQUIRE);
+	uint32_t block = seq_nb / 32;
+	if (seq_nb < high_sn && high_sn / 32 - block >= IPRP_DD_WORDS) {
+		printf("Very Late Packet\n");
 		return false;
+	}
+
+	// Record the packet in the word of its block
+	uint64_t *word = &link->window[block % IPRP_DD_WORDS];
+	uint64_t bit = (uint64_t) 1 << (seq_nb % 32);
+	uint64_t old = __atomic_load_n(word, __ATOMIC_ACQUIRE);
+	uint64_t new;
+	do {
+		uint32_t tag = old >> 32;
+		if (tag > block || (tag == block && (old & bit))) {
+			// Duplicate packet, or very late packet whose word was taken over
+			return false;
+		}
+		new = (tag == block) ? (old | bit) : (((uint64_t) block << 32) | bit);
+	} while (!__atomic_compare_exchange_n(word, &old, new, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+	// Move the highest sequence number forward if needed
+	while (seq_nb > high_sn && !__atomic_compare_exchange_n(&link->high_sn, &high_sn, seq_nb, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	return true;
+}
+
+/**
+ Returns whether a packet was received, without updating the duplicate-discard state
+
+ Packets older than the window are considered received.
+*/
+bool is_received(uint32_t seq_nb, iprp_receiver_link_t *link) {
+	uint32_t high_sn = __atomic_load_n(&link->high_sn, __ATOMIC_ACQUIRE);
+	uint32_t block = seq_nb / 32;
+	if (seq_nb > high_sn) {
+		return false;
+	} else if (high_sn / 32 - block >= IPRP_DD_WORDS) {
+		return true;
+	}
+
+	uint64_t word = __atomic_load_n(&link->window[block % IPRP_DD_WORDS], __ATOMIC_ACQUIRE);
+	uint32_t tag = word >> 32;
+	return tag > block || (tag == block && (word & ((uint64_t) 1 << (seq_nb % 32))));
+}
+
+/**
+ Counts a copy in the statistics of its path
+
+ The loss of a path is measured against the sequence numbers sent during the period, so that packets lost on every path count.
+ The delay of a path is the lag of its copies behind the first copy of their packet,
+ so that it does not depend on the clock of the sender.
+ The counters are updated atomically by the workers, new paths are added under the mutex of the link
+ with the copy already counted (a path is never stored with no copy). Paths stay for the life of the link.
+*/
+void path_stats_update(iprp_receiver_link_t *link, uint32_t path_addr, uint32_t seq_nb, bool fresh) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t time = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	// Find path
+	iprp_ird_path_t *path = path_find(link, __atomic_load_n(&link->nb_paths, __ATOMIC_ACQUIRE), path_addr);
+	if (path) {
+		__atomic_add_fetch(&path->received, 1, __ATOMIC_RELAXED);
 	} else {
-		if (packet->seq_nb > link->high_sn) {
-			// Fresh packet out of order
-			// We lose space for received packets (we can accept very late packets although more recent ones would be dropped)
-			for (int i = link->high_sn + 1; i < packet->seq_nb; ++i) {
-				link->list_sn[i % IPRP_DD_MAX_LOST_PACKETS] = i;
-			}
-			link->high_sn = packet->seq_nb;
-			//*resetCtr = 0;
-			return 1;
+		// Look again with the mutex, another worker may be adding it
+		pthread_mutex_lock(&link->mutex);
+		int nb_paths = link->nb_paths;
+		if ((path = path_find(link, nb_paths, path_addr))) {
+			__atomic_add_fetch(&path->received, 1, __ATOMIC_RELAXED);
+		} else if (nb_paths < IPRP_MAX_INDS) {
+			path = &link->paths[nb_paths];
+			path->addr = path_addr;
+			path->received = 1;
+			path->total_delay = 0;
+			__atomic_store_n(&link->nb_paths, nb_paths + 1, __ATOMIC_RELEASE);
 		}
-		else
-		{
-			if (packet->seq_nb < link->high_sn && link->high_sn - packet->seq_nb > IPRP_DD_MAX_LOST_PACKETS) {
-				printf("Very Late Packet\n");
-				//*resetCtr = *resetCtr + 1;
-			}
-			/*if(*resetCtr ==MAX_OLD)
-			{
-				printf("Reboot Detected\n");
-				*highSN = 0;
-				*resetCtr = 0;
-				for(ii = 0; ii < MAX_LOST; ii++)
-					listSN[ii] = -1;
-				return 1;
-			}*/
-
-			if (link->list_sn[packet->seq_nb % IPRP_DD_MAX_LOST_PACKETS] == packet->seq_nb) {
-				// The sequence number is in the list, it is a late packet
-				// Remove from List
-				link->list_sn[packet->seq_nb % IPRP_DD_MAX_LOST_PACKETS] = 0;
-				return true;
-			} else {
-				return false;
-			}
+		pthread_mutex_unlock(&link->mutex);
+		if (!path) {
+			return;
 		}
 	}
+
+	// Record the first copy, or measure the lag behind it
+	iprp_ird_arrival_t *arrival = &link->arrivals[seq_nb & (IRD_ARRIVALS - 1)];
+	if (fresh) {
+		__atomic_store_n(&arrival->time, time, __ATOMIC_RELAXED);
+		__atomic_store_n(&arrival->seq_nb, seq_nb, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&arrival->seq_nb, __ATOMIC_ACQUIRE) == seq_nb) {
+		__atomic_add_fetch(&path->total_delay, time - __atomic_load_n(&arrival->time, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	}
 }
 
 /**
- Computes the IP checksum from an IP header
+ Returns the path of the given link with the given address, among its first paths (NULL if none)
 */
-uint16_t ip_checksum(struct iphdr *header, size_t len) {
-	uint32_t checksum = 0;
-	uint16_t *halfwords = (uint16_t *) header;
-
-	for (int i = 0; i < len/2; ++i) {
-		checksum += halfwords[i];
-		while (checksum >> 16) {
-			checksum = (checksum & 0xFFFF) + (checksum >> 16);
+iprp_ird_path_t *path_find(iprp_receiver_link_t *link, int nb_paths, uint32_t path_addr) {
+	for (int i = 0; i < nb_paths; ++i) {
+		if (link->paths[i].addr == path_addr) {
+			return &link->paths[i];
 		}
 	}
-	
-	while (checksum >> 16) {
-		checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	return NULL;
+}
+
+/**
+ Stores the path statistics of all links for the ICD, and starts a new period
+
+ The workers keep counting meanwhile: the copies handled while a link is reported may go to either period.
+ The counters are reset in place, as the workers keep their paths. Paths with no copy in the period are left out.
+*/
+void path_stats_store() {
+	list_lock(&receiver_links);
+
+	iprp_link_stats_t *stats = calloc(list_size(&receiver_links) + 1, sizeof(iprp_link_stats_t));
+	if (!stats) {
+		list_unlock(&receiver_links);
+		ERR("Unable to allocate path statistics", errno);
+	}
+	int count = 0;
+
+	list_elem_t *iterator = receiver_links.head;
+	while(iterator != NULL) {
+		iprp_receiver_link_t *link = (iprp_receiver_link_t *) iterator->elem;
+		pthread_mutex_lock(&link->mutex); // No path is added meanwhile
+		uint32_t high_sn = __atomic_load_n(&link->high_sn, __ATOMIC_ACQUIRE);
+		uint32_t packets = high_sn - link->period_sn;
+		iprp_link_stats_t *entry = (packets > 0) ? &stats[count++] : NULL;
+		if (entry) {
+			entry->src_addr = link->src_addr;
+			entry->src_port = link->src_port;
+			entry->dest_port = link->dest_port;
+			entry->nb_paths = 0;
+		}
+		for (int i = 0; i < link->nb_paths; ++i) {
+			iprp_ird_path_t *path = &link->paths[i];
+			uint32_t received = __atomic_exchange_n(&path->received, 0, __ATOMIC_RELAXED);
+			uint64_t total_delay = __atomic_exchange_n(&path->total_delay, 0, __ATOMIC_RELAXED);
+			if (entry && received > 0) {
+				iprp_path_stats_t *path_stats = &entry->paths[entry->nb_paths++];
+				path_stats->path_addr.s_addr = path->addr;
+				path_stats->packets = packets;
+				path_stats->received = received;
+				path_stats->delay = total_delay / received;
+			}
+		}
+		link->period_sn = high_sn;
+		pthread_mutex_unlock(&link->mutex);
+		iterator = iterator->next;
 	}
 
-	return (uint16_t) ~checksum;
+	list_unlock(&receiver_links);
+
+	pathstats_store(IPRP_PS_FILE, count, stats);
+	free(stats);
 }
 
 /**
- Computes the UDP checksum from a UDP header and the given IP pseudo-header
-*/
-uint16_t udp_checksum(uint16_t *packet, size_t len, uint32_t src_addr, uint32_t dest_addr) {
-	uint32_t checksum = 0;
+ Adds the given bytes to a one's complement sum (in host order)
 
-	// Pseudo-header
-	checksum += (((uint16_t *) src_addr)[0]);
-	checksum += (((uint16_t *) src_addr)[1]);
+ The offset of the bytes in the checksummed data gives their position in its 16-bit words.
+*/
+uint16_t checksum_add(uint16_t sum, const void *data, size_t size, size_t offset) {
+	const unsigned char *bytes = (const unsigned char *) data;
+	uint64_t checksum = sum;
+	for (size_t i = 0; i < size; ++i) {
+		checksum += ((offset + i) % 2) ? bytes[i] : (bytes[i] << 8);
+	}
 
-	checksum += (((uint16_t *) dest_addr)[0]);
-	checksum += (((uint16_t *) dest_addr)[1]);
+	return checksum_fold(checksum);
+}
 
-	checksum += htons(IPPROTO_UDP);
-	checksum += htons(len);
+/**
+ Removes the given bytes from a one's complement sum (in host order)
+*/
+uint16_t checksum_sub(uint16_t sum, const void *data, size_t size, size_t offset) {
+	return checksum_fold((uint32_t) sum + (uint16_t) ~checksum_add(0, data, size, offset));
+}
 
-	while(checksum >> 16) {
+/**
+ Folds the carries of a one's complement sum
+*/
+uint16_t checksum_fold(uint64_t checksum) {
+	while (checksum >> 16) {
 		checksum = (checksum & 0xFFFF) + (checksum >> 16);
 	}
+	return (uint16_t) checksum;
+}
 
-	// Calculate the sum
-	for (int i = 0; i < len/2; ++i) {
-		checksum += packet[i];
-		while (checksum >> 16) {
-			checksum = (checksum & 0xFFFF) + (checksum >> 16);
-		}
-	}
+/**
+ Returns the one's complement sum of the UDP pseudo-header of the given IP header and UDP length (network order)
+*/
+uint16_t pseudo_sum(struct iphdr *ip_header, uint16_t udp_len) {
+	uint16_t sum = checksum_add(0, &ip_header->saddr, 2 * sizeof(uint32_t), 0);
+	uint16_t fields[2] = { htons(IPPROTO_UDP), udp_len };
+	return checksum_add(sum, fields, sizeof(fields), 0);
+}
+
+/**
+ Marks the given worker as using the links, until links_leave
+
+ The links and table slots removed meanwhile are not freed before.
+*/
+void links_enter(int reader) {
+	__atomic_store_n(&readers[reader].version, __atomic_load_n(&links_version, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+}
+
+/**
+ Marks the given worker as not using the links anymore
+*/
+void links_leave(int reader) {
+	__atomic_store_n(&readers[reader].version, IRD_LINKS_OFFLINE, __ATOMIC_RELEASE);
+}
+
+/**
+ Waits for the workers to stop using the links they found before this call
 
-	if (len % 2 == 1) {
-		checksum += *((uint8_t *) packet[len/2]);
-		while (checksum >> 16) {
-			checksum = (checksum & 0xFFFF) + (checksum >> 16);
+ Each worker is either between two packets (offline), or it has announced the version it entered with.
+ Packets are handled in microseconds, so this only waits for the packets in progress.
+ Must be called without the list locked, as workers may wait for it.
+*/
+void links_synchronize() {
+	uint32_t version = __atomic_add_fetch(&links_version, 1, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < nb_readers; ++i) {
+		while (true) {
+			uint32_t reader_version = __atomic_load_n(&readers[i].version, __ATOMIC_SEQ_CST);
+			if (reader_version == IRD_LINKS_OFFLINE || reader_version == version) {
+				break;
+			}
+			struct timespec wait = { 0, IRD_LINKS_SYNC_USEC * 1000 };
+			nanosleep(&wait, NULL);
 		}
 	}
-
-	return (uint16_t) ~checksum;
 }
 
 /**
- Deletes expired entries from the receiver link structure
+ Deletes expired entries from the receiver link structure, and stores the path statistics of the others
 */
 void* cleanup_routine(void* arg) {
 	DEBUG("In routine");
 
 	while(true) {
-		// Delete aged entries
+		// Remove aged entries from the tables (workers may still be handling their packets)
+		list_lock(&receiver_links);
 		list_elem_t *iterator = receiver_links.head;
 		while(iterator != NULL) {
-			// Fine grain lock to avoid blocking packet treatment for a long time
-			list_lock(&receiver_links);
-
 			iprp_receiver_link_t *as = (iprp_receiver_link_t*) iterator->elem;
-			if (curr_time - as->last_seen > IRD_T_EXP) {
+			if (curr_time - __atomic_load_n(&as->last_seen, __ATOMIC_RELAXED) > IRD_T_EXP) {
 				// Expired sender
-				list_elem_t *to_delete = iterator;
-				iterator = iterator->next;
-				list_delete(&receiver_links, to_delete);
+				receiver_link_unindex(as);
+				as->expired = true;
 				DEBUG("Aged receiver");
 			} else {
 				// Good sender
-				iterator = iterator->next;
 				DEBUG("Fresh receiver");
 			}
-			list_unlock(&receiver_links);
+			iterator = iterator->next;
+		}
+		iprp_ird_slots_t *retired[2] = { table_retired(&links_by_snsid), table_retired(&links_by_path) };
+		list_unlock(&receiver_links);
+
+		// Free them once no worker uses them anymore
+		links_synchronize();
+		table_free(retired[0]);
+		table_free(retired[1]);
+		list_lock(&receiver_links);
+		iterator = receiver_links.head;
+		while(iterator != NULL) {
+			iprp_receiver_link_t *as = (iprp_receiver_link_t*) iterator->elem;
+			list_elem_t *next = iterator->next;
+			if (as->expired) {
+				list_delete(&receiver_links, iterator);
+				free(as->fec);
+				pthread_mutex_destroy(&as->mutex);
+				free(as);
+			}
+			iterator = next;
 		}
+		list_unlock(&receiver_links);
 		DEBUG("Deleted aged entries");
 
+		// Report the paths of the remaining links
+		path_stats_store();
+		DEBUG("Path statistics stored");
+
 		LOG("Receiver links cleaned up");
 		sleep(IRD_T_CLEANUP);
 	}
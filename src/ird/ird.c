@@ -15,7 +15,7 @@ int imd_queue_id;
 
 /* Threads */
 pthread_t time_thread;
-pthread_t handle_thread;
+iprp_ird_worker_t workers[IRD_MAX_WORKERS];
 #ifdef IPRP_MULTICAST
 pthread_t si_thread;
 #endif
@@ -24,14 +24,21 @@ pthread_t si_thread;
  Receiver daemon entry point
 
  The IRD first parses its arguments (incoming and outgoing packet queues).
- It then launches the IRD routines and waits forever.
+ It then launches the IRD routines (one receiving routine per incoming queue) and waits forever.
 */
 int main(int argc, char const *argv[]) {
 	int err;
 	
-	// Get arguments
+	// Get arguments (the optional queue count is the size of the --queue-balance range)
+	if (argc < 3) {
+		ERR("Missing arguments (incoming and outgoing queues)", IPRP_ERR);
+	}
 	int queue_id = atoi(argv[1]);
 	imd_queue_id = atoi(argv[2]);
+	int nb_queues = (argc > 3) ? atoi(argv[3]) : 1;
+	if (nb_queues < 1 || nb_queues > IRD_MAX_WORKERS) {
+		ERR("Invalid queue count", nb_queues);
+	}
 	DEBUG("Started");
 
 	// Launch time routine
@@ -40,11 +47,16 @@ int main(int argc, char const *argv[]) {
 	}
 	DEBUG("Time thread created");
 
-	// Launch receiving routine
-	if ((err = pthread_create(&handle_thread, NULL, handle_routine, (void*) queue_id))) {
-		ERR("Unable to setup receive thread", err);
+	// Launch receiving routines
+	handle_init(nb_queues);
+	for (int i = 0; i < nb_queues; ++i) {
+		workers[i].id = i;
+		workers[i].queue_id = queue_id + i;
+		if ((err = pthread_create(&workers[i].thread, NULL, handle_routine, &workers[i]))) {
+			ERR("Unable to setup receive thread", err);
+		}
 	}
-	DEBUG("Receive thread created");
+	DEBUG("%d receive threads created", nb_queues);
 
 #ifdef IPRP_MULTICAST
 	// Launch subscribe routine
@@ -0,0 +1,256 @@
+/**\file ird/table.c
+ * Open-addressing hash tables indexing the receiver links
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE IRD_HANDLE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ird.h"
+
+#define TABLE_EMPTY 0 // Hash of a slot never used
+#define TABLE_DELETED 1 // Hash of a slot whose element was removed (probing goes on past it)
+
+/* Function prototypes */
+iprp_ird_slots_t *slots_alloc(size_t size);
+void table_grow(iprp_ird_table_t *table);
+void table_migrate(iprp_ird_table_t *table);
+void table_insert(iprp_ird_slots_t *slots, uint64_t hash, void *elem);
+void *table_probe(iprp_ird_slots_t *slots, uint64_t hash, table_match_t match, const void *key);
+uint64_t hash_mix(uint64_t hash);
+
+/**
+ Allocates the slots of an empty table
+*/
+void table_init(iprp_ird_table_t *table) {
+	table->slots = slots_alloc(IRD_TABLE_MIN_SIZE);
+	table->count = 0;
+	table->used = 0;
+	table->old_slots = NULL;
+	table->migrated = 0;
+	table->version = 0;
+	table->retired = NULL;
+}
+
+/**
+ Returns the element of the given key (NULL if none)
+
+ The element must have the given hash, and the match function must accept it for the key.
+ Lookups do not lock the table: they run concurrently with the additions and removals of another thread.
+ A lookup that misses while the table grows is retried, so that it sees the elements added to the new slots.
+*/
+void *table_get(iprp_ird_table_t *table, uint64_t hash, table_match_t match, const void *key) {
+	hash = hash_mix(hash);
+	uint32_t version;
+	do {
+		version = __atomic_load_n(&table->version, __ATOMIC_SEQ_CST);
+		iprp_ird_slots_t *slots = __atomic_load_n(&table->slots, __ATOMIC_SEQ_CST);
+		iprp_ird_slots_t *old_slots = __atomic_load_n(&table->old_slots, __ATOMIC_SEQ_CST);
+
+		void *elem = table_probe(slots, hash, match, key);
+		if (!elem && old_slots) {
+			elem = table_probe(old_slots, hash, match, key);
+		}
+		if (elem) {
+			return elem;
+		}
+	} while (version != __atomic_load_n(&table->version, __ATOMIC_SEQ_CST));
+	return NULL;
+}
+
+/**
+ Adds an element with the given hash (the key must not be in the table yet)
+
+ The table grows when it is three quarters full. The elements are then copied to the new slots a few at a time,
+ by the next additions and removals, so that no packet waits for the whole table to be copied.
+ Only one thread at a time may add or remove elements.
+*/
+void table_put(iprp_ird_table_t *table, uint64_t hash, void *elem) {
+	table_migrate(table);
+	if ((table->used + 1) * 4 > table->slots->size * 3) {
+		table_grow(table);
+	}
+
+	table_insert(table->slots, hash_mix(hash), elem);
+	table->count++;
+	table->used++;
+}
+
+/**
+ Removes the given element, added with the given hash
+
+ While the table grows, the element may be in both the old and the new slots.
+*/
+void table_remove(iprp_ird_table_t *table, uint64_t hash, void *elem) {
+	table_migrate(table);
+	hash = hash_mix(hash);
+
+	iprp_ird_slots_t *slots[2] = { table->slots, table->old_slots };
+	for (int i = 0; i < 2 && slots[i]; ++i) {
+		size_t mask = slots[i]->size - 1;
+		iprp_ird_slot_t *slot = slots[i]->slots;
+		for (size_t j = hash & mask; slot[j].hash != TABLE_EMPTY; j = (j + 1) & mask) {
+			if (slot[j].elem == elem) {
+				__atomic_store_n(&slot[j].hash, TABLE_DELETED, __ATOMIC_RELEASE);
+				__atomic_store_n(&slot[j].elem, NULL, __ATOMIC_RELEASE);
+				if (i == 0) {
+					table->count--; // The slot stays used until the next growth
+				}
+				break;
+			}
+		}
+	}
+}
+
+/**
+ Returns the slots that are not used by the table anymore, and forgets them
+
+ They must only be freed once the lookups in progress are over.
+*/
+iprp_ird_slots_t *table_retired(iprp_ird_table_t *table) {
+	iprp_ird_slots_t *retired = table->retired;
+	table->retired = NULL;
+	return retired;
+}
+
+/**
+ Frees the given retired slots
+*/
+void table_free(iprp_ird_slots_t *slots) {
+	while (slots) {
+		iprp_ird_slots_t *next = slots->next;
+		free(slots);
+		slots = next;
+	}
+}
+
+/**
+ Allocates empty slots
+*/
+iprp_ird_slots_t *slots_alloc(size_t size) {
+	iprp_ird_slots_t *slots = calloc(1, sizeof(iprp_ird_slots_t) + size * sizeof(iprp_ird_slot_t));
+	if (!slots) {
+		ERR("Unable to allocate link table", errno);
+	}
+	slots->size = size;
+	slots->next = NULL;
+	return slots;
+}
+
+/**
+ Starts copying the elements to new slots (twice as many if the table holds more than a quarter of them)
+
+ Removed slots are dropped on the way. A growth still in progress is completed first.
+*/
+void table_grow(iprp_ird_table_t *table) {
+	while (table->old_slots) {
+		table_migrate(table);
+	}
+
+	size_t size = (table->count * 4 > table->slots->size) ? table->slots->size * 2 : table->slots->size;
+	iprp_ird_slots_t *slots = slots_alloc(size);
+
+	// Lookups that see the new slots also see the old ones
+	__atomic_store_n(&table->old_slots, table->slots, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&table->slots, slots, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&table->version, 1, __ATOMIC_SEQ_CST);
+	table->migrated = 0;
+	table->used = 0;
+	table->count = 0;
+}
+
+/**
+ Copies some elements of the old slots to the new ones, and retires the old slots once they are all copied
+
+ The elements stay in the old slots, so that the lookups in progress still find them there.
+*/
+void table_migrate(iprp_ird_table_t *table) {
+	iprp_ird_slots_t *old_slots = table->old_slots;
+	if (!old_slots) {
+		return;
+	}
+
+	for (int i = 0; i < IRD_TABLE_MIGRATE && table->migrated < old_slots->size; ++i) {
+		iprp_ird_slot_t *slot = &old_slots->slots[table->migrated++];
+		if (slot->elem) {
+			table_insert(table->slots, slot->hash, slot->elem);
+			table->count++;
+			table->used++;
+		}
+	}
+
+	if (table->migrated == old_slots->size) {
+		__atomic_store_n(&table->old_slots, NULL, __ATOMIC_SEQ_CST);
+		old_slots->next = table->retired;
+		table->retired = old_slots;
+	}
+}
+
+/**
+ Writes an element in the first free slot of its probe sequence
+
+ The element is written before the hash, so that lookups never match a slot without its element.
+*/
+void table_insert(iprp_ird_slots_t *slots, uint64_t hash, void *elem) {
+	size_t mask = slots->size - 1;
+	size_t i = hash & mask;
+	while (slots->slots[i].hash != TABLE_EMPTY) {
+		i = (i + 1) & mask;
+	}
+	__atomic_store_n(&slots->slots[i].elem, elem, __ATOMIC_RELEASE);
+	__atomic_store_n(&slots->slots[i].hash, hash, __ATOMIC_RELEASE);
+}
+
+/**
+ Returns the element of the given key in the given slots (NULL if none)
+
+ The hash must already be mixed.
+*/
+void *table_probe(iprp_ird_slots_t *slots, uint64_t hash, table_match_t match, const void *key) {
+	size_t mask = slots->size - 1;
+	for (size_t i = hash & mask; ; i = (i + 1) & mask) {
+		uint64_t slot_hash = __atomic_load_n(&slots->slots[i].hash, __ATOMIC_ACQUIRE);
+		if (slot_hash == TABLE_EMPTY) {
+			return NULL;
+		}
+		if (slot_hash == hash) {
+			void *elem = __atomic_load_n(&slots->slots[i].elem, __ATOMIC_ACQUIRE);
+			if (elem && match(elem, key)) {
+				return elem;
+			}
+		}
+	}
+}
+
+/**
+ Returns a 64-bit hash of the given bytes
+
+ The bytes are read 8 at a time, each word is mixed in with a multiplication.
+*/
+uint64_t hash_bytes(const void *data, size_t size) {
+	const unsigned char *bytes = (const unsigned char *) data;
+	uint64_t hash = size;
+	while (size > 0) {
+		uint64_t word = 0;
+		size_t chunk = (size < sizeof(uint64_t)) ? size : sizeof(uint64_t);
+		memcpy(&word, bytes, chunk);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
+		bytes += chunk;
+		size -= chunk;
+	}
+	return hash;
+}
+
+/**
+ Finalizes a hash (the values of empty and removed slots are never returned)
+*/
+uint64_t hash_mix(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	return (hash > TABLE_DELETED) ? hash : hash + 2;
+}
\ No newline at end of file
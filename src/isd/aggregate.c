@@ -0,0 +1,188 @@
+/**\file isd/aggregate.c
+ * Aggregation of the small payloads of a flow in frames
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "isd.h"
+
+extern uint64_t aggregate_hold;
+
+/* Function prototypes */
+iprp_isd_frame_t *frame_find(iprp_isd_aggregator_t *aggregator, uint16_t flow_id);
+iprp_isd_frame_t *frame_open(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, uint16_t flow_id);
+void frame_send(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, iprp_isd_frame_t *frame);
+
+/**
+ Allocates the aggregation frames of a worker
+*/
+iprp_isd_aggregator_t *aggregator_create() {
+	iprp_isd_aggregator_t *aggregator = malloc(sizeof(iprp_isd_aggregator_t));
+	if (!aggregator) {
+		return NULL;
+	}
+
+	for (int i = 0; i < IPRP_ISD_AGG_BUFS; ++i) {
+		aggregator->bufs[i].refs = 0;
+	}
+	aggregator->nb_frames = 0;
+	aggregator->payloads = 0;
+	aggregator->sent = 0;
+
+	return aggregator;
+}
+
+/**
+ Adds the payload of the given packet to the frame of its flow
+
+ Only flows whose receivers all split frames are aggregated. Returns false if the packet must be sent alone:
+ the frame of the flow is then sent first, so that the datagrams of the flow stay in order.
+ A full frame is sent before the payload is added to a new one.
+*/
+bool aggregate_add(iprp_isd_worker_t *worker, struct nfq_data *packet, iprp_isd_snapshot_t *snapshot, int flow) {
+	iprp_isd_aggregator_t *aggregator = worker->aggregator;
+	iprp_peerbase_t *base = &snapshot->flows[flow];
+	if (base->version < IPRP_VERSION_AGGREGATE) {
+		return false;
+	}
+
+	char *payload;
+	size_t payload_size = packet_payload(packet, &payload);
+	iprp_isd_frame_t *frame = frame_find(aggregator, base->flow_id);
+	if (payload_size > IPRP_ISD_AGG_MAX_PAYLOAD) {
+		if (frame) {
+			frame_send(worker, snapshot, frame);
+		}
+		return false;
+	}
+
+	if (frame && frame->size + sizeof(uint16_t) + payload_size > IPRP_ISD_AGG_MAX_SIZE) {
+		frame_send(worker, snapshot, frame);
+		frame = NULL;
+	}
+	if (!frame) {
+		frame = frame_open(worker, snapshot, base->flow_id);
+	}
+
+	// Write the datagram after its size
+	uint16_t size = htons(payload_size);
+	memcpy(frame->buf->data + frame->size, &size, sizeof(uint16_t));
+	memcpy(frame->buf->data + frame->size + sizeof(uint16_t), payload, payload_size);
+	frame->size += sizeof(uint16_t) + payload_size;
+	aggregator->payloads++;
+
+	// The payload is copied, the packet is not needed anymore
+	packet_verdict(worker, packet, base->flow_id);
+
+	return true;
+}
+
+/**
+ Returns the open frame of the given flow (NULL if none)
+*/
+iprp_isd_frame_t *frame_find(iprp_isd_aggregator_t *aggregator, uint16_t flow_id) {
+	for (int i = 0; i < aggregator->nb_frames; ++i) {
+		if (aggregator->frames[i].flow_id == flow_id) {
+			return &aggregator->frames[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ Opens a frame for the given flow
+
+ If all frames are open, the oldest one is sent first. The frame gets a buffer whose copies have all been sent,
+ which it holds (one reference) until it is sent itself.
+*/
+iprp_isd_frame_t *frame_open(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, uint16_t flow_id) {
+	iprp_isd_aggregator_t *aggregator = worker->aggregator;
+
+	if (aggregator->nb_frames == IPRP_ISD_AGG_FLOWS) {
+		iprp_isd_frame_t *oldest = &aggregator->frames[0];
+		for (int i = 1; i < aggregator->nb_frames; ++i) {
+			if (aggregator->frames[i].deadline < oldest->deadline) {
+				oldest = &aggregator->frames[i];
+			}
+		}
+		frame_send(worker, snapshot, oldest);
+	}
+
+	iprp_pktbuf_t *buf = spare_buf(worker, aggregator->bufs, IPRP_ISD_AGG_BUFS);
+	__atomic_store_n(&buf->refs, 1, __ATOMIC_RELAXED);
+
+	iprp_isd_frame_t *frame = &aggregator->frames[aggregator->nb_frames++];
+	frame->flow_id = flow_id;
+	frame->buf = buf;
+	frame->size = 0;
+	frame->deadline = clock_ns(CLOCK_MONOTONIC) + aggregate_hold;
+	return frame;
+}
+
+/**
+ Sends the copies of the given frame and closes it
+
+ The frame is dropped if its flow is gone, or if a receiver that cannot split frames joined it.
+*/
+void frame_send(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, iprp_isd_frame_t *frame) {
+	iprp_isd_aggregator_t *aggregator = worker->aggregator;
+	iprp_pktbuf_t *buf = frame->buf;
+
+	int flow = (frame->flow_id <= IPRP_MAX_FLOWS) ? snapshot->flow_index[frame->flow_id] : -1;
+	if (flow >= 0 && snapshot->flows[flow].version >= IPRP_VERSION_AGGREGATE) {
+		header_fill(worker, buf, snapshot, flow);
+		buf->header.compact.header.flags |= IPRP_COMPACT_AGGREGATE;
+
+		send_packet(worker, buf, snapshot, flow, buf->data, frame->size);
+		aggregator->sent++;
+		DEBUG("Frame of flow %u sent (%lu bytes)", frame->flow_id, frame->size);
+	} else {
+		LOG("Frame of flow %u dropped", frame->flow_id);
+	}
+	pool_release(buf);
+
+	*frame = aggregator->frames[--aggregator->nb_frames];
+}
+
+/**
+ Sends the frames whose hold time is over at the given time
+
+ Returns the hold time of the earliest frame left open (UINT64_MAX if none), and sets sent if frames were sent.
+*/
+uint64_t aggregate_expire(iprp_isd_worker_t *worker, uint64_t now, bool *sent) {
+	iprp_isd_aggregator_t *aggregator = worker->aggregator;
+	uint64_t next = UINT64_MAX;
+	iprp_isd_snapshot_t *snapshot = NULL;
+	for (int i = 0; i < aggregator->nb_frames; ) {
+		iprp_isd_frame_t *frame = &aggregator->frames[i];
+		if (frame->deadline > now) {
+			if (frame->deadline < next) {
+				next = frame->deadline;
+			}
+			++i;
+			continue;
+		}
+		if (!snapshot) {
+			snapshot = pb_enter(worker->id);
+		}
+		frame_send(worker, snapshot, frame); // The last frame takes its place
+		*sent = true;
+	}
+	if (snapshot) {
+		pb_leave(worker->id);
+	}
+	return next;
+}
+
+/**
+ Logs the aggregation counters of a worker
+*/
+void aggregate_log(iprp_isd_aggregator_t *aggregator, int worker_id) {
+	LOG("Aggregation (worker %d): %lu payloads in %lu frames (%.1f per frame)", worker_id, aggregator->payloads, aggregator->sent, aggregator->sent ? (double) aggregator->payloads / aggregator->sent : 0.0);
+}
\ No newline at end of file
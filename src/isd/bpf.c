@@ -0,0 +1,245 @@
+/**\file isd/bpf.c
+ * tc sender program loading and map filling (bpf engine of the ISD)
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_PB
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include <linux/bpf.h>
+
+#include "isd.h"
+#include "isd_bpf.h"
+
+/* Maps of the program (pinned by tc) */
+int flows_map = -1;
+int seq_nbs_map = -1;
+int allowed_map = -1;
+int stats_map = -1;
+
+/* Flows currently in the flows map (by packet mark) */
+uint32_t published_marks[IPRP_MAX_FLOWS];
+int nb_published = 0;
+
+/* Function prototypes */
+int bpf_map_open(char *name);
+bool bpf_fill_flow(struct iprp_bpf_flow *value, iprp_peerbase_t *base, iprp_isd_header_t *template);
+int bpf_map_update(int map, void *key, void *value);
+int bpf_map_delete(int map, void *key);
+int bpf_map_lookup(int map, void *key, void *value);
+
+/**
+ Attaches the sender program to the egress of the interface with the given address
+
+ The program is loaded by tc, which pins its maps. Checksum offloading is disabled on the interface:
+ the program moves the UDP header of the packets, which the device could not find anymore.
+*/
+void bpf_attach(iprp_iface_t *iface) {
+	char ifname[IF_NAMESIZE];
+	unsigned char mac[6];
+	if (iface_lookup(iface->addr, ifname, mac, NULL) < 0) {
+		ERR("Unable to find interface", IPRP_ERR_LOOKUPFAIL);
+	}
+
+	// The clsact qdisc may already exist
+	char shell[256];
+	snprintf(shell, sizeof(shell), "tc qdisc add dev %s clsact 2>/dev/null", ifname);
+	system(shell);
+	snprintf(shell, sizeof(shell), "tc filter replace dev %s egress pref 1 handle 1 bpf direct-action object-file %s section tc", ifname, IPRP_ISD_BPF_OBJECT);
+	if (system(shell)) {
+		ERR("Unable to attach sender program", errno);
+	}
+	snprintf(shell, sizeof(shell), "ethtool -K %s tx off >/dev/null 2>&1", ifname);
+	if (system(shell)) {
+		DEBUG("Unable to disable checksum offloading on %s", ifname);
+	}
+	DEBUG("Sender program attached to %s", ifname);
+
+	if (flows_map == -1) {
+		if ((flows_map = bpf_map_open("iprp_flows")) == -1
+			|| (seq_nbs_map = bpf_map_open("iprp_seq_nbs")) == -1
+			|| (allowed_map = bpf_map_open("iprp_allowed")) == -1
+			|| (stats_map = bpf_map_open("iprp_stats")) == -1) {
+			ERR("Unable to open sender program maps", errno);
+		}
+		DEBUG("Maps opened");
+	}
+}
+
+/**
+ Opens the pinned map with the given name
+*/
+int bpf_map_open(char *name) {
+	char path[128];
+	snprintf(path, sizeof(path), "%s%s", IPRP_BPF_PIN_PATH, name);
+
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uint64_t) (unsigned long) path;
+	return syscall(__NR_bpf, BPF_OBJ_GET, &attr, sizeof(attr));
+}
+
+/**
+ Writes the flows of the given snapshot to the flows map, and removes the other ones
+
+ Paths whose next hop is not in the ARP table yet are left out.
+ Returns false in that case, so that the flows are written again at the next peerbase cycle.
+*/
+bool bpf_publish(iprp_isd_snapshot_t *snapshot) {
+	bool complete = true;
+
+	// Write current flows
+	static struct iprp_bpf_flow value;
+	uint32_t marks[IPRP_MAX_FLOWS];
+	int nb_marks = 0;
+	for (int i = 0; i < snapshot->nb_flows; ++i) {
+		iprp_peerbase_t *base = &snapshot->flows[i];
+		complete &= bpf_fill_flow(&value, base, &snapshot->templates[i]);
+
+		uint32_t mark = IPRP_FLOW_MARK | base->flow_id;
+		if (bpf_map_update(flows_map, &mark, &value) == -1) {
+			ERR("Unable to update flows map", errno);
+		}
+		marks[nb_marks++] = mark;
+	}
+
+	// Remove old flows
+	for (int i = 0; i < nb_published; ++i) {
+		bool found = false;
+		for (int j = 0; j < nb_marks; ++j) {
+			if (marks[j] == published_marks[i]) {
+				found = true;
+				break;
+			}
+		}
+		if (!found && bpf_map_delete(flows_map, &published_marks[i]) == -1 && errno != ENOENT) {
+			ERR("Unable to update flows map", errno);
+		}
+	}
+	memcpy(published_marks, marks, nb_marks * sizeof(uint32_t));
+	nb_published = nb_marks;
+
+	DEBUG("%d flows written to the sender program (%s)", nb_marks, complete ? "complete" : "incomplete");
+	return complete;
+}
+
+/**
+ Fills the flows map value of the given flow
+
+ Returns false if some paths are missing.
+*/
+bool bpf_fill_flow(struct iprp_bpf_flow *value, iprp_peerbase_t *base, iprp_isd_header_t *template) {
+	memset(value, 0, sizeof(struct iprp_bpf_flow));
+	value->flow_id = base->flow_id;
+	value->dest_port = htons(IPRP_DATA_PORT);
+	if (base->version >= IPRP_VERSION_COMPACT) {
+		// The program does not count packets, the link description is sent with every packet
+		value->header_size = sizeof(iprp_compact_header_t) + sizeof(iprp_compact_link_t);
+		value->seq_offset = offsetof(iprp_compact_header_t, seq_nb);
+	} else {
+		value->header_size = sizeof(iprp_header_t);
+		value->seq_offset = offsetof(iprp_header_t, seq_nb);
+	}
+	memcpy(value->header, template, value->header_size);
+	if (base->version >= IPRP_VERSION_COMPACT) {
+		((iprp_compact_header_t *) value->header)->flags |= IPRP_COMPACT_LINK;
+	}
+#ifdef IPRP_MULTICAST
+	value->allow_period = IPRP_T_ISD_ALLOW;
+#endif
+
+	bool complete = true;
+	value->mtu = IPRP_MAX_PACKET_SIZE;
+	for (int i = 0; i < base->host.nb_ifaces; ++i) {
+		iprp_iface_t *iface = &base->host.ifaces[i];
+		if (!((1 << iface->ind) & base->inds)) {
+			continue;
+		}
+		struct iprp_bpf_path *path = &value->paths[value->nb_paths];
+
+		char ifname[IF_NAMESIZE];
+		unsigned int mtu;
+		int ifindex = iface_lookup(iface->addr, ifname, path->smac, &mtu);
+	#ifndef IPRP_MULTICAST
+		struct in_addr dest_addr = base->dest_addr[iface->ind];
+	#else
+		struct in_addr dest_addr = base->link.dest_addr;
+	#endif
+		if (ifindex < 0 || !neigh_lookup(ifname, dest_addr.s_addr, path->dmac)) {
+			complete = false;
+			continue;
+		}
+
+		path->ifindex = ifindex;
+		path->saddr = iface->addr.s_addr;
+		path->daddr = dest_addr.s_addr;
+		if (mtu < value->mtu) {
+			value->mtu = mtu;
+		}
+		value->nb_paths++;
+	}
+
+	return complete;
+}
+
+/**
+ Restarts the sequence numbers of the given flow ID
+*/
+void bpf_reset_seq(uint16_t flow_id) {
+	uint32_t key = flow_id;
+	uint32_t seq = 1;
+	uint64_t allowed = 0;
+	if (bpf_map_update(seq_nbs_map, &key, &seq) == -1 || bpf_map_update(allowed_map, &key, &allowed) == -1) {
+		ERR("Unable to reset sequence number", errno);
+	}
+}
+
+/**
+ Logs the statistics of the sender program
+*/
+void bpf_log() {
+	uint64_t stats[IPRP_BPF_NB_STATS];
+	for (uint32_t i = 0; i < IPRP_BPF_NB_STATS; ++i) {
+		if (bpf_map_lookup(stats_map, &i, &stats[i]) == -1) {
+			return;
+		}
+	}
+	LOG("Sender program: %lu packets replicated, %lu sent unchanged", (unsigned long) stats[IPRP_BPF_REPLICATED], (unsigned long) stats[IPRP_BPF_PASSED]);
+}
+
+/**
+ Map element syscalls
+*/
+int bpf_map_update(int map, void *key, void *value) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (uint64_t) (unsigned long) key;
+	attr.value = (uint64_t) (unsigned long) value;
+	attr.flags = BPF_ANY;
+	return syscall(__NR_bpf, BPF_MAP_UPDATE_ELEM, &attr, sizeof(attr));
+}
+
+int bpf_map_delete(int map, void *key) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (uint64_t) (unsigned long) key;
+	return syscall(__NR_bpf, BPF_MAP_DELETE_ELEM, &attr, sizeof(attr));
+}
+
+int bpf_map_lookup(int map, void *key, void *value) {
+	union bpf_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.map_fd = map;
+	attr.key = (uint64_t) (unsigned long) key;
+	attr.value = (uint64_t) (unsigned long) value;
+	return syscall(__NR_bpf, BPF_MAP_LOOKUP_ELEM, &attr, sizeof(attr));
+}
\ No newline at end of file
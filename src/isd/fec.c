@@ -0,0 +1,249 @@
+/**\file isd/fec.c
+ * Forward error correction: packets spread over the paths, protected by parity packets
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "isd.h"
+
+extern bool txtime;
+
+/* Offset of the parity in the data of a group buffer (after the largest member list) */
+#define FEC_PARITY_OFFSET (sizeof(iprp_parity_header_t) + IPRP_FEC_MAX_GROUP * sizeof(iprp_fec_member_t))
+
+/* Function prototypes */
+iprp_isd_fec_t *fec_create();
+iprp_isd_group_t *group_find(iprp_isd_fec_t *fec, uint16_t flow_id);
+iprp_isd_group_t *group_open(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, uint16_t flow_id);
+void group_send(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, iprp_isd_group_t *group);
+iprp_ind_bitmap_t next_path(iprp_isd_fec_t *fec, iprp_peerbase_t *base, bool parity);
+
+/**
+ Returns whether the packets of the given flow are protected by parity packets instead of duplicated
+
+ All the receivers of the flow must rebuild lost packets, and the parity packet must fit in a datagram.
+*/
+bool fec_protects(iprp_peerbase_t *base, size_t payload_size) {
+	return base->fec_group > 0 && base->version >= IPRP_VERSION_FEC && payload_size <= IPRP_FEC_MAX_SIZE;
+}
+
+/**
+ Sends a packet of a protected flow on a single path, and adds it to the parity group of its flow
+
+ The paths of the flow are used in turn. The parity packet is sent once the group is complete.
+*/
+void fec_send(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_isd_snapshot_t *snapshot, int flow, char *payload, size_t payload_size) {
+	if (!worker->fec && !(worker->fec = fec_create())) {
+		ERR("Unable to allocate parity groups", errno);
+	}
+	iprp_isd_fec_t *fec = worker->fec;
+	iprp_peerbase_t *base = &snapshot->flows[flow];
+
+	iprp_isd_group_t *group = group_find(fec, base->flow_id);
+	if (!group) {
+		group = group_open(worker, snapshot, base->flow_id);
+	}
+
+	// Send the packet
+	iprp_compact_header_t *header = &buf->header.compact.header;
+	header->flags |= IPRP_COMPACT_FEC;
+	iprp_ind_bitmap_t path = next_path(fec, base, false);
+	if (path) {
+		__atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+		queue_copies(worker, buf, snapshot, flow, path, payload, payload_size);
+	}
+	fec->packets++;
+
+	// Add it to the parity
+	iprp_parity_header_t *parity = (iprp_parity_header_t *) group->buf->data;
+	iprp_fec_member_t *member = &parity->members[parity->nb_members++];
+	member->seq_nb = header->seq_nb;
+	member->size = payload_size;
+	member->flags = header->flags;
+	member->pad = 0;
+
+	char *data = group->buf->data + FEC_PARITY_OFFSET;
+	size_t common = (payload_size < group->size) ? payload_size : group->size;
+	for (size_t i = 0; i < common; ++i) {
+		data[i] ^= payload[i];
+	}
+	if (payload_size > group->size) {
+		memcpy(data + group->size, payload + group->size, payload_size - group->size);
+		group->size = payload_size;
+	}
+
+	if (parity->nb_members >= base->fec_group) {
+		group_send(worker, snapshot, group);
+	}
+}
+
+/**
+ Allocates the parity groups of a worker
+*/
+iprp_isd_fec_t *fec_create() {
+	iprp_isd_fec_t *fec = malloc(sizeof(iprp_isd_fec_t));
+	if (!fec) {
+		return NULL;
+	}
+
+	for (int i = 0; i < IPRP_ISD_FEC_BUFS; ++i) {
+		fec->bufs[i].refs = 0;
+	}
+	memset(fec->next_paths, 0, sizeof(fec->next_paths));
+	fec->nb_groups = 0;
+	fec->packets = 0;
+	fec->parities = 0;
+
+	return fec;
+}
+
+/**
+ Returns the open parity group of the given flow (NULL if none)
+*/
+iprp_isd_group_t *group_find(iprp_isd_fec_t *fec, uint16_t flow_id) {
+	for (int i = 0; i < fec->nb_groups; ++i) {
+		if (fec->groups[i].flow_id == flow_id) {
+			return &fec->groups[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ Opens a parity group for the given flow
+
+ If all groups are open, the oldest one is sent first. The group holds its buffer (one reference) until it is sent.
+*/
+iprp_isd_group_t *group_open(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, uint16_t flow_id) {
+	iprp_isd_fec_t *fec = worker->fec;
+
+	if (fec->nb_groups == IPRP_ISD_FEC_FLOWS) {
+		iprp_isd_group_t *oldest = &fec->groups[0];
+		for (int i = 1; i < fec->nb_groups; ++i) {
+			if (fec->groups[i].deadline < oldest->deadline) {
+				oldest = &fec->groups[i];
+			}
+		}
+		group_send(worker, snapshot, oldest);
+	}
+
+	iprp_pktbuf_t *buf = spare_buf(worker, fec->bufs, IPRP_ISD_FEC_BUFS);
+	__atomic_store_n(&buf->refs, 1, __ATOMIC_RELAXED);
+	memset(buf->data, 0, FEC_PARITY_OFFSET + IPRP_FEC_MAX_SIZE);
+
+	iprp_isd_group_t *group = &fec->groups[fec->nb_groups++];
+	group->flow_id = flow_id;
+	group->buf = buf;
+	group->size = 0;
+	group->deadline = clock_ns(CLOCK_MONOTONIC) + IPRP_ISD_FEC_HOLD;
+	return group;
+}
+
+/**
+ Sends the parity packet of the given group and closes it
+
+ The parity is dropped if the flow is gone or not protected anymore.
+*/
+void group_send(iprp_isd_worker_t *worker, iprp_isd_snapshot_t *snapshot, iprp_isd_group_t *group) {
+	iprp_isd_fec_t *fec = worker->fec;
+	iprp_pktbuf_t *buf = group->buf;
+
+	int flow = (group->flow_id <= IPRP_MAX_FLOWS) ? snapshot->flow_index[group->flow_id] : -1;
+	if (flow >= 0 && fec_protects(&snapshot->flows[flow], group->size)) {
+		iprp_peerbase_t *base = &snapshot->flows[flow];
+
+		// Move the parity right after the member list
+		iprp_parity_header_t *parity = (iprp_parity_header_t *) buf->data;
+		size_t members_size = sizeof(iprp_parity_header_t) + parity->nb_members * sizeof(iprp_fec_member_t);
+		memmove(buf->data + members_size, buf->data + FEC_PARITY_OFFSET, group->size);
+
+		// Parity packets have no sequence number, they are neither counted nor measured
+		buf->header.compact.header = snapshot->templates[flow].compact.header;
+		buf->header.compact.header.flags |= IPRP_COMPACT_PARITY;
+		buf->header.compact.header.seq_nb = 0;
+		buf->header_size = sizeof(iprp_compact_header_t);
+		buf->txtime = txtime ? txtime_now() : 0;
+		buf->sampled = false;
+
+		iprp_ind_bitmap_t path = next_path(fec, base, true);
+		if (path) {
+			__atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+			queue_copies(worker, buf, snapshot, flow, path, buf->data, members_size + group->size);
+		}
+		fec->parities++;
+		DEBUG("Parity of flow %u sent (%u packets)", group->flow_id, parity->nb_members);
+	} else {
+		LOG("Parity of flow %u dropped", group->flow_id);
+	}
+	pool_release(buf);
+
+	*group = fec->groups[--fec->nb_groups];
+}
+
+/**
+ Returns the path of the next packet of the given flow (as an IND bitmap)
+
+ The packets use the paths in turn. A parity packet goes on the path of the next packet, without taking its turn:
+ the IRD only learns a path from the packets describing the link, so each path must carry packets.
+*/
+iprp_ind_bitmap_t next_path(iprp_isd_fec_t *fec, iprp_peerbase_t *base, bool parity) {
+	iprp_ind_t inds[IPRP_MAX_IFACE];
+	int nb_inds = 0;
+	for (int i = 0; i < base->host.nb_ifaces; ++i) {
+		if ((1 << base->host.ifaces[i].ind) & base->inds) {
+			inds[nb_inds++] = base->host.ifaces[i].ind;
+		}
+	}
+	if (nb_inds == 0) {
+		return 0;
+	}
+
+	uint8_t next = fec->next_paths[base->flow_id] % nb_inds;
+	if (!parity) {
+		fec->next_paths[base->flow_id] = next + 1;
+	}
+	return 1 << inds[next];
+}
+
+/**
+ Sends the parity packets of the groups whose hold time is over at the given time
+
+ Returns the hold time of the earliest group left open (UINT64_MAX if none), and sets sent if parity packets were sent.
+*/
+uint64_t fec_expire(iprp_isd_worker_t *worker, uint64_t now, bool *sent) {
+	iprp_isd_fec_t *fec = worker->fec;
+	uint64_t next = UINT64_MAX;
+	iprp_isd_snapshot_t *snapshot = NULL;
+	for (int i = 0; i < fec->nb_groups; ) {
+		iprp_isd_group_t *group = &fec->groups[i];
+		if (group->deadline > now) {
+			if (group->deadline < next) {
+				next = group->deadline;
+			}
+			++i;
+			continue;
+		}
+		if (!snapshot) {
+			snapshot = pb_enter(worker->id);
+		}
+		group_send(worker, snapshot, group); // The last group takes its place
+		*sent = true;
+	}
+	if (snapshot) {
+		pb_leave(worker->id);
+	}
+	return next;
+}
+
+/**
+ Logs the forward error correction counters of a worker
+*/
+void fec_log(iprp_isd_fec_t *fec, int worker_id) {
+	LOG("Parity (worker %d): %lu packets, %lu parity packets", worker_id, fec->packets, fec->parities);
+}
\ No newline at end of file
@@ -6,10 +6,13 @@
 #define IPRP_FILE ISD_HANDLE
 
 #include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <linux/ip.h>
 #include <linux/udp.h>
 
@@ -18,31 +21,78 @@
 
 extern time_t curr_time;
 #ifdef IPRP_MULTICAST
-time_t last_allowed_thru = 0; /* Multicast periodical keepalive timer */
+time_t last_allowed_thru[IPRP_MAX_FLOWS + 1]; /* Multicast periodical keepalive timer (per flow ID) */
 #endif
 
 extern iprp_isd_peerbase_t pb;
 extern int sockets[IPRP_MAX_INDS];
+extern int raw_sockets[IPRP_MAX_INDS];
+extern iprp_isd_engine_t engine;
+extern bool gso;
+extern bool txtime;
+extern uint64_t aggregate_hold;
+extern iprp_isd_txtrack_t txtracks[IPRP_MAX_INDS];
+extern iprp_isd_path_t paths[IPRP_MAX_INDS];
 
 /* Function prototypes */
 int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data);
-size_t create_iprp_packet(struct nfq_data *packet, char* *new_buf, struct nfq_q_handle *queue);
-int send_packet(iprp_iface_t *iface, char *packet, size_t packet_size, struct sockaddr_in *addr, iprp_ind_bitmap_t base_inds);
-uint32_t get_verdict();
+size_t create_iprp_packet(iprp_isd_worker_t *worker, struct nfq_data *packet, char* *payload, iprp_isd_snapshot_t *snapshot, int flow);
+int set_verdict(iprp_isd_worker_t *worker, struct nfq_data *packet, uint32_t verdict);
+uint32_t next_seq_nb(uint16_t flow_id);
+int queue_copy(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_ind_t ind, char *payload, size_t payload_size, struct sockaddr_in *addr, iprp_ipudp_t *raw_template);
+iprp_isd_batch_t *path_batch(iprp_isd_worker_t *worker, iprp_ind_t ind);
+uint32_t copies_count(iprp_peerbase_t *base, iprp_ind_bitmap_t inds);
+void worker_wait(iprp_isd_worker_t *worker);
+uint32_t get_verdict(uint16_t flow_id);
 
 /**
- Sets up the queue and forwards packet to the handle function
+ Sets up the worker queue and forwards packet to the handle function
 */
 void* handle_routine(void* arg) {
-	intptr_t queue_id = (intptr_t) arg;
-	printf("Queue ID: %p\n", queue_id);
-	DEBUG("In routine");
+	iprp_isd_worker_t *worker = (iprp_isd_worker_t *) arg;
+	DEBUG("In routine (worker %d, queue %u)", worker->id, worker->queue_id);
 
 	// Setup NFQueue
-	iprp_queue_t nfq;
-	queue_setup(&nfq, queue_id, handle_packet);
+	queue_setup(&worker->nfq, worker->queue_id, handle_packet, worker, IPRP_COPY_PACKET);
 	DEBUG("NFQueue setup");
 
+	// Setup send batches
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		batch_init(&worker->batches[i], sockets[i], gso, false);
+		if (txtime) {
+			worker->batches[i].track = &txtracks[i];
+		}
+		if (engine == IPRP_ENGINE_RAW) {
+			batch_init(&worker->raw_batches[i], raw_sockets[i], false, true);
+		}
+	}
+	DEBUG("Send batches initialized");
+
+	// Setup io_uring
+	if (engine == IPRP_ENGINE_URING) {
+		if (!(worker->uring = malloc(sizeof(iprp_isd_uring_t)))) {
+			ERR("Unable to allocate io_uring", errno);
+		}
+		if (uring_setup(worker->uring, sockets, IPRP_MAX_INDS)) {
+			ERR("Unable to setup io_uring", errno);
+		}
+		DEBUG("io_uring setup");
+	}
+
+	// Setup packet buffers
+	if (!(worker->pool = pool_create())) {
+		ERR("Unable to allocate packet pool", errno);
+	}
+	DEBUG("Packet pool created");
+
+	// Setup aggregation frames
+	if (aggregate_hold > 0) {
+		if (!(worker->aggregator = aggregator_create())) {
+			ERR("Unable to allocate aggregation frames", errno);
+		}
+		DEBUG("Aggregation frames created");
+	}
+
 	// Wait for the peerbase to be loaded the first time
 	pthread_mutex_lock(&pb.mutex);
 	while (!pb.loaded) {
@@ -52,9 +102,25 @@ void* handle_routine(void* arg) {
 	DEBUG("Base loaded");
 
 	// Handle outgoing packets
+	time_t last_stats = curr_time;
+	time_t last_collect = curr_time;
 	while (true) {
+		// Get a free buffer (the payloads of the pending copies point into their receive buffers)
+		if (!(worker->current_buf = pool_next(worker->pool))) {
+			worker->pool->exhausted++;
+			flush_copies(worker);
+			while (!(worker->current_buf = pool_next(worker->pool))) {
+				wait_copies(worker);
+			}
+		}
+
+		// Send the frames and parity packets that are due while waiting for the next packet
+		if (worker->aggregator || worker->fec) {
+			worker_wait(worker);
+		}
+
 		// Get packet
-		int err = get_and_handle(nfq.handle, nfq.fd);
+		int err = get_and_handle_buf(worker->nfq.handle, worker->nfq.fd, worker->current_buf->data, IPRP_PKTBUF_SIZE);
 		if (err) {
 			if (err == IPRP_ERR) {
 				ERR("Unable to retrieve packet from ISD queue", errno);
@@ -62,146 +128,435 @@ void* handle_routine(void* arg) {
 			DEBUG("Error %d while handling packet", err);
 		}
 		DEBUG("Packet handled");
+
+		// Send the pending copies and verdicts once the queue has been drained
+		if (queue_empty(worker->nfq.fd)) {
+			flush_copies(worker);
+			if (verdict_flush(&worker->nfq) == -1) {
+				ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+			}
+		}
+
+		// Read the departure timestamps of the measured copies (all sockets, first worker only)
+		if (txtime && worker->id == 0 && curr_time != last_collect) {
+			for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+				txtime_collect(&txtracks[i]);
+			}
+			last_collect = curr_time;
+		}
+
+		// Report pool usage
+		if (curr_time - last_stats >= IPRP_T_ISD_STATS) {
+			pool_log(worker->pool, worker->id);
+			if (engine == IPRP_ENGINE_URING) {
+				LOG("io_uring (worker %d): %lu copies sent, %lu dropped", worker->id, worker->uring->sent, worker->uring->errors);
+			}
+			if (txtime && worker->id == 0) {
+				txtime_log();
+			}
+			if (worker->aggregator) {
+				aggregate_log(worker->aggregator, worker->id);
+			}
+			if (worker->fec) {
+				fec_log(worker->fec, worker->id);
+			}
+			last_stats = curr_time;
+		}
 	}
 }
 
 /**
  Duplicates a packet and sends it through iPRP
 
- The routine first adds the iPRP header to the packet.
- It then sends it to all the receiver interfaces contained in the peerbase.
+ The routine first finds the flow of the packet from its mark.
+ Small payloads are held in the frame of their flow if aggregation is enabled (the frame is sent later).
+ Otherwise, the routine creates the iPRP header of the packet, and queues one copy for each receiver interface contained in the peerbase
+ (or a single copy, if parity packets protect the flow).
+ The copies are sent by the worker when the queue is drained or when a batch is full,
+ or by the transmit thread of each path when the paths engine is used.
 */
 int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data) {
+	iprp_isd_worker_t *worker = (iprp_isd_worker_t *) data;
 	DEBUG("In handle");
 
-	// Create new packet
-	char* new_packet = NULL;
-	size_t new_size = create_iprp_packet(packet, &new_packet, queue);
-	if (new_size == 0) {
-		ERR("Unable to create IPRP packet", errno);
+	// Get the flow table snapshot for the header and the copies
+	iprp_isd_snapshot_t *snapshot = pb_enter(worker->id);
+
+	// Find the flow of the packet
+	uint16_t flow_id = nfq_get_nfmark(packet) & IPRP_FLOW_ID_MASK;
+	int flow = (flow_id <= IPRP_MAX_FLOWS) ? snapshot->flow_index[flow_id] : -1;
+	if (flow < 0) {
+		// Flow not loaded yet or expired, let the packet through without iPRP
+		pb_leave(worker->id);
+		if (set_verdict(worker, packet, NF_ACCEPT) == -1) {
+			ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+		}
+		DEBUG("Packet of unknown flow %u accepted", flow_id);
+		return 0;
 	}
-	DEBUG("New packet of size %lu created", new_size);
 
-	struct sockaddr_in dest_addr;
-#ifndef IPRP_MULTICAST
-	// Send packet on all interfaces
-	pthread_mutex_lock(&pb.mutex);
+	// Payloads that do not fit in a datagram with the iPRP header go through without iPRP
+	char *payload = NULL;
+	if (packet_payload(packet, &payload) > IPRP_MAX_UDP_PAYLOAD - sizeof(iprp_isd_header_t)) {
+		pb_leave(worker->id);
+		if (set_verdict(worker, packet, NF_ACCEPT) == -1) {
+			ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+		}
+		LOG("Packet of flow %u too big for iPRP accepted", flow_id);
+		return 0;
+	}
 
-	for (int i = 0; i < pb.base.host.nb_ifaces; ++i) {
-		printf("Iface %d, ind 0x%x, addr 0x%x\n", i, pb.base.host.ifaces[i].ind, pb.base.host.ifaces[i].addr.s_addr);
-		printf("dest 0x%x", pb.base.dest_addr[pb.base.host.ifaces[i].ind].s_addr);
-		sockaddr_fill(&dest_addr, pb.base.dest_addr[pb.base.host.ifaces[i].ind], IPRP_DATA_PORT);
+	// Hold small payloads in the frame of the flow
+	if (worker->aggregator && aggregate_add(worker, packet, snapshot, flow)) {
+		pb_leave(worker->id);
+		DEBUG("Payload added to the frame of flow %u", flow_id);
+		return 0;
+	}
 
-		int err = send_packet(&pb.base.host.ifaces[i], new_packet, new_size, &dest_addr, pb.base.inds);
-		if (err) {
-			pthread_mutex_unlock(&pb.mutex);
-			ERR("Unable to send packet", errno);			
+	// Create iPRP header
+	size_t payload_size = create_iprp_packet(worker, packet, &payload, snapshot, flow);
+	DEBUG("New packet of size %lu created", payload_size + worker->current_buf->header_size);
+
+	// The copies reference the receive buffer, keep it until they are all sent
+	pool_take(worker->pool, 1);
+	send_packet(worker, worker->current_buf, snapshot, flow, payload, payload_size);
+	pool_release(worker->current_buf);
+
+	pb_leave(worker->id);
+	
+	DEBUG("Outgoing packet handled. All duplicate packets queued.");
+	
+	return 0;
+}
+
+/**
+ Sends the copies of the given packet buffer
+
+ The caller holds a reference on the buffer while the copies are queued, and releases it afterwards.
+ Packets of flows protected by parity packets go on a single path, the others are duplicated on all the paths of the flow.
+*/
+void send_packet(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_isd_snapshot_t *snapshot, int flow, char *payload, size_t payload_size) {
+	iprp_peerbase_t *base = &snapshot->flows[flow];
+	if (fec_protects(base, payload_size)) {
+		fec_send(worker, buf, snapshot, flow, payload, payload_size);
+		return;
+	}
+
+	__atomic_add_fetch(&buf->refs, copies_count(base, base->inds), __ATOMIC_RELAXED);
+	queue_copies(worker, buf, snapshot, flow, base->inds, payload, payload_size);
+}
+
+/**
+ Returns the number of copies sent on the given INDs for a packet of the given flow
+*/
+uint32_t copies_count(iprp_peerbase_t *base, iprp_ind_bitmap_t inds) {
+	uint32_t count = 0;
+	for (int i = 0; i < base->host.nb_ifaces; ++i) {
+		if ((1 << base->host.ifaces[i].ind) & inds) {
+			count++;
 		}
-		DEBUG("Packet sent on interface %d to %x", i, dest_addr.sin_addr.s_addr);
 	}
+	return count;
+}
 
-	pthread_mutex_unlock(&pb.mutex);
-#else
+/**
+ Queues one copy of the given packet buffer for each of the given receiver interfaces of its flow
+
+ The reference count of the buffer must already account for the copies.
+*/
+void queue_copies(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_isd_snapshot_t *snapshot, int flow, iprp_ind_bitmap_t inds, char *payload, size_t payload_size) {
+	iprp_peerbase_t *base = &snapshot->flows[flow];
+
+	struct sockaddr_in dest_addr;
+#ifdef IPRP_MULTICAST
 	// Send packet to group
-	sockaddr_fill(&dest_addr, pb.base.link.dest_addr, IPRP_DATA_PORT);
+	sockaddr_fill(&dest_addr, base->link.dest_addr, IPRP_DATA_PORT);
+#endif
 
-	pthread_mutex_lock(&pb.mutex);
-	
-	for (int i = 0; i < pb.base.host.nb_ifaces; ++i) {
-		int err = send_packet(&pb.base.host.ifaces[i], new_packet, new_size, &dest_addr, pb.base.inds);
+	// Queue packet on all interfaces
+	for (int i = 0; i < base->host.nb_ifaces; ++i) {
+		iprp_iface_t *iface = &base->host.ifaces[i];
+		if (!((1 << iface->ind) & inds)) {
+			continue;
+		}
+	#ifndef IPRP_MULTICAST
+		sockaddr_fill(&dest_addr, base->dest_addr[iface->ind], IPRP_DATA_PORT);
+	#endif
+
+		int err = queue_copy(worker, buf, iface->ind, payload, payload_size, &dest_addr, &snapshot->raw_templates[flow][iface->ind]);
 		if (err) {
-			pthread_mutex_unlock(&pb.mutex);
-			ERR("Unable to send packet", errno);			
+			ERR("Unable to send packet", errno);
 		}
-		DEBUG("Packet sent on interface %d to %x", i, dest_addr.sin_addr.s_addr);
+		DEBUG("Packet queued on interface %d to %x", i, dest_addr.sin_addr.s_addr);
 	}
-	
-	pthread_mutex_unlock(&pb.mutex);
-#endif
-	
-	DEBUG("Outgoing packet handled. All duplicate packets sent.");
-	
-	return 0;
 }
 
 /**
- Creates an iPRP packet from the given NFQueue packet
+ Creates the iPRP header for the given NFQueue packet
+
+ The header is copied from the flow template into the packet buffer and only the sequence number is set.
+ The payload is not copied: the returned pointer points to the UDP payload in the receive buffer.
+*/
+size_t create_iprp_packet(iprp_isd_worker_t *worker, struct nfq_data *packet, char* *payload, iprp_isd_snapshot_t *snapshot, int flow) {
+	// Locate UDP payload
+	size_t payload_size = packet_payload(packet, payload);
+
+	// Create IPRP header
+	header_fill(worker, worker->current_buf, snapshot, flow);
+	DEBUG("IPRP header created");
+
+	// Set verdict in queue
+	packet_verdict(worker, packet, snapshot->flows[flow].flow_id);
+
+	return payload_size;
+}
+
+/**
+ Locates the UDP payload of the given NFQueue packet
 */
-size_t create_iprp_packet(struct nfq_data *packet, char* *new_buf, struct nfq_q_handle *queue) {
-	static uint32_t seq_nb = 1;
+size_t packet_payload(struct nfq_data *packet, char* *payload) {
 	int bytes;
 	unsigned char *buf;
-	
-	// Get packet payload
 	if ((bytes = nfq_get_payload(packet, &buf)) == -1) {
 		ERR("Unable to retrieve payload from received packet", IPRP_ERR_NFQUEUE);
 	}
 	DEBUG("Got payload");
 
-	// Create new packet
-	char *payload = buf + sizeof(struct iphdr) + sizeof(struct udphdr);
-	size_t payload_size = bytes - sizeof(struct iphdr) - sizeof(struct udphdr);
-	char* new_packet = malloc(payload_size + sizeof(iprp_header_t));
-	if (!new_packet) {
-		return 0;
-	}
-	memcpy(new_packet + sizeof(iprp_header_t), payload, payload_size);
-	DEBUG("Created new packet");
+	*payload = (char *) buf + sizeof(struct iphdr) + sizeof(struct udphdr);
+	return bytes - sizeof(struct iphdr) - sizeof(struct udphdr);
+}
 
-	// Create IPRP header
-	iprp_header_t *header = (iprp_header_t *) new_packet;
-	header->version = IPRP_VERSION;
-	header->seq_nb = seq_nb;
-	header->dest_port = pb.base.link.dest_port;
-#ifndef IPRP_MULTICAST
-	header->dest_addr.s_addr = pb.base.link.dest_addr.s_addr;
-#endif
-	memcpy(&header->snsid, pb.base.link.snsid, IPRP_SNSID_SIZE);
-	DEBUG("IPRP header created");
+/**
+ Fills the iPRP header of the given packet buffer from the template of its flow, with the next sequence number
+*/
+void header_fill(iprp_isd_worker_t *worker, iprp_pktbuf_t *pktbuf, iprp_isd_snapshot_t *snapshot, int flow) {
+	uint16_t flow_id = snapshot->flows[flow].flow_id;
+	uint32_t seq_nb = next_seq_nb(flow_id);
+	if (snapshot->compact[flow]) {
+		iprp_compact_header_t *header = &pktbuf->header.compact.header;
+		*header = snapshot->templates[flow].compact.header;
+		header->seq_nb = seq_nb;
+		pktbuf->header_size = sizeof(iprp_compact_header_t);
 
-	// Compute next sequence number
-	seq_nb = (seq_nb == UINT32_MAX) ? 1 : seq_nb + 1;
+		// Describe the link from time to time, so that receivers can map the flow ID to it
+		if (seq_nb <= IPRP_ISD_LINK_FIRST || seq_nb % IPRP_ISD_LINK_PERIOD == 0) {
+			header->flags |= IPRP_COMPACT_LINK;
+			pktbuf->header.compact.link = snapshot->templates[flow].compact.link;
+			pktbuf->header_size += sizeof(iprp_compact_link_t);
+		}
+	} else {
+		pktbuf->header.full = snapshot->templates[flow].full;
+		pktbuf->header.full.seq_nb = seq_nb;
+		pktbuf->header_size = sizeof(iprp_header_t);
+	}
 
-	// Apply changes to the given pointer
-	*new_buf = new_packet;
+	// All copies leave at the same time, a little after the last one is queued (some packets are measured)
+	if (txtime) {
+		pktbuf->txtime = txtime_now() + IPRP_ISD_TXTIME_LEAD;
+		pktbuf->sampled = (pktbuf->txtime - worker->last_sample >= IPRP_ISD_TXTIME_SAMPLE);
+		if (pktbuf->sampled) {
+			worker->last_sample = pktbuf->txtime;
+		}
+	}
+}
 
-	// Set verdict in queue
+/**
+ Sets the verdict of a packet whose payload is sent through iPRP
+
+ The packet is dropped, or let through from time to time in multicast.
+*/
+void packet_verdict(iprp_isd_worker_t *worker, struct nfq_data *packet, uint16_t flow_id) {
 #ifndef IPRP_MULTICAST
 	uint32_t verdict = NF_DROP;
 #else
-	uint32_t verdict = get_verdict();
+	uint32_t verdict = get_verdict(flow_id);
 #endif
+	if (set_verdict(worker, packet, verdict) == -1) {
+		ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+	}
+	DEBUG("Packet verdict set to %u", verdict);
+}
+
+/**
+ Sets the verdict of an unmodified packet
+
+ The ISD never modifies the packets it queues, so all its verdicts are batched:
+ a burst of packets of known flows is dropped with a single netlink message.
+*/
+int set_verdict(iprp_isd_worker_t *worker, struct nfq_data *packet, uint32_t verdict) {
 	struct nfqnl_msg_packet_hdr *nfq_header = nfq_get_msg_packet_hdr(packet);
 	if (!nfq_header) {
 		ERR("Unable to retrieve header form received packet", IPRP_ERR_NFQUEUE);
 	}
-	if (nfq_set_verdict(queue, ntohl(nfq_header->packet_id), verdict, bytes, buf) == -1) {
-		ERR("Unable to set verdict", IPRP_ERR_NFQUEUE);
+	return verdict_batch(&worker->nfq, ntohl(nfq_header->packet_id), verdict);
+}
+
+/**
+ Allocates the next sequence number of the given flow (0 is never used)
+
+ Workers allocate concurrently, so the counters are only accessed atomically.
+*/
+uint32_t next_seq_nb(uint16_t flow_id) {
+	uint32_t seq;
+	do {
+		seq = __atomic_fetch_add(&pb.seq_nbs[flow_id], 1, __ATOMIC_RELAXED);
+	} while (seq == 0);
+	return seq;
+}
+
+/**
+ Queues a copy of the given packet buffer on the given IND
+
+ With the paths engine, a copy that does not fit in the ring of the path is dropped (and counted by the path).
+ With the raw engine, copies too big for a single datagram go through the UDP socket of the path, which fragments them.
+*/
+int queue_copy(iprp_isd_worker_t *worker, iprp_pktbuf_t *buf, iprp_ind_t ind, char *payload, size_t payload_size, struct sockaddr_in *addr, iprp_ipudp_t *raw_template) {
+	if (IPRP_ENGINE_THREADED(engine)) {
+		iprp_isd_copy_t copy = {
+			.buf = buf,
+			.payload = payload,
+			.payload_size = payload_size,
+			.addr = *addr
+		};
+		if (engine == IPRP_ENGINE_XDP) {
+			copy.ipudp = *raw_template; // The snapshot may be replaced before the copy is sent
+		}
+		if (!tx_push(&paths[ind], worker->id, &copy)) {
+			pool_release(buf);
+		}
+		return 0;
+	}
+	if (engine == IPRP_ENGINE_URING) {
+		return uring_add(worker->uring, ind, buf, payload, payload_size, addr);
+	}
+	if (engine == IPRP_ENGINE_RAW && buf->header_size + payload_size <= IPRP_ISD_RAW_MAX_SIZE) {
+		return batch_add(&worker->raw_batches[ind], ind, buf, payload, payload_size, addr, raw_template);
 	}
-	DEBUG("Packet verdict set to %u", verdict);
 
-	return payload_size + sizeof(iprp_header_t);
+	return batch_add(path_batch(worker, ind), ind, buf, payload, payload_size, addr, NULL);
 }
 
 /**
- Sends a packet on the given interface
+ Returns the worker send batch for the given IND
+
+ In unicast, the sockets are not bound to an interface (the route to the destination selects the path),
+ so all the copies of a packet go through the same socket and leave with a single sendmmsg.
+ In multicast, the outgoing interface is a socket option, so each IND has its own batch.
+ With GSO, each IND also has its own batch, so that the successive copies of a path can be coalesced.
 */
-int send_packet(iprp_iface_t *iface, char *packet, size_t packet_size, struct sockaddr_in *addr, iprp_ind_bitmap_t base_inds) {
-	if ((1 << iface->ind) & base_inds) {
-		if (sendto(sockets[iface->ind], packet, packet_size, 0, (struct sockaddr *) addr, sizeof(struct sockaddr)) == -1) {
-			return IPRP_ERR;
+iprp_isd_batch_t *path_batch(iprp_isd_worker_t *worker, iprp_ind_t ind) {
+#ifndef IPRP_MULTICAST
+	return gso ? &worker->batches[ind] : &worker->batches[0];
+#else
+	return &worker->batches[ind];
+#endif
+}
+
+/**
+ Sends all pending copies of the worker
+
+ With the paths engine, the copies are already queued: the idle transmit threads are woken up.
+ With the io_uring engine, the pending requests are submitted with a single system call.
+*/
+void flush_copies(iprp_isd_worker_t *worker) {
+	if (IPRP_ENGINE_THREADED(engine)) {
+		tx_kick();
+		return;
+	}
+	if (engine == IPRP_ENGINE_URING) {
+		if (uring_submit(worker->uring, false)) {
+			ERR("Unable to submit packets", errno);
+		}
+		return;
+	}
+
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		if (worker->batches[i].count > 0 && batch_flush(&worker->batches[i])) {
+			ERR("Unable to send packet", errno);
+		}
+		if (worker->raw_batches[i].count > 0 && batch_flush(&worker->raw_batches[i])) {
+			ERR("Unable to send packet", errno);
+		}
+	}
+}
+
+/**
+ Waits for sent copies to give their buffers back to the pool
+
+ The batch engine releases all buffers when flushing, so only the asynchronous engines wait.
+*/
+void wait_copies(iprp_isd_worker_t *worker) {
+	if (engine == IPRP_ENGINE_URING) {
+		if (uring_submit(worker->uring, true)) {
+			ERR("Unable to wait for packets", errno);
+		}
+	} else {
+		sched_yield(); // Transmit threads are still sending the copies of the buffer
+	}
+}
+
+/**
+ Returns a buffer of the given set whose copies have all been sent, waiting for one if needed
+*/
+iprp_pktbuf_t *spare_buf(iprp_isd_worker_t *worker, iprp_pktbuf_t *bufs, int nb_bufs) {
+	while (true) {
+		for (int i = 0; i < nb_bufs; ++i) {
+			if (__atomic_load_n(&bufs[i].refs, __ATOMIC_ACQUIRE) == 0) {
+				return &bufs[i];
+			}
+		}
+		flush_copies(worker);
+		wait_copies(worker);
+	}
+}
+
+/**
+ Sends the frames and parity packets that are due, and waits for the next packet of the queue
+
+ While frames or parity groups are open, the wait is bounded by the earliest of their deadlines.
+*/
+void worker_wait(iprp_isd_worker_t *worker) {
+	while (true) {
+		uint64_t now = clock_ns(CLOCK_MONOTONIC);
+		uint64_t next = UINT64_MAX;
+		bool sent = false;
+		if (worker->aggregator) {
+			next = aggregate_expire(worker, now, &sent);
+		}
+		if (worker->fec) {
+			uint64_t group_next = fec_expire(worker, now, &sent);
+			if (group_next < next) {
+				next = group_next;
+			}
+		}
+		if (sent) {
+			flush_copies(worker);
+			continue;
+		}
+		if (next == UINT64_MAX) {
+			return;
+		}
+
+		// Wait for a packet until the next deadline
+		struct pollfd fd = { .fd = worker->nfq.fd, .events = POLLIN };
+		struct timespec timeout = { .tv_sec = (next - now) / 1000000000, .tv_nsec = (next - now) % 1000000000 };
+		int ready = ppoll(&fd, 1, &timeout, NULL);
+		if (ready == -1 && errno != EINTR) {
+			ERR("Unable to wait for packets", errno);
+		}
+		if (ready > 0) {
+			return;
 		}
 	}
-	return 0;
 }
 
 #ifdef IPRP_MULTICAST
 /**
  Returns whether the packet should be let through (multicast only)
 */
-uint32_t get_verdict() {
-	if (curr_time - last_allowed_thru >= IPRP_T_ISD_ALLOW) {
-		last_allowed_thru = curr_time;
+uint32_t get_verdict(uint16_t flow_id) {
+	if (curr_time - last_allowed_thru[flow_id] >= IPRP_T_ISD_ALLOW) {
+		last_allowed_thru[flow_id] = curr_time;
 		return NF_ACCEPT;
 	}
 	return NF_DROP;
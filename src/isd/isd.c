@@ -6,6 +6,8 @@
 #define IPRP_FILE ISD_MAIN
 
 #include <errno.h>
+#include <string.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "isd.h"
@@ -13,33 +15,99 @@
 
 /* Global variables */
 int sockets[IPRP_MAX_INDS];
+int raw_sockets[IPRP_MAX_INDS];
 iprp_isd_peerbase_t pb = {
+	.current = NULL,
+	.version = 0,
+	.nb_readers = 0,
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.cond = PTHREAD_COND_INITIALIZER,
 	.loaded = false
 };
 
+iprp_isd_worker_t workers[IPRP_ISD_MAX_WORKERS];
+iprp_isd_engine_t engine = IPRP_ENGINE_BATCH;
+bool gso = false;
+bool txtime = false;
+uint64_t aggregate_hold = 0; // Hold time of the aggregation frames (nanoseconds, 0 if disabled)
+iprp_isd_txtrack_t txtracks[IPRP_MAX_INDS];
+iprp_isd_path_t paths[IPRP_MAX_INDS];
+
 /* Function prototypes */
 int create_socket();
+int create_raw_socket();
 
 /**
  Sender daemon entry point
 
- The ISD first gets its queue and peerbase path from its arguments.
+ The ISD first gets its transmit engine, queue range and peerbases path from its arguments.
  It then creates the sockets it will use to send iPRP packets.
- It finally launches the needed routines and waits forever.
+ It finally launches the needed routines (one worker per queue) and waits forever.
 */
-int main(int argc, char const *argv[]) {
+int main(int argc, char *argv[]) {
 	// Thread variables
 	pthread_t pb_thread;
-	pthread_t handle_thread;
 	pthread_t time_thread;
 
 	int err;
 	
-	// Get arguments
+	// Get options
+	int opt;
+	while ((opt = getopt(argc, argv, "e:gta:")) != -1) {
+		switch (opt) {
+			case 'e':
+				if (!strcmp(optarg, "batch")) {
+					engine = IPRP_ENGINE_BATCH;
+				} else if (!strcmp(optarg, "paths")) {
+					engine = IPRP_ENGINE_PATHS;
+				} else if (!strcmp(optarg, "uring")) {
+					engine = IPRP_ENGINE_URING;
+				} else if (!strcmp(optarg, "raw")) {
+					engine = IPRP_ENGINE_RAW;
+				} else if (!strcmp(optarg, "xdp")) {
+					engine = IPRP_ENGINE_XDP;
+				} else if (!strcmp(optarg, "bpf")) {
+					engine = IPRP_ENGINE_BPF;
+				} else {
+					return EXIT_FAILURE;
+				}
+				break;
+			case 'g':
+				gso = true;
+				break;
+			case 't':
+				txtime = true;
+				break;
+			case 'a':
+				aggregate_hold = strtoull(optarg, NULL, 10) * 1000;
+				break;
+			default:
+				ERR("Unknown option", IPRP_ERR);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	// Get arguments (the optional queue count is the size of the --queue-balance range)
+	if (argc < 3) {
+		ERR("Missing arguments (queue and peerbase file)", IPRP_ERR);
+	}
 	int queue_id = atoi(argv[1]);
 	char* base_path = argv[2];
+	int nb_queues = (argc > 3) ? atoi(argv[3]) : 1;
+	if (nb_queues < 1 || nb_queues > IPRP_ISD_MAX_WORKERS) {
+		ERR("Invalid queue count", nb_queues);
+	}
+	if (engine == IPRP_ENGINE_BPF) {
+		nb_queues = 0; // The tc program sends the copies, there is no queue to handle
+	}
+	if (engine != IPRP_ENGINE_BATCH) {
+		txtime = false; // Departure times are only set on the batches of the workers
+	}
+#ifdef IPRP_MULTICAST
+	aggregate_hold = 0; // Receivers deliver the datagrams of a frame on the loopback, which would send them to the group
+#endif
+	pb.nb_readers = nb_queues;
 	DEBUG("Started");
 
 	// Create send sockets and configure multicast outgoing interface
@@ -47,6 +115,16 @@ int main(int argc, char const *argv[]) {
 		if ((sockets[i] = create_socket()) < 0) {
 			ERR("Unable to setup socket", errno);
 		}
+		if (txtime && txtime_setup(&txtracks[i], sockets[i])) {
+			ERR("Unable to setup departure times", errno);
+		}
+	}
+	if (engine == IPRP_ENGINE_RAW) {
+		for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+			if ((raw_sockets[i] = create_raw_socket()) < 0) {
+				ERR("Unable to setup raw socket", errno);
+			}
+		}
 	}
 	DEBUG("Sockets created");
 
@@ -62,11 +140,15 @@ int main(int argc, char const *argv[]) {
 	}
 	DEBUG("Peerbase thread created");
 
-	// Launch send routine
-	if ((err = pthread_create(&handle_thread, NULL, handle_routine, (void*) queue_id))) {
-		ERR("Unable to setup handle thread", err);
+	// Launch send routines
+	for (int i = 0; i < nb_queues; ++i) {
+		workers[i].id = i;
+		workers[i].queue_id = queue_id + i;
+		if ((err = pthread_create(&workers[i].thread, NULL, handle_routine, &workers[i]))) {
+			ERR("Unable to setup handle thread", err);
+		}
 	}
-	DEBUG("Handle thread created");
+	DEBUG("%d handle threads created", nb_queues);
 	
 	LOG("Sender daemon successfully created");
 
@@ -79,7 +161,7 @@ int main(int argc, char const *argv[]) {
 		ERR("Unable to join on peerbase thread", err);
 	}
 	ERR("Peerbase thread unexpectedly finished execution", (int) return_value);
-	if ((err = pthread_join(handle_thread, &return_value))) {
+	if ((err = pthread_join(workers[0].thread, &return_value))) {
 		ERR("Unable to join on handle thread", err);
 	}
 	ERR("Handle thread unexpectedly finished execution", (int) return_value);
@@ -112,6 +194,23 @@ int create_socket() {
 	return sock;
 }
 
+/**
+ Creates an ISD raw socket (the copies carry their own IP header)
+*/
+int create_raw_socket() {
+	int sock;
+	if ((sock = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1) {
+		return IPRP_ERR;
+	}
+
+#ifdef IPRP_MULTICAST
+	bool loopback = false;
+	setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loopback, sizeof(loopback));
+#endif
+
+	return sock;
+}
+
 /*
 void cleanup() {
 	// TODO implement clean ISD shutdown
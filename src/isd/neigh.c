@@ -0,0 +1,117 @@
+/**\file isd/neigh.c
+ * Interfaces and neighbours of the paths (engines that build the Ethernet header)
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_TX
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+
+#include "isd.h"
+
+/**
+ Finds the interface with the given address
+
+ The name, Ethernet address and MTU (if not NULL) of the interface are returned, along with its index (-1 if not found).
+*/
+int iface_lookup(struct in_addr addr, char *ifname, unsigned char *mac, unsigned int *mtu) {
+	struct ifaddrs *ifaddrs;
+	if (getifaddrs(&ifaddrs) == -1) {
+		return -1;
+	}
+
+	int ifindex = -1;
+	for (struct ifaddrs *ifa = ifaddrs; ifa; ifa = ifa->ifa_next) {
+		if (ifa->ifa_addr && ifa->ifa_addr->sa_family == AF_INET
+			&& ((struct sockaddr_in *) ifa->ifa_addr)->sin_addr.s_addr == addr.s_addr) {
+			strncpy(ifname, ifa->ifa_name, IF_NAMESIZE - 1);
+			ifname[IF_NAMESIZE - 1] = '\0';
+			ifindex = if_nametoindex(ifname);
+			break;
+		}
+	}
+	freeifaddrs(ifaddrs);
+	if (ifindex <= 0) {
+		return -1;
+	}
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock == -1) {
+		return -1;
+	}
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, IF_NAMESIZE - 1);
+	int err = ioctl(sock, SIOCGIFHWADDR, &ifr);
+	if (!err) {
+		memcpy(mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+		if (mtu) {
+			err = ioctl(sock, SIOCGIFMTU, &ifr);
+			*mtu = ifr.ifr_mtu;
+		}
+	}
+	close(sock);
+	if (err == -1) {
+		return -1;
+	}
+
+	return ifindex;
+}
+
+/**
+ Finds the Ethernet address of the given next hop on the given interface
+
+ Multicast addresses are mapped directly. Unicast addresses are read from the ARP table,
+ the function returns false if the neighbour is not resolved (or not on the link).
+*/
+bool neigh_lookup(const char *ifname, uint32_t addr, unsigned char *mac) {
+	if (IN_MULTICAST(ntohl(addr))) {
+		uint32_t group = ntohl(addr);
+		mac[0] = 0x01;
+		mac[1] = 0x00;
+		mac[2] = 0x5e;
+		mac[3] = (group >> 16) & 0x7f;
+		mac[4] = (group >> 8) & 0xff;
+		mac[5] = group & 0xff;
+		return true;
+	}
+
+	FILE *file = fopen("/proc/net/arp", "r");
+	if (!file) {
+		return false;
+	}
+
+	char line[256];
+	bool found = false;
+	while (fgets(line, sizeof(line), file)) {
+		char ip[32], hw[32], device[IF_NAMESIZE + 1];
+		unsigned int type, flags;
+		if (sscanf(line, "%31s 0x%x 0x%x %31s %*s %16s", ip, &type, &flags, hw, device) != 5) {
+			continue; // Header line
+		}
+		struct in_addr neighbour;
+		if (!(flags & 0x2) || strcmp(device, ifname) || !inet_aton(ip, &neighbour) || neighbour.s_addr != addr) {
+			continue; // Incomplete entry or other neighbour
+		}
+		unsigned int bytes[ETH_ALEN];
+		if (sscanf(hw, "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) == ETH_ALEN) {
+			for (int i = 0; i < ETH_ALEN; ++i) {
+				mac[i] = bytes[i];
+			}
+			found = true;
+		}
+		break;
+	}
+	fclose(file);
+
+	DEBUG("Neighbour %x %s on %s", addr, found ? "resolved" : "unknown", ifname);
+	return found;
+}
\ No newline at end of file
@@ -1,11 +1,13 @@
 /**\file isd/peerbase.c
- * Peerbase handler on the ISD side
+ * Peerbase (flow table) handler on the ISD side
  * 
  * \author Loic Ottet (loic.ottet@epfl.ch)
  */
 #define IPRP_FILE ISD_PB
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/socket.h>
 #include <pthread.h>
@@ -15,50 +17,256 @@
 
 extern iprp_isd_peerbase_t pb;
 extern int sockets[];
+extern int raw_sockets[];
+extern iprp_isd_engine_t engine;
+extern bool txtime;
+extern iprp_isd_path_t paths[IPRP_MAX_INDS];
+
+/* Function prototypes */
+bool pb_changed(iprp_peerbase_t *bases, int count);
+void pb_publish(iprp_peerbase_t *bases, int count);
+void pb_synchronize();
+void create_header_template(iprp_isd_header_t *template, iprp_peerbase_t *base);
+void create_raw_templates(iprp_ipudp_t *templates, iprp_peerbase_t *base);
 
 /**
- Caches the peerbase
+ Caches the flow table
 
- The routine periodically loads the peerbase from file and updates its cache.
- The first time it does so, it signals the handling thread that it can begin to send packets.
+ The routine periodically loads the peerbases of all flows from file.
+ If they changed, the routine publishes them as a new snapshot for the workers.
+ The first time it does so, it signals the workers that they can begin to send packets.
 */
 void* pb_routine(void *arg) {
 	// Get argument
 	char* base_path = arg;
+	bool bpf_complete = false;
 	DEBUG("In routine");
 
 	while(true) {
-		iprp_peerbase_t temp;
+		iprp_peerbase_t *bases;
+		int count;
 
-		// Load peerbase from file
-		int err = peerbase_load(base_path, &temp);
+		// Load peerbases from file
+		int err = peerbases_load(base_path, &count, &bases);
 		if (err) {
-			ERR("Unable to load peerbase", err);
+			ERR("Unable to load peerbases", err);
+		}
+		if (count > IPRP_MAX_FLOWS) {
+			count = IPRP_MAX_FLOWS;
+		}
+		DEBUG("%d peerbases loaded", count);
+
+		// Publish if changed
+		bool changed = pb_changed(bases, count);
+		if (changed) {
+		#ifdef IPRP_MULTICAST
+			// Update sockets according to loaded peerbase (all flows share the host interfaces)
+			if (count > 0) {
+				for (int i = 0; i < bases[0].host.nb_ifaces; ++i) {
+					iprp_iface_t iface = bases[0].host.ifaces[i];
+					if (setsockopt(sockets[iface.ind], IPPROTO_IP, IP_MULTICAST_IF, &iface.addr, sizeof(iface.addr)) == -1) {
+						ERR("Unable to set outgoing interface", errno);
+					}
+					if (engine == IPRP_ENGINE_RAW && setsockopt(raw_sockets[iface.ind], IPPROTO_IP, IP_MULTICAST_IF, &iface.addr, sizeof(iface.addr)) == -1) {
+						ERR("Unable to set outgoing interface", errno);
+					}
+				}
+				DEBUG("Sockets updated");
+			}
+		#endif
+
+			// Start the transmit threads of the host interfaces before the flows can use them
+			if (IPRP_ENGINE_THREADED(engine) && count > 0) {
+				for (int i = 0; i < bases[0].host.nb_ifaces; ++i) {
+					tx_start(&paths[bases[0].host.ifaces[i].ind], &bases[0].host.ifaces[i]);
+				}
+			}
+			if (txtime && count > 0) {
+				for (int i = 0; i < bases[0].host.nb_ifaces; ++i) {
+					txtime_qdisc(&bases[0].host.ifaces[i]);
+				}
+			}
+			if (engine == IPRP_ENGINE_BPF && count > 0) {
+				for (int i = 0; i < bases[0].host.nb_ifaces; ++i) {
+					bpf_attach(&bases[0].host.ifaces[i]);
+				}
+			}
+
+			pb_publish(bases, count);
+			DEBUG("Flow table published");
 		}
-		DEBUG("Peerbase loaded");
-
-		// Update
-		pthread_mutex_lock(&pb.mutex);
-		pb.base = temp;
-		pthread_mutex_unlock(&pb.mutex);
-		DEBUG("Peerbase cached");
-
-	#ifdef IPRP_MULTICAST
-		// Update sockets according to loaded peerbase (no need to lock nor correct dropped sockets)
-		for (int i = 0; i < pb.base.host.nb_ifaces; ++i) {
-			iprp_iface_t iface = pb.base.host.ifaces[i];
-			if (setsockopt(sockets[iface.ind], IPPROTO_IP, IP_MULTICAST_IF, &iface.addr, sizeof(iface.addr)) == -1) {
-				ERR("Unable to set outgoing interface", errno);
+		free(bases);
+
+		// Write the flows to the tc program (again while some neighbours are unknown)
+		if (engine == IPRP_ENGINE_BPF) {
+			if (changed || !bpf_complete) {
+				bpf_complete = bpf_publish(pb.current);
 			}
+			bpf_log();
 		}
-		DEBUG("Sockets updated");
-	#endif
 
 		// Allow launching of send routine
-		pb.loaded = true;
-		pthread_cond_signal(&pb.cond);
+		if (!pb.loaded) {
+			pthread_mutex_lock(&pb.mutex);
+			pb.loaded = true;
+			pthread_cond_signal(&pb.cond);
+			pthread_mutex_unlock(&pb.mutex);
+		}
 
-		LOG("Peerbase cached");
+		LOG("Peerbases cached");
 		sleep(IPRP_T_PB_CACHE);
 	}
+}
+
+/**
+ Returns whether the given peerbases differ from the current snapshot
+
+ The peerbases left out of the snapshots (invalid flow ID) are skipped, as pb_publish does.
+ Only this thread writes snapshots, no need to protect the read.
+*/
+bool pb_changed(iprp_peerbase_t *bases, int count) {
+	if (!pb.current) {
+		return true;
+	}
+	int nb_flows = 0;
+	for (int i = 0; i < count; ++i) {
+		iprp_peerbase_t *base = &bases[i];
+		if (base->flow_id == 0 || base->flow_id > IPRP_MAX_FLOWS) {
+			continue;
+		}
+		if (nb_flows == pb.current->nb_flows || memcmp(&pb.current->flows[nb_flows], base, sizeof(iprp_peerbase_t))) {
+			return true;
+		}
+		nb_flows++;
+	}
+	return nb_flows != pb.current->nb_flows;
+}
+
+/**
+ Publishes a new flow table snapshot
+
+ The new table is written in the unused snapshot, which becomes current by swapping the pointer.
+ The iPRP header templates of the flows are built here, so that workers only set the sequence number.
+*/
+void pb_publish(iprp_peerbase_t *bases, int count) {
+	iprp_isd_snapshot_t *spare = (pb.current == &pb.snapshots[0]) ? &pb.snapshots[1] : &pb.snapshots[0];
+
+	// Wait until no worker uses the spare snapshot anymore
+	pb_synchronize();
+
+	for (int i = 0; i <= IPRP_MAX_FLOWS; ++i) {
+		spare->flow_index[i] = -1;
+	}
+	spare->nb_flows = 0;
+	for (int i = 0; i < count; ++i) {
+		iprp_peerbase_t *base = &bases[i];
+		if (base->flow_id == 0 || base->flow_id > IPRP_MAX_FLOWS) {
+			continue;
+		}
+
+		// New flow (or flow ID reused for another link), restart its sequence numbers
+		int old = pb.current ? pb.current->flow_index[base->flow_id] : -1;
+		if (old < 0 || memcmp(pb.current->flows[old].link.snsid, base->link.snsid, IPRP_SNSID_SIZE)) {
+			__atomic_store_n(&pb.seq_nbs[base->flow_id], 1, __ATOMIC_RELAXED);
+			if (engine == IPRP_ENGINE_BPF) {
+				bpf_reset_seq(base->flow_id);
+			}
+		}
+
+		spare->flows[spare->nb_flows] = *base;
+		create_header_template(&spare->templates[spare->nb_flows], base);
+		spare->compact[spare->nb_flows] = (base->version >= IPRP_VERSION_COMPACT);
+		if (engine == IPRP_ENGINE_RAW || engine == IPRP_ENGINE_XDP) {
+			create_raw_templates(spare->raw_templates[spare->nb_flows], base);
+		}
+		spare->flow_index[base->flow_id] = spare->nb_flows;
+		spare->nb_flows++;
+	}
+	spare->version = (pb.version + 1 == IPRP_PB_OFFLINE) ? pb.version + 2 : pb.version + 1;
+
+	__atomic_store_n(&pb.current, spare, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&pb.version, spare->version, __ATOMIC_SEQ_CST);
+}
+
+/**
+ Builds the iPRP header template of the given flow
+
+ The compact header is used if all the receivers of the flow announced a version that supports it.
+*/
+void create_header_template(iprp_isd_header_t *template, iprp_peerbase_t *base) {
+	memset(template, 0, sizeof(iprp_isd_header_t));
+	if (base->version >= IPRP_VERSION_COMPACT) {
+		iprp_compact_header_t *header = &template->compact.header;
+		header->version = IPRP_VERSION_COMPACT;
+		header->flow_id = base->flow_id;
+
+		iprp_compact_link_t *link = &template->compact.link;
+		link->src_addr = base->link.src_addr;
+		link->src_port = base->link.src_port;
+		memcpy(&link->reboot, &base->link.snsid[18], sizeof(link->reboot));
+		link->dest_port = base->link.dest_port;
+	#ifndef IPRP_MULTICAST
+		link->dest_addr.s_addr = base->link.dest_addr.s_addr;
+	#endif
+		return;
+	}
+
+	iprp_header_t *header = &template->full;
+	header->version = IPRP_VERSION_FULL;
+	header->dest_port = base->link.dest_port;
+#ifndef IPRP_MULTICAST
+	header->dest_addr.s_addr = base->link.dest_addr.s_addr;
+#endif
+	memcpy(&header->snsid, base->link.snsid, IPRP_SNSID_SIZE);
+}
+
+/**
+ Builds the IP and UDP header templates of the given flow (one per host interface)
+
+ The source address is the address of the interface, so that the receiver sees the same packets as with UDP sockets.
+*/
+void create_raw_templates(iprp_ipudp_t *templates, iprp_peerbase_t *base) {
+	for (int i = 0; i < base->host.nb_ifaces; ++i) {
+		iprp_iface_t *iface = &base->host.ifaces[i];
+	#ifndef IPRP_MULTICAST
+		raw_template(&templates[iface->ind], iface->addr, base->dest_addr[iface->ind]);
+	#else
+		raw_template(&templates[iface->ind], iface->addr, base->link.dest_addr);
+	#endif
+	}
+}
+
+/**
+ Waits for the workers to stop using snapshots older than the current one
+
+ Each worker is either between two packets (offline), or it has announced the version it entered with.
+ Packets are handled in microseconds, so this only waits for the packets in progress.
+*/
+void pb_synchronize() {
+	for (int i = 0; i < pb.nb_readers; ++i) {
+		while (true) {
+			uint32_t reader_version = __atomic_load_n(&pb.reader_versions[i], __ATOMIC_SEQ_CST);
+			if (reader_version == IPRP_PB_OFFLINE || reader_version == __atomic_load_n(&pb.version, __ATOMIC_SEQ_CST)) {
+				break;
+			}
+			usleep(IPRP_PB_SYNC_USEC);
+		}
+	}
+}
+
+/**
+ Returns the current peerbase snapshot to the given worker
+
+ The snapshot can be read without locking until pb_leave is called.
+*/
+iprp_isd_snapshot_t *pb_enter(int reader) {
+	__atomic_store_n(&pb.reader_versions[reader], __atomic_load_n(&pb.version, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&pb.current, __ATOMIC_SEQ_CST);
+}
+
+/**
+ Releases the snapshot returned by pb_enter
+*/
+void pb_leave(int reader) {
+	__atomic_store_n(&pb.reader_versions[reader], IPRP_PB_OFFLINE, __ATOMIC_RELEASE);
 }
\ No newline at end of file
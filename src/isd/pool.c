@@ -0,0 +1,85 @@
+/**\file isd/pool.c
+ * Packet buffer pool for the ISD
+ * 
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "isd.h"
+
+/**
+ Allocates a packet buffer pool
+
+ This is the only allocation made for packet buffers: the handling thread creates its pool once at startup.
+*/
+iprp_pktbuf_pool_t *pool_create() {
+	iprp_pktbuf_pool_t *pool = malloc(sizeof(iprp_pktbuf_pool_t));
+	if (!pool) {
+		return NULL;
+	}
+
+	pool->next = 0;
+	pool->high_water = 0;
+	pool->gets = 0;
+	pool->exhausted = 0;
+	for (int i = 0; i < IPRP_ISD_POOL_SIZE; ++i) {
+		pool->bufs[i].refs = 0;
+	}
+
+	return pool;
+}
+
+/**
+ Returns the next free packet buffer of the pool, or NULL if its copies have not all been sent yet
+
+ The buffer stays free until it is taken, so it can be used to receive a message that may not be a packet.
+*/
+iprp_pktbuf_t *pool_next(iprp_pktbuf_pool_t *pool) {
+	iprp_pktbuf_t *buf = &pool->bufs[pool->next];
+	if (__atomic_load_n(&buf->refs, __ATOMIC_ACQUIRE) != 0) {
+		return NULL;
+	}
+	return buf;
+}
+
+/**
+ Marks the next free packet buffer as used by the given number of copies
+
+ The reference count must be set before the copies are handed to the senders.
+*/
+void pool_take(iprp_pktbuf_pool_t *pool, uint32_t refs) {
+	__atomic_store_n(&pool->bufs[pool->next].refs, refs, __ATOMIC_RELAXED);
+	pool->next = (pool->next + 1) % IPRP_ISD_POOL_SIZE;
+	pool->gets++;
+}
+
+/**
+ Releases one copy of the given buffer
+
+ The buffer goes back to the pool when all its copies have been sent (or dropped).
+ Transmit threads release buffers of other threads' pools, so this is atomic.
+*/
+void pool_release(iprp_pktbuf_t *buf) {
+	__atomic_sub_fetch(&buf->refs, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ Logs the pool usage counters
+
+ The buffers in use are counted at each report, so the high water mark is sampled.
+*/
+void pool_log(iprp_pktbuf_pool_t *pool, int worker_id) {
+	unsigned int in_use = 0;
+	for (int i = 0; i < IPRP_ISD_POOL_SIZE; ++i) {
+		if (__atomic_load_n(&pool->bufs[i].refs, __ATOMIC_RELAXED) != 0) {
+			in_use++;
+		}
+	}
+	if (in_use > pool->high_water) {
+		pool->high_water = in_use;
+	}
+	LOG("Packet pool (worker %d): %u/%u in use, high water %u, %lu packets, exhausted %lu times", worker_id, in_use, IPRP_ISD_POOL_SIZE, pool->high_water, pool->gets, pool->exhausted);
+}
\ No newline at end of file
@@ -0,0 +1,74 @@
+/**\file isd/raw.c
+ * IP and UDP headers of the copies sent on raw sockets
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <string.h>
+#include <netinet/in.h>
+
+#include "isd.h"
+
+/* Function prototypes */
+uint16_t raw_checksum(uint16_t *halfwords, size_t len);
+
+/**
+ Builds the IP and UDP header template of a path
+
+ Only the total length, identification and checksum of the IP header and the UDP length change between copies.
+ They are left to zero, so that the template checksum covers the other fields only.
+ The UDP checksum is not used (it is optional on IPv4).
+*/
+void raw_template(iprp_ipudp_t *template, struct in_addr src_addr, struct in_addr dest_addr) {
+	memset(template, 0, sizeof(iprp_ipudp_t));
+	template->ip.version = 4;
+	template->ip.ihl = sizeof(struct iphdr) / 4;
+	template->ip.frag_off = htons(IPRP_IP_DF);
+#ifndef IPRP_MULTICAST
+	template->ip.ttl = 64;
+#else
+	template->ip.ttl = 255;
+#endif
+	template->ip.protocol = IPPROTO_UDP;
+	template->ip.saddr = src_addr.s_addr;
+	template->ip.daddr = dest_addr.s_addr;
+	template->ip.check = raw_checksum((uint16_t *) &template->ip, sizeof(struct iphdr));
+
+	template->udp.source = htons(IPRP_DATA_PORT);
+	template->udp.dest = htons(IPRP_DATA_PORT);
+}
+
+/**
+ Fills the IP and UDP headers of a copy of the given size (iPRP header and payload) from the path template
+
+ The checksum is updated from the template one by adding the two fields that were left to zero.
+*/
+void raw_fill(iprp_ipudp_t *ipudp, iprp_ipudp_t *template, size_t size, uint16_t id) {
+	*ipudp = *template;
+	ipudp->ip.tot_len = htons(sizeof(iprp_ipudp_t) + size);
+	ipudp->ip.id = htons(id);
+	ipudp->udp.len = htons(sizeof(struct udphdr) + size);
+
+	uint32_t checksum = (uint16_t) ~template->ip.check;
+	checksum += ipudp->ip.tot_len;
+	checksum += ipudp->ip.id;
+	while (checksum >> 16) {
+		checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	}
+	ipudp->ip.check = (uint16_t) ~checksum;
+}
+
+/**
+ Computes the internet checksum of the given buffer
+*/
+uint16_t raw_checksum(uint16_t *halfwords, size_t len) {
+	uint32_t checksum = 0;
+	for (int i = 0; i < len/2; ++i) {
+		checksum += halfwords[i];
+	}
+	while (checksum >> 16) {
+		checksum = (checksum & 0xFFFF) + (checksum >> 16);
+	}
+	return (uint16_t) ~checksum;
+}
\ No newline at end of file
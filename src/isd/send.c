@@ -0,0 +1,204 @@
+/**\file isd/send.c
+ * Batched packet sending for the ISD
+ * 
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/udp.h>
+#include <linux/net_tstamp.h>
+
+#include "isd.h"
+
+/* Function prototypes */
+bool batch_extend(iprp_isd_batch_t *batch, size_t size, struct sockaddr_in *addr);
+void batch_control(iprp_isd_batch_t *batch, unsigned int i, size_t segments);
+
+/**
+ Initializes an empty send batch on the given socket
+*/
+void batch_init(iprp_isd_batch_t *batch, int socket, bool gso, bool raw) {
+	memset(batch, 0, sizeof(iprp_isd_batch_t));
+	batch->socket = socket;
+	batch->gso = gso && !raw; // The kernel does not segment raw datagrams
+	batch->raw = raw;
+	batch->count = 0;
+	batch->nb_copies = 0;
+}
+
+/**
+ Adds a copy to the given batch
+
+ The copy is sent as a two-element vector (iPRP header and payload), so the payload is never copied.
+ On a raw batch, the IP and UDP headers of the copy are filled from the given template and sent in front of it.
+ The packet buffer holds one reference for the copy, released when the batch is flushed.
+ With GSO, a copy of the same size and destination as the previous message is appended to it as a new segment.
+ If the batch is full, it is flushed before the copy is added.
+*/
+int batch_add(iprp_isd_batch_t *batch, iprp_ind_t ind, iprp_pktbuf_t *buf, char *payload, size_t payload_size, struct sockaddr_in *addr, iprp_ipudp_t *raw_template) {
+	if (batch->nb_copies == IPRP_ISD_BATCH_SIZE) {
+		int err = batch_flush(batch);
+		if (err) {
+			return err;
+		}
+	}
+
+	unsigned int c = batch->nb_copies;
+	size_t size = buf->header_size + payload_size;
+	unsigned int nb_iovs = batch->raw ? 3 : 2;
+	struct iovec *iov = &batch->iovs[nb_iovs * c];
+	batch->bufs[c] = buf;
+	if (batch->raw) {
+		raw_fill(&batch->ipudp[c], raw_template, size, batch->ip_id++);
+		iov->iov_base = &batch->ipudp[c];
+		iov->iov_len = sizeof(iprp_ipudp_t);
+		iov++;
+	}
+	iov[0].iov_base = &buf->header;
+	iov[0].iov_len = buf->header_size;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = payload_size;
+	batch->nb_copies++;
+
+	if (batch->gso && batch_extend(batch, size, addr)) {
+		return 0;
+	}
+
+	unsigned int i = batch->count;
+	batch->addrs[i] = *addr;
+	batch->sizes[i] = size;
+	batch->txtimes[i] = buf->txtime;
+	batch->sampled[i] = buf->sampled;
+	batch->inds[i] = ind;
+
+	struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+	hdr->msg_name = &batch->addrs[i];
+	hdr->msg_namelen = sizeof(struct sockaddr_in);
+	hdr->msg_iov = &batch->iovs[nb_iovs * c];
+	hdr->msg_iovlen = nb_iovs;
+	hdr->msg_flags = 0;
+	batch_control(batch, i, 1);
+
+	batch->count++;
+	return 0;
+}
+
+/**
+ Appends the last added copy to the previous message as a GSO segment, if possible
+
+ The kernel splits the message in datagrams of the segment size, so the copies must have the same size.
+ They must also have the same destination, and the message must stay within the segment and size limits.
+*/
+bool batch_extend(iprp_isd_batch_t *batch, size_t size, struct sockaddr_in *addr) {
+	if (batch->count == 0) {
+		return false;
+	}
+
+	unsigned int i = batch->count - 1;
+	struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+	size_t segments = hdr->msg_iovlen / 2;
+	if (batch->sizes[i] != size || size > IPRP_ISD_GSO_MAX_SIZE || segments == IPRP_ISD_GSO_SEGMENTS
+		|| (segments + 1) * size > IPRP_MAX_UDP_PAYLOAD
+		|| batch->addrs[i].sin_addr.s_addr != addr->sin_addr.s_addr || batch->addrs[i].sin_port != addr->sin_port) {
+		return false;
+	}
+
+	// The copy vectors follow each other in the batch
+	hdr->msg_iovlen += 2;
+
+	// Set segment size
+	if (segments == 1) {
+		batch_control(batch, i, 2);
+	}
+	DEBUG("Copy coalesced (%lu segments of %lu bytes)", segments + 1, size);
+
+	return true;
+}
+
+/**
+ Writes the control messages of the given message of the batch
+
+ They carry the segment size of a GSO message, and the departure time of the copies when the socket is tracked
+ (the departure time of a GSO message is the one of its first copy). Measured messages also request a timestamp.
+*/
+void batch_control(iprp_isd_batch_t *batch, unsigned int i, size_t segments) {
+	struct msghdr *hdr = &batch->msgs[i].msg_hdr;
+	if (segments == 1 && !batch->track) {
+		hdr->msg_control = NULL;
+		hdr->msg_controllen = 0;
+		return;
+	}
+
+	memset(batch->controls[i], 0, sizeof(batch->controls[i]));
+	hdr->msg_control = batch->controls[i];
+	hdr->msg_controllen = sizeof(batch->controls[i]);
+	size_t len = 0;
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+	if (segments > 1) {
+		cmsg->cmsg_level = IPPROTO_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+		*((uint16_t *) CMSG_DATA(cmsg)) = batch->sizes[i];
+		len += CMSG_SPACE(sizeof(uint16_t));
+		cmsg = CMSG_NXTHDR(hdr, cmsg);
+	}
+	if (batch->track) {
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+		memcpy(CMSG_DATA(cmsg), &batch->txtimes[i], sizeof(uint64_t));
+		len += CMSG_SPACE(sizeof(uint64_t));
+		if (batch->sampled[i]) {
+			cmsg = CMSG_NXTHDR(hdr, cmsg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SO_TIMESTAMPING;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint32_t));
+			*((uint32_t *) CMSG_DATA(cmsg)) = SOF_TIMESTAMPING_TX_SOFTWARE;
+			len += CMSG_SPACE(sizeof(uint32_t));
+		}
+	}
+	hdr->msg_controllen = len;
+}
+
+/**
+ Sends all the copies of the given batch
+
+ The whole batch is handed to the kernel with sendmmsg, retrying until every message has been sent.
+ The buffers of the copies are then released.
+ On a tracked socket, the measured messages are recorded before other workers can send on the socket.
+*/
+int batch_flush(iprp_isd_batch_t *batch) {
+	unsigned int sent = 0;
+	int err = 0;
+	if (batch->track) {
+		pthread_mutex_lock(&batch->track->mutex);
+	}
+	while (sent < batch->count) {
+		int ret = sendmmsg(batch->socket, &batch->msgs[sent], batch->count - sent, 0);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			err = IPRP_ERR;
+			break;
+		}
+		sent += ret;
+	}
+	if (batch->track) {
+		txtime_sent(batch->track, batch, sent);
+		pthread_mutex_unlock(&batch->track->mutex);
+	}
+	DEBUG("Batch of %u copies sent in %u messages", batch->nb_copies, sent);
+
+	for (unsigned int i = 0; i < batch->nb_copies; ++i) {
+		pool_release(batch->bufs[i]);
+	}
+	batch->count = 0;
+	batch->nb_copies = 0;
+	return err;
+}
\ No newline at end of file
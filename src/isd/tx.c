@@ -0,0 +1,238 @@
+/**\file isd/tx.c
+ * Per-interface transmit threads for the ISD
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_TX
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "isd.h"
+
+extern time_t curr_time;
+extern iprp_isd_peerbase_t pb;
+extern iprp_isd_path_t paths[IPRP_MAX_INDS];
+extern int sockets[IPRP_MAX_INDS];
+extern iprp_isd_engine_t engine;
+
+/* Function prototypes */
+unsigned int tx_pop(iprp_isd_path_t *path, iprp_isd_copy_t *copies, unsigned int max);
+void tx_send(iprp_isd_path_t *path, iprp_isd_copy_t *copies, unsigned int count);
+bool tx_idle(iprp_isd_path_t *path);
+
+/**
+ Starts the transmit thread of the given interface (if not started yet)
+
+ Only the peerbase thread starts paths, before publishing the flows that use them.
+ With the xdp engine, the AF_XDP socket of the interface is created here.
+*/
+void tx_start(iprp_isd_path_t *path, iprp_iface_t *iface) {
+	if (path->started) {
+		return;
+	}
+
+	iprp_ind_t ind = iface->ind;
+	path->ind = ind;
+	path->socket = sockets[ind];
+	path->xsk = NULL;
+	if (engine == IPRP_ENGINE_XDP) {
+		if (!(path->xsk = malloc(sizeof(iprp_isd_xsk_t)))) {
+			ERR("Unable to allocate AF_XDP socket", errno);
+		}
+		int err = xsk_setup(path->xsk, iface->addr);
+		if (err) {
+			ERR("Unable to setup AF_XDP socket", err == IPRP_ERR ? errno : err);
+		}
+	}
+	path->sleeping = false;
+	path->sent = 0;
+	path->ring_drops = 0;
+	path->send_drops = 0;
+	if (!(path->rings = calloc(pb.nb_readers, sizeof(iprp_isd_ring_t)))) {
+		ERR("Unable to allocate transmit rings", errno);
+	}
+	if ((path->event_fd = eventfd(0, 0)) == -1) {
+		ERR("Unable to create transmit event", errno);
+	}
+
+	int err;
+	if ((err = pthread_create(&path->thread, NULL, tx_routine, path))) {
+		ERR("Unable to setup transmit thread", err);
+	}
+	__atomic_store_n(&path->started, true, __ATOMIC_RELEASE);
+	DEBUG("Transmit thread started for IND %d", ind);
+}
+
+/**
+ Hands a copy to the transmit thread of a path
+
+ Returns false if the ring of the worker is full, in which case the copy is dropped on this path only.
+*/
+bool tx_push(iprp_isd_path_t *path, int worker_id, iprp_isd_copy_t *copy) {
+	iprp_isd_ring_t *ring = &path->rings[worker_id];
+	uint32_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == IPRP_ISD_RING_SIZE) {
+		__atomic_add_fetch(&path->ring_drops, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+
+	ring->copies[head % IPRP_ISD_RING_SIZE] = *copy;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/**
+ Wakes up the idle transmit threads
+
+ Called by the workers after queuing copies. Threads that are busy poll their rings and are not signaled.
+*/
+void tx_kick() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		iprp_isd_path_t *path = &paths[i];
+		if (!__atomic_load_n(&path->started, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+		if (__atomic_load_n(&path->sleeping, __ATOMIC_RELAXED) && __atomic_exchange_n(&path->sleeping, false, __ATOMIC_SEQ_CST)) {
+			uint64_t one = 1;
+			if (write(path->event_fd, &one, sizeof(one)) == -1) {
+				ERR("Unable to wake transmit thread up", errno);
+			}
+		}
+	}
+}
+
+/**
+ Sends the copies queued on one interface
+
+ The routine takes the copies of all workers from their rings and sends them with non-blocking sendmmsg calls.
+ A full socket buffer or a send error only drops copies of this path: the other paths have their own thread and socket.
+ When all rings are empty, the routine sleeps until a worker wakes it up.
+*/
+void* tx_routine(void *arg) {
+	iprp_isd_path_t *path = (iprp_isd_path_t *) arg;
+	iprp_isd_copy_t copies[IPRP_ISD_BATCH_SIZE];
+	DEBUG("In routine (IND %d)", path->ind);
+
+	time_t last_stats = curr_time;
+	while (true) {
+		unsigned int count = tx_pop(path, copies, IPRP_ISD_BATCH_SIZE);
+		if (count > 0) {
+			tx_send(path, copies, count);
+		} else {
+			// Announce sleep, then check again for copies queued before the announcement was visible
+			__atomic_store_n(&path->sleeping, true, __ATOMIC_SEQ_CST);
+			if (tx_idle(path)) {
+				uint64_t events;
+				if (read(path->event_fd, &events, sizeof(events)) == -1 && errno != EINTR) {
+					ERR("Unable to wait for transmit event", errno);
+				}
+			}
+			__atomic_store_n(&path->sleeping, false, __ATOMIC_RELAXED);
+		}
+
+		// Report path counters
+		if (curr_time - last_stats >= IPRP_T_ISD_STATS) {
+			LOG("Path %d: %lu copies sent, %lu dropped (ring full), %lu dropped (send)", path->ind, path->sent, __atomic_load_n(&path->ring_drops, __ATOMIC_RELAXED), path->send_drops);
+			if (path->xsk) {
+				LOG("Path %d: %lu copies sent through UDP instead of AF_XDP", path->ind, path->xsk->fallbacks);
+			}
+			last_stats = curr_time;
+		}
+	}
+}
+
+/**
+ Takes up to max copies from the rings of the path, in worker order
+*/
+unsigned int tx_pop(iprp_isd_path_t *path, iprp_isd_copy_t *copies, unsigned int max) {
+	unsigned int count = 0;
+	for (int i = 0; i < pb.nb_readers && count < max; ++i) {
+		iprp_isd_ring_t *ring = &path->rings[i];
+		uint32_t tail = ring->tail;
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		while (tail != head && count < max) {
+			copies[count++] = ring->copies[tail % IPRP_ISD_RING_SIZE];
+			tail++;
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	return count;
+}
+
+/**
+ Sends the given copies on the socket of the path and releases their buffers
+
+ With an AF_XDP socket, the copies are written to its transmit ring first. The others go through the UDP socket.
+ A full socket buffer drops the remaining copies, any other error only drops the failing copy.
+*/
+void tx_send(iprp_isd_path_t *path, iprp_isd_copy_t *copies, unsigned int count) {
+	struct mmsghdr msgs[IPRP_ISD_BATCH_SIZE];
+	struct iovec iovs[IPRP_ISD_BATCH_SIZE][2];
+	unsigned int nb_msgs = 0;
+
+	memset(msgs, 0, count * sizeof(struct mmsghdr));
+	for (unsigned int i = 0; i < count; ++i) {
+		if (path->xsk && xsk_send(path->xsk, &copies[i])) {
+			path->sent++;
+			continue;
+		}
+		unsigned int m = nb_msgs++;
+		iovs[m][0].iov_base = &copies[i].buf->header;
+		iovs[m][0].iov_len = copies[i].buf->header_size;
+		iovs[m][1].iov_base = copies[i].payload;
+		iovs[m][1].iov_len = copies[i].payload_size;
+		msgs[m].msg_hdr.msg_name = &copies[i].addr;
+		msgs[m].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[m].msg_hdr.msg_iov = iovs[m];
+		msgs[m].msg_hdr.msg_iovlen = 2;
+	}
+	if (path->xsk && nb_msgs < count) {
+		xsk_kick(path->xsk);
+	}
+
+	unsigned int done = 0;
+	while (done < nb_msgs) {
+		int ret = sendmmsg(path->socket, &msgs[done], nb_msgs - done, MSG_DONTWAIT);
+		if (ret == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				path->send_drops += nb_msgs - done;
+				DEBUG("Path %d congested, %u copies dropped", path->ind, nb_msgs - done);
+				break;
+			}
+			DEBUG("Error %d while sending on path %d, copy dropped", errno, path->ind);
+			path->send_drops++;
+			done++;
+			continue;
+		}
+		path->sent += ret;
+		done += ret;
+	}
+
+	for (unsigned int i = 0; i < count; ++i) {
+		pool_release(copies[i].buf);
+	}
+}
+
+/**
+ Returns whether all the rings of the path are empty
+*/
+bool tx_idle(iprp_isd_path_t *path) {
+	for (int i = 0; i < pb.nb_readers; ++i) {
+		iprp_isd_ring_t *ring = &path->rings[i];
+		if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) != ring->tail) {
+			return false;
+		}
+	}
+	return true;
+}
\ No newline at end of file
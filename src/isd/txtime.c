@@ -0,0 +1,200 @@
+/**\file isd/txtime.c
+ * Synchronized departure of the copies (SO_TXTIME) and departure measurement
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include "isd.h"
+
+extern iprp_isd_txtrack_t txtracks[IPRP_MAX_INDS];
+
+/* Departures of the measured copies of each path (collected by the first worker) */
+iprp_isd_departure_t departures[IPRP_MAX_INDS];
+
+/* Interfaces where fq is installed (by IND) */
+bool fq_installed[IPRP_MAX_INDS];
+
+/**
+ Configures a send socket for departure times, and initializes its tracking
+
+ The departure times are on the monotonic clock, as required by the fq qdisc.
+ Timestamps are only generated for the messages that request them (measured packets),
+ they are reported with an ID, without the packet.
+*/
+int txtime_setup(iprp_isd_txtrack_t *track, int socket) {
+	struct sock_txtime config = {
+		.clockid = CLOCK_MONOTONIC,
+		.flags = SOF_TXTIME_REPORT_ERRORS
+	};
+	if (setsockopt(socket, SOL_SOCKET, SO_TXTIME, &config, sizeof(config)) == -1) {
+		return IPRP_ERR;
+	}
+	uint32_t flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+	if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) == -1) {
+		return IPRP_ERR;
+	}
+
+	memset(track, 0, sizeof(iprp_isd_txtrack_t));
+	track->socket = socket;
+	pthread_mutex_init(&track->mutex, NULL);
+	return 0;
+}
+
+/**
+ Installs the fq qdisc (which honours departure times) on the interface with the given address, if not done yet
+*/
+void txtime_qdisc(iprp_iface_t *iface) {
+	if (fq_installed[iface->ind]) {
+		return;
+	}
+
+	char ifname[IF_NAMESIZE];
+	unsigned char mac[6];
+	if (iface_lookup(iface->addr, ifname, mac, NULL) < 0) {
+		ERR("Unable to find interface", IPRP_ERR_LOOKUPFAIL);
+	}
+
+	char shell[128];
+	snprintf(shell, sizeof(shell), "tc qdisc replace dev %s root fq", ifname);
+	if (system(shell)) {
+		ERR("Unable to install fq qdisc", errno);
+	}
+	fq_installed[iface->ind] = true;
+	DEBUG("fq qdisc installed on %s", ifname);
+}
+
+/**
+ Returns the current time on the departure clock
+*/
+uint64_t txtime_now() {
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+/**
+ Returns the current time on the given clock (nanoseconds)
+*/
+uint64_t clock_ns(clockid_t clock) {
+	struct timespec now;
+	clock_gettime(clock, &now);
+	return (uint64_t) now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ Records the measured messages among the first sent ones of the given batch
+
+ Only those messages consume a timestamp ID, so the IDs follow from the number of measured messages already sent.
+ Must be called with the tracking mutex held since the messages were sent.
+*/
+void txtime_sent(iprp_isd_txtrack_t *track, iprp_isd_batch_t *batch, unsigned int count) {
+	for (unsigned int i = 0; i < count; ++i) {
+		if (!batch->sampled[i]) {
+			continue;
+		}
+		uint32_t id = track->next_id++;
+		unsigned int slot = id & (IPRP_ISD_TXTIME_TRACK - 1);
+		track->samples[slot].id = id;
+		track->samples[slot].ind = batch->inds[i];
+		track->samples[slot].txtime = batch->txtimes[i];
+	}
+}
+
+/**
+ Reads the departure timestamps and errors reported on the error queue of the given socket
+
+ Timestamps are taken when the copies are handed to the device, on the realtime clock:
+ they are compared to the departure time converted with the current offset between the clocks.
+*/
+void txtime_collect(iprp_isd_txtrack_t *track) {
+	int64_t offset = (int64_t) (clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC));
+
+	pthread_mutex_lock(&track->mutex);
+	while (true) {
+		char control[CMSG_SPACE(sizeof(struct scm_timestamping)) + CMSG_SPACE(sizeof(struct sock_extended_err) + sizeof(struct sockaddr_in))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(track->socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			break;
+		}
+
+		struct scm_timestamping *timestamps = NULL;
+		struct sock_extended_err *error = NULL;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPING) {
+				timestamps = (struct scm_timestamping *) CMSG_DATA(cmsg);
+			} else if (cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_RECVERR) {
+				error = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			}
+		}
+		if (!error) {
+			continue;
+		}
+
+		if (error->ee_origin == SO_EE_ORIGIN_TXTIME) {
+			track->missed++;
+		} else if (error->ee_origin == SO_EE_ORIGIN_TIMESTAMPING && timestamps) {
+			unsigned int slot = error->ee_data & (IPRP_ISD_TXTIME_TRACK - 1);
+			if (track->samples[slot].id != error->ee_data || track->samples[slot].txtime == 0) {
+				continue; // Overwritten by a more recent sample
+			}
+			int64_t departure = (int64_t) timestamps->ts[0].tv_sec * 1000000000LL + timestamps->ts[0].tv_nsec;
+			int64_t delay = departure - ((int64_t) track->samples[slot].txtime + offset);
+			iprp_isd_departure_t *path = &departures[track->samples[slot].ind];
+			path->samples++;
+			path->total_delay += delay;
+			if (path->samples == 1 || delay > path->max_delay) {
+				path->max_delay = delay;
+			}
+			track->samples[slot].txtime = 0;
+		}
+	}
+	pthread_mutex_unlock(&track->mutex);
+}
+
+/**
+ Logs the departure delay of each path, and its skew relative to the earliest path
+
+ The counters are reset, so that each report covers the last period.
+*/
+void txtime_log() {
+	int64_t earliest = 0;
+	bool found = false;
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		if (departures[i].samples > 0) {
+			int64_t mean = departures[i].total_delay / (int64_t) departures[i].samples;
+			if (!found || mean < earliest) {
+				earliest = mean;
+				found = true;
+			}
+		}
+	}
+
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		iprp_isd_departure_t *path = &departures[i];
+		if (path->samples > 0) {
+			int64_t mean = path->total_delay / (int64_t) path->samples;
+			LOG("Path %d: copies left %ld us after their departure time (max %ld us, %lu samples), skew %ld us", i, (long) (mean / 1000), (long) (path->max_delay / 1000), path->samples, (long) ((mean - earliest) / 1000));
+		}
+		memset(path, 0, sizeof(iprp_isd_departure_t));
+	}
+
+	unsigned long missed = 0;
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		missed += txtracks[i].missed;
+	}
+	if (missed > 0) {
+		LOG("%lu copies dropped for missing their departure time", missed);
+	}
+}
\ No newline at end of file
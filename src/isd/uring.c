@@ -0,0 +1,176 @@
+/**\file isd/uring.c
+ * io_uring packet sending for the ISD
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "isd.h"
+
+/* Function prototypes */
+void uring_reap(iprp_isd_uring_t *ring);
+
+/**
+ Creates the io_uring of a worker and registers the send sockets
+
+ The sockets are registered as fixed files: requests refer to a socket by its IND, which saves a file lookup per copy.
+ No library is used, the rings are mapped directly.
+*/
+int uring_setup(iprp_isd_uring_t *ring, int *sockets, int nb_sockets) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if ((ring->fd = syscall(__NR_io_uring_setup, IPRP_ISD_URING_DEPTH, &params)) == -1) {
+		return IPRP_ERR;
+	}
+
+	// Map submission and completion rings (a single mapping on recent kernels)
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cq_size > sq_size) {
+		sq_size = cq_size;
+	}
+	char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		return IPRP_ERR;
+	}
+	char *cq = sq;
+	if (!single) {
+		cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED) {
+			return IPRP_ERR;
+		}
+	}
+	ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		return IPRP_ERR;
+	}
+
+	ring->sq_head = (unsigned int *) (sq + params.sq_off.head);
+	ring->sq_tail = (unsigned int *) (sq + params.sq_off.tail);
+	ring->sq_mask = (unsigned int *) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + params.sq_off.array);
+	ring->cq_head = (unsigned int *) (cq + params.cq_off.head);
+	ring->cq_tail = (unsigned int *) (cq + params.cq_off.tail);
+	ring->cq_mask = (unsigned int *) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+	ring->pending = 0;
+	DEBUG("io_uring mapped (%u submission entries, %u completion entries)", params.sq_entries, params.cq_entries);
+
+	// Register sockets
+	if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_FILES, sockets, nb_sockets) == -1) {
+		return IPRP_ERR;
+	}
+
+	// All slots are free (there are never more copies in flight than submission entries)
+	for (int i = 0; i < IPRP_ISD_URING_DEPTH; ++i) {
+		ring->free_slots[i] = i;
+	}
+	ring->nb_free = IPRP_ISD_URING_DEPTH;
+	ring->sent = 0;
+	ring->errors = 0;
+
+	return 0;
+}
+
+/**
+ Adds a send request for a copy to the submission queue
+
+ The request is only submitted by the next call to uring_submit.
+ If all slots are in flight, pending requests are submitted and the function waits for a completion.
+*/
+int uring_add(iprp_isd_uring_t *ring, iprp_ind_t ind, iprp_pktbuf_t *buf, char *payload, size_t payload_size, struct sockaddr_in *addr) {
+	while (ring->nb_free == 0) {
+		int err = uring_submit(ring, true);
+		if (err) {
+			return err;
+		}
+	}
+
+	// Fill copy slot
+	unsigned int slot = ring->free_slots[--ring->nb_free];
+	ring->addrs[slot] = *addr;
+	ring->bufs[slot] = buf;
+	ring->iovs[slot][0].iov_base = &buf->header;
+	ring->iovs[slot][0].iov_len = buf->header_size;
+	ring->iovs[slot][1].iov_base = payload;
+	ring->iovs[slot][1].iov_len = payload_size;
+	struct msghdr *msg = &ring->msgs[slot];
+	memset(msg, 0, sizeof(struct msghdr));
+	msg->msg_name = &ring->addrs[slot];
+	msg->msg_namelen = sizeof(struct sockaddr_in);
+	msg->msg_iov = ring->iovs[slot];
+	msg->msg_iovlen = 2;
+
+	// Write request (only this worker writes the tail)
+	unsigned int tail = *ring->sq_tail;
+	unsigned int index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->fd = ind;
+	sqe->addr = (unsigned long) msg;
+	sqe->len = 1;
+	sqe->user_data = slot;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->pending++;
+
+	return 0;
+}
+
+/**
+ Submits the pending requests and harvests the available completions
+
+ With wait, the call also blocks until at least one copy has completed (used when slots or buffers run out).
+*/
+int uring_submit(iprp_isd_uring_t *ring, bool wait) {
+	unsigned int flags = wait ? IORING_ENTER_GETEVENTS : 0;
+	if (ring->pending > 0 || wait) {
+		int ret;
+		do {
+			ret = syscall(__NR_io_uring_enter, ring->fd, ring->pending, wait ? 1 : 0, flags, NULL, 0);
+		} while (ret == -1 && errno == EINTR);
+		if (ret == -1) {
+			return IPRP_ERR;
+		}
+		ring->pending -= ret;
+		DEBUG("%d copies submitted", ret);
+	}
+
+	uring_reap(ring);
+	return 0;
+}
+
+/**
+ Harvests all available completions and releases the buffers of the completed copies
+
+ A failed send only drops its copy, it is counted in the worker statistics.
+*/
+void uring_reap(iprp_isd_uring_t *ring) {
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+		unsigned int slot = cqe->user_data;
+		if (cqe->res < 0) {
+			ring->errors++;
+			DEBUG("Copy dropped (error %d)", -cqe->res);
+		} else {
+			ring->sent++;
+		}
+		pool_release(ring->bufs[slot]);
+		ring->free_slots[ring->nb_free++] = slot;
+		head++;
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
\ No newline at end of file
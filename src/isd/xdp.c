@@ -0,0 +1,229 @@
+/**\file isd/xdp.c
+ * AF_XDP packet sending for the ISD transmit threads
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_TX
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_ether.h>
+#include <linux/if_xdp.h>
+
+#include "isd.h"
+
+extern time_t curr_time;
+
+/* Function prototypes */
+void xsk_complete(iprp_isd_xsk_t *xsk);
+bool xsk_neighbour(iprp_isd_xsk_t *xsk, uint32_t addr, unsigned char *mac);
+
+/**
+ Creates the AF_XDP socket of the interface with the given address
+
+ The socket only transmits, in copy mode, so that it works on any driver (veth included) without an XDP program.
+ Frames are copied into a UMEM owned by the path, and given back by the kernel through the completion ring.
+*/
+int xsk_setup(iprp_isd_xsk_t *xsk, struct in_addr addr) {
+	// Find interface
+	int ifindex = iface_lookup(addr, xsk->ifname, xsk->mac, NULL);
+	if (ifindex <= 0) {
+		return IPRP_ERR_LOOKUPFAIL;
+	}
+	DEBUG("Interface %s found (index %d)", xsk->ifname, ifindex);
+
+	if ((xsk->fd = socket(AF_XDP, SOCK_RAW, 0)) == -1) {
+		return IPRP_ERR;
+	}
+
+	// Register UMEM
+	size_t umem_size = IPRP_ISD_XDP_FRAMES * IPRP_ISD_XDP_FRAME_SIZE;
+	xsk->umem = mmap(NULL, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (xsk->umem == MAP_FAILED) {
+		return IPRP_ERR_MALLOC;
+	}
+	struct xdp_umem_reg reg = {
+		.addr = (uint64_t) (unsigned long) xsk->umem,
+		.len = umem_size,
+		.chunk_size = IPRP_ISD_XDP_FRAME_SIZE,
+		.headroom = 0,
+		.flags = 0
+	};
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) == -1) {
+		return IPRP_ERR;
+	}
+	for (int i = 0; i < IPRP_ISD_XDP_FRAMES; ++i) {
+		xsk->free_frames[i] = (uint64_t) i * IPRP_ISD_XDP_FRAME_SIZE;
+	}
+	xsk->nb_free = IPRP_ISD_XDP_FRAMES;
+
+	// Create rings (the kernel needs a fill ring, even if nothing is received)
+	int size = IPRP_ISD_XDP_RING;
+	if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &size, sizeof(size)) == -1
+		|| setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &size, sizeof(size)) == -1
+		|| setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &size, sizeof(size)) == -1) {
+		return IPRP_ERR;
+	}
+	struct xdp_mmap_offsets off;
+	socklen_t off_len = sizeof(off);
+	if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &off_len) == -1) {
+		return IPRP_ERR;
+	}
+
+	char *tx = mmap(NULL, off.tx.desc + IPRP_ISD_XDP_RING * sizeof(struct xdp_desc), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, XDP_PGOFF_TX_RING);
+	if (tx == MAP_FAILED) {
+		return IPRP_ERR;
+	}
+	xsk->tx_producer = (uint32_t *) (tx + off.tx.producer);
+	xsk->tx_consumer = (uint32_t *) (tx + off.tx.consumer);
+	xsk->tx_descs = (struct xdp_desc *) (tx + off.tx.desc);
+
+	char *cq = mmap(NULL, off.cr.desc + IPRP_ISD_XDP_RING * sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, xsk->fd, XDP_UMEM_PGOFF_COMPLETION_RING);
+	if (cq == MAP_FAILED) {
+		return IPRP_ERR;
+	}
+	xsk->cq_producer = (uint32_t *) (cq + off.cr.producer);
+	xsk->cq_consumer = (uint32_t *) (cq + off.cr.consumer);
+	xsk->cq_addrs = (uint64_t *) (cq + off.cr.desc);
+	DEBUG("Rings mapped");
+
+	// Bind to the first queue of the interface
+	struct sockaddr_xdp sxdp = {
+		.sxdp_family = AF_XDP,
+		.sxdp_flags = XDP_COPY,
+		.sxdp_ifindex = ifindex,
+		.sxdp_queue_id = 0
+	};
+	if (bind(xsk->fd, (struct sockaddr *) &sxdp, sizeof(sxdp)) == -1) {
+		return IPRP_ERR;
+	}
+
+	xsk->ip_id = 0;
+	xsk->nb_neighbours = 0;
+	xsk->fallbacks = 0;
+	return 0;
+}
+
+/**
+ Writes a copy to the transmit ring
+
+ The Ethernet, IP and UDP headers are built in front of the iPRP header and payload in a free frame.
+ Returns false if the copy cannot be sent on the socket (neighbour not resolved, no free frame or descriptor,
+ or copy too big), in which case it must be sent through the UDP socket.
+ The copies written are only sent by the kernel after xsk_kick.
+*/
+bool xsk_send(iprp_isd_xsk_t *xsk, iprp_isd_copy_t *copy) {
+	size_t size = copy->buf->header_size + copy->payload_size;
+	size_t frame_len = sizeof(struct ethhdr) + sizeof(iprp_ipudp_t) + size;
+	if (size > IPRP_ISD_RAW_MAX_SIZE || frame_len > IPRP_ISD_XDP_FRAME_SIZE) {
+		xsk->fallbacks++;
+		return false;
+	}
+
+	// Resolve next hop (destinations are expected on the link)
+	unsigned char dest_mac[ETH_ALEN];
+	if (!xsk_neighbour(xsk, copy->addr.sin_addr.s_addr, dest_mac)) {
+		xsk->fallbacks++;
+		return false;
+	}
+
+	// Get frame and descriptor
+	xsk_complete(xsk);
+	uint32_t producer = *xsk->tx_producer;
+	if (xsk->nb_free == 0 || producer - __atomic_load_n(xsk->tx_consumer, __ATOMIC_ACQUIRE) == IPRP_ISD_XDP_RING) {
+		xsk->fallbacks++;
+		return false;
+	}
+	uint64_t frame = xsk->free_frames[--xsk->nb_free];
+
+	// Build frame
+	char *data = xsk->umem + frame;
+	struct ethhdr *eth = (struct ethhdr *) data;
+	memcpy(eth->h_dest, dest_mac, ETH_ALEN);
+	memcpy(eth->h_source, xsk->mac, ETH_ALEN);
+	eth->h_proto = htons(ETH_P_IP);
+	data += sizeof(struct ethhdr);
+	iprp_ipudp_t ipudp;
+	raw_fill(&ipudp, &copy->ipudp, size, xsk->ip_id++);
+	memcpy(data, &ipudp, sizeof(iprp_ipudp_t));
+	data += sizeof(iprp_ipudp_t);
+	memcpy(data, &copy->buf->header, copy->buf->header_size);
+	data += copy->buf->header_size;
+	memcpy(data, copy->payload, copy->payload_size);
+
+	// Post descriptor
+	struct xdp_desc *desc = &xsk->tx_descs[producer & (IPRP_ISD_XDP_RING - 1)];
+	desc->addr = frame;
+	desc->len = frame_len;
+	desc->options = 0;
+	__atomic_store_n(xsk->tx_producer, producer + 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+/**
+ Tells the kernel to send the posted copies
+*/
+void xsk_kick(iprp_isd_xsk_t *xsk) {
+	if (sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0) == -1 && errno != EAGAIN && errno != EBUSY && errno != ENOBUFS) {
+		DEBUG("Error %d while kicking AF_XDP socket", errno);
+	}
+}
+
+/**
+ Gives the frames of the sent copies back to the free frames
+*/
+void xsk_complete(iprp_isd_xsk_t *xsk) {
+	uint32_t consumer = *xsk->cq_consumer;
+	uint32_t producer = __atomic_load_n(xsk->cq_producer, __ATOMIC_ACQUIRE);
+	while (consumer != producer) {
+		xsk->free_frames[xsk->nb_free++] = xsk->cq_addrs[consumer & (IPRP_ISD_XDP_RING - 1)];
+		consumer++;
+	}
+	__atomic_store_n(xsk->cq_consumer, consumer, __ATOMIC_RELEASE);
+}
+
+/**
+ Returns the Ethernet address of the given next hop
+
+ Unicast addresses are cached: the UDP socket fallback makes the kernel resolve the neighbours that are not known yet.
+*/
+bool xsk_neighbour(iprp_isd_xsk_t *xsk, uint32_t addr, unsigned char *mac) {
+	if (IN_MULTICAST(ntohl(addr))) {
+		return neigh_lookup(xsk->ifname, addr, mac);
+	}
+
+	// Find cache entry
+	iprp_isd_neighbour_t *neighbour = NULL;
+	for (int i = 0; i < xsk->nb_neighbours; ++i) {
+		if (xsk->neighbours[i].addr == addr) {
+			neighbour = &xsk->neighbours[i];
+			break;
+		}
+	}
+	if (!neighbour) {
+		if (xsk->nb_neighbours == IPRP_ISD_XDP_NEIGHBOURS) {
+			return false;
+		}
+		neighbour = &xsk->neighbours[xsk->nb_neighbours++];
+		neighbour->addr = addr;
+		neighbour->known = false;
+		neighbour->checked = 0;
+	}
+
+	// Unknown entries are looked up again every second, known ones every IPRP_T_ISD_NEIGHBOUR seconds
+	if (curr_time - neighbour->checked >= (neighbour->known ? IPRP_T_ISD_NEIGHBOUR : 1)) {
+		neighbour->known = neigh_lookup(xsk->ifname, addr, neighbour->mac);
+		neighbour->checked = curr_time;
+	}
+
+	if (neighbour->known) {
+		memcpy(mac, neighbour->mac, ETH_ALEN);
+	}
+	return neighbour->known;
+}
\ No newline at end of file
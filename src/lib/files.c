@@ -10,44 +10,71 @@
 #include "global.h"
 #include "activesenders.h"
 #include "peerbase.h"
+#include "pathstats.h"
 #ifdef IPRP_MULTICAST
  #include "senderifaces.h"
 #endif
 
 /**
- Stores the given peerbase to the given file
+ Stores the given peerbases to the given file
 */
-int peerbase_store(const char* path, iprp_peerbase_t *base) {
-	if (path == NULL | base == NULL) return IPRP_ERR_NULLPTR;
+void peerbases_store(const char* path, const int count, const iprp_peerbase_t* bases) {
+	// Write to a temporary file, so that the ISD never reads a partial table
+	char tmp_path[IPRP_PATH_LENGTH];
+	snprintf(tmp_path, IPRP_PATH_LENGTH, "%s.tmp", path);
 
-	// Save file
-	FILE* writer = fopen(path, "w");
+	// Get file descriptor
+	FILE* writer = fopen(tmp_path, "w");
 	if (!writer) {
 		ERR("Unable to write to peerbase file", errno);
 	}
 
-	fwrite(base, sizeof(iprp_peerbase_t), 1, writer);
+	// Write entry count
+	fwrite(&count, sizeof(int), 1, writer);
 
-	fflush(writer);		
+	// Write entries
+	if (count > 0) {
+		fwrite(bases, sizeof(iprp_peerbase_t), count, writer);
+	}
 
+	// Cleanup write
+	fflush(writer);
 	fclose(writer);
 
-	return 0;
+	// Replace the table
+	if (rename(tmp_path, path) == -1) {
+		ERR("Unable to replace peerbase file", errno);
+	}
 }
 
 /**
- Loads the peerbase from the given file
+ Loads the peerbases from the given file
 */
-int peerbase_load(const char *path, iprp_peerbase_t *base) {
-	if (path == NULL || base == NULL) return IPRP_ERR_NULLPTR;
+int peerbases_load(const char *path, int* count, iprp_peerbase_t** bases) {
+	if (!path || !count || !bases) return IPRP_ERR_NULLPTR;
 
+	// Get file descriptor
 	FILE* reader = fopen(path, "r");
 	if (!reader) {
 		ERR("Unable to read peerbase file", errno);
 	}
 
-	fread(base, sizeof(iprp_peerbase_t), 1, reader);
+	// Read entry count
+	*count = 0;
+	fread(count, sizeof(int), 1, reader);
+
+	// Read entries
+	*bases = NULL;
+	if (*count > 0) {
+		*bases = calloc(*count, sizeof(iprp_peerbase_t));
+		if (!*bases) {
+			fclose(reader);
+			return IPRP_ERR_MALLOC;
+		}
+		*count = fread(*bases, sizeof(iprp_peerbase_t), *count, reader);
+	}
 
+	// Cleanup read
 	fclose(reader);
 
 	return 0;
@@ -103,6 +130,71 @@ int activesenders_load(const char *path, int* count, iprp_active_sender_t** send
 	return 0;
 }
 
+/**
+ Stores the given path statistics to the given file
+*/
+void pathstats_store(const char* path, const int count, const iprp_link_stats_t* links) {
+	// Write to a temporary file, so that the ICD never reads partial statistics
+	char tmp_path[IPRP_PATH_LENGTH];
+	snprintf(tmp_path, IPRP_PATH_LENGTH, "%s.tmp", path);
+
+	// Get file descriptor
+	FILE* writer = fopen(tmp_path, "w");
+	if (!writer) {
+		ERR("Unable to write to path statistics file", errno);
+	}
+
+	// Write entry count
+	fwrite(&count, sizeof(int), 1, writer);
+
+	// Write entries
+	if (count > 0) {
+		fwrite(links, sizeof(iprp_link_stats_t), count, writer);
+	}
+
+	// Cleanup write
+	fflush(writer);
+	fclose(writer);
+
+	// Replace the statistics
+	if (rename(tmp_path, path) == -1) {
+		ERR("Unable to replace path statistics file", errno);
+	}
+}
+
+/**
+ Loads the path statistics from the given file
+*/
+int pathstats_load(const char *path, int* count, iprp_link_stats_t** links) {
+	if (!path || !count || !links) return IPRP_ERR_NULLPTR;
+
+	// Get file descriptor
+	FILE* reader = fopen(path, "r");
+	if (!reader) {
+		ERR("Unable to read path statistics file", errno);
+	}
+
+	// Read entry count
+	*count = 0;
+	fread(count, sizeof(int), 1, reader);
+
+	// Read entries
+	*links = NULL;
+	if (*count > 0) {
+		*links = calloc(*count, sizeof(iprp_link_stats_t));
+		if (!*links) {
+			fclose(reader);
+			return IPRP_ERR_MALLOC;
+		}
+		*count = fread(*links, sizeof(iprp_link_stats_t), *count, reader);
+	}
+
+	// Cleanup read
+	fclose(reader);
+
+	return 0;
+}
+
 #ifdef IPRP_MULTICAST
 /**
  Stores the given sender interfaces to the given file
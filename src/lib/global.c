@@ -34,6 +34,17 @@ iprp_ind_bitmap_t ind_match(iprp_host_t *sender, iprp_ind_bitmap_t receiver_inds
 	return sender_inds & receiver_inds;
 }
 
+/**
+ Fills in the SNSID of a link (source address repeated four times, source port and reboot counter)
+*/
+void snsid_fill(unsigned char *snsid, struct in_addr src_addr, uint16_t src_port, uint16_t reboot) {
+	for (int i = 0; i < 16/sizeof(src_addr); ++i) {
+		memcpy(&snsid[4*i], &src_addr, sizeof(src_addr));
+	}
+	memcpy(&snsid[16], &src_port, sizeof(src_port));
+	memcpy(&snsid[18], &reboot, sizeof(reboot));
+}
+
 /**
  Returns the current thread name (used for debugging)
 */
@@ -51,6 +62,7 @@ char* iprp_thr_name(iprp_thread_t thread) {
 		case ISD_MAIN: return "isd";
 		case ISD_HANDLE: return "isd-handle";
 		case ISD_PB: return "isd-pb";
+		case ISD_TX: return "isd-tx";
 
 		case IMD_MAIN: return "imd";
 		case IMD_HANDLE: return "imd-handle";
@@ -3,16 +3,24 @@
  * 
  * \author Loic Ottet (loic.ottet@epfl.ch)
  */
+#define _DEFAULT_SOURCE // clock_gettime is not part of C99
+
 #include <errno.h>
+#include <poll.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 
 #include "global.h"
 
 /**
- Sets up the given queue to handle its packet from the given callback
+ Sets up the given queue to handle its packet from the given callback (called with the given data)
+
+ Only the first copy_range bytes of each packet are copied to userspace (IPRP_COPY_HEADERS for handlers that only read the headers).
+ The netlink receive buffer is enlarged, so that a burst of large packets does not overflow it.
+ GSO packets are still segmented by the kernel before they are queued (NFQA_CFG_F_GSO is not set):
+ the segment size is not reported with the packet, so the datagram boundaries could not be restored.
 */
-int queue_setup(iprp_queue_t *nfq, int queue_id, nfq_callback *callback) {
+int queue_setup(iprp_queue_t *nfq, int queue_id, nfq_callback *callback, void *data, uint16_t copy_range) {
 	// Setup nfqueue
 	nfq->handle = nfq_open();
 	if (!nfq->handle) {
@@ -24,17 +32,19 @@ int queue_setup(iprp_queue_t *nfq, int queue_id, nfq_callback *callback) {
 	if (nfq_bind_pf(nfq->handle, AF_INET) < 0) {
 		ERR("Unable to bind IP protocol to queue handle", IPRP_ERR_NFQUEUE);
 	}
-	nfq->queue = nfq_create_queue(nfq->handle, queue_id, callback, NULL);
+	nfq->queue = nfq_create_queue(nfq->handle, queue_id, callback, data);
 	if (!nfq->queue) {
 		ERR("Unable to create queue", IPRP_ERR_NFQUEUE);
 	}
 	if (nfq_set_queue_maxlen(nfq->queue, IPRP_NFQUEUE_MAX_LENGTH) == -1) {
 		ERR("Unable to set queue max length", IPRP_ERR_NFQUEUE);
 	}
-	if (nfq_set_mode(nfq->queue, NFQNL_COPY_PACKET, 0xffff) == -1) {
+	if (nfq_set_mode(nfq->queue, NFQNL_COPY_PACKET, copy_range) == -1) {
 		ERR("Unable to set queue mode", IPRP_ERR_NFQUEUE);
 	}
 	nfq->fd = nfq_fd(nfq->handle);
+	nfnl_rcvbufsiz(nfq_nfnlh(nfq->handle), IPRP_NFQUEUE_RCVBUF);
+	nfq->batch_count = 0;
 
 	return 0;
 }
@@ -43,11 +53,21 @@ int queue_setup(iprp_queue_t *nfq, int queue_id, nfq_callback *callback) {
  Handles the next packet from the queue
 */
 int get_and_handle(struct nfq_handle *handle, int queue_fd) {
-	int bytes;
 	char buf[IPRP_PKTBUF_SIZE];
 
+	return get_and_handle_buf(handle, queue_fd, buf, IPRP_PKTBUF_SIZE);
+}
+
+/**
+ Handles the next packet from the queue, received into the given buffer
+
+ The payload given to the callback points into the buffer, so it stays valid as long as the buffer is not reused.
+*/
+int get_and_handle_buf(struct nfq_handle *handle, int queue_fd, char *buf, size_t buf_size) {
+	int bytes;
+
 	// Get packet from queue
-	if ((bytes = recv(queue_fd, buf, IPRP_PKTBUF_SIZE, 0)) == -1) {
+	if ((bytes = recv(queue_fd, buf, buf_size, 0)) == -1) {
 		if (errno == ENOBUFS) {
 			return IPRP_ERR_UNKNOWN;
 		}
@@ -61,4 +81,55 @@ int get_and_handle(struct nfq_handle *handle, int queue_fd) {
 		//ERR("Error while handling packet", err);
 	}
 	return 0;
+}
+
+/**
+ Returns whether the queue has no packet waiting to be handled
+*/
+bool queue_empty(int queue_fd) {
+	struct pollfd pfd = { .fd = queue_fd, .events = POLLIN };
+	return poll(&pfd, 1, 0) <= 0;
+}
+
+/**
+ Sets the verdict of an unmodified packet, batched with the previous packets of the queue
+
+ Verdicts are sent with nfq_set_verdict_batch, which applies a verdict to all the pending packets of the queue up to the given ID.
+ Packets are handled in ID order, so successive packets with the same verdict are answered with a single netlink message.
+ The pending verdicts are sent when the verdict changes, when the batch is full, or when its first packet has waited too long.
+ The caller must also call verdict_flush when the queue is drained.
+*/
+int verdict_batch(iprp_queue_t *nfq, uint32_t packet_id, uint32_t verdict) {
+	if (nfq->batch_count > 0 && nfq->batch_verdict != verdict) {
+		if (verdict_flush(nfq) == -1) {
+			return -1;
+		}
+	}
+
+	if (nfq->batch_count == 0) {
+		nfq->batch_verdict = verdict;
+		clock_gettime(CLOCK_MONOTONIC, &nfq->batch_start);
+	}
+	nfq->batch_id = packet_id;
+	nfq->batch_count++;
+
+	// Cap the delay of the first packet
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long waited = (now.tv_sec - nfq->batch_start.tv_sec) * 1000000 + (now.tv_nsec - nfq->batch_start.tv_nsec) / 1000;
+	if (nfq->batch_count == IPRP_VERDICT_BATCH_SIZE || waited >= IPRP_VERDICT_BATCH_USEC) {
+		return verdict_flush(nfq);
+	}
+	return 0;
+}
+
+/**
+ Sends the pending verdicts of the queue
+*/
+int verdict_flush(iprp_queue_t *nfq) {
+	if (nfq->batch_count == 0) {
+		return 0;
+	}
+	nfq->batch_count = 0;
+	return nfq_set_verdict_batch(nfq->queue, nfq->batch_id, nfq->batch_verdict);
 }
\ No newline at end of file
@@ -0,0 +1,39 @@
+#!/bin/bash
+# Builds and runs the tests ("test.sh bench" runs the benchmarks instead)
+# The daemon code logs in bin/test/<name>.log, the results are printed on stderr.
+# Extra compiler flags can be given in CFLAGS.
+rm -rf bin/test
+mkdir -p bin/test
+
+FLAGS="-std=c99 -I inc/ -I test/ $CFLAGS -lpthread -lnfnetlink -lnetfilter_queue -Wfatal-errors"
+ISD="$(ls src/isd/*.c | grep -v isd.c) src/lib/* test/nfq.c test/isd_setup.c -D_GNU_SOURCE"
+IRD="$(ls src/ird/*.c | grep -v ird.c) src/lib/* test/nfq.c test/ird_setup.c"
+
+if [ "$1" = "bench" ]; then
+	gcc test/bench_aggregate.c $ISD -o bin/test/bench_aggregate -O2 $FLAGS || exit 1
+	gcc test/bench_fec.c $IRD -o bin/test/bench_fec -O2 $FLAGS || exit 1
+	gcc test/bench_shift.c $IRD -o bin/test/bench_shift -O2 -D_GNU_SOURCE $FLAGS || exit 1
+
+	for b in bench_aggregate bench_fec bench_shift; do
+		bin/test/$b > /dev/null || exit 1
+	done
+	exit 0
+fi
+
+gcc test/pool.c src/isd/pool.c src/lib/* -o bin/test/pool -D_GNU_SOURCE $FLAGS || exit 1
+gcc test/rss.c $ISD -o bin/test/rss $FLAGS || exit 1
+gcc test/peerbase.c $ISD -o bin/test/peerbase $FLAGS || exit 1
+gcc test/aggregate.c $ISD -o bin/test/aggregate $FLAGS || exit 1
+gcc test/parity.c $ISD -o bin/test/parity $FLAGS || exit 1
+gcc test/recover.c $IRD -o bin/test/recover $FLAGS || exit 1
+
+failed=0
+for t in pool peerbase aggregate; do
+	bin/test/$t > bin/test/$t.log || failed=1
+done
+# 10M packets, without their logs (gigabytes)
+bin/test/rss > /dev/null || failed=1
+# The copies sent by the ISD in the parity test are handed to the IRD in the recover test
+bin/test/parity bin/test/copies > bin/test/parity.log || failed=1
+bin/test/recover bin/test/copies > bin/test/recover.log || failed=1
+exit $failed
\ No newline at end of file
@@ -0,0 +1,171 @@
+/**\file test/aggregate.c
+ * Tests of the aggregation of small payloads in frames, with the batch and paths engines
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "isd.h"
+#include "test.h"
+#include "isd_setup.h"
+
+#define FLOW_ID 1
+#define NB_PATHS 2
+#define HOLD 1000000 // Nanoseconds
+
+/* Function prototypes */
+void worker_wait(iprp_isd_worker_t *worker);
+
+int failures = 0;
+int path_sockets[NB_PATHS];
+const char *small[] = { "alpha", "bravo!", "charlie" };
+#define NB_SMALL 3
+
+/**
+ Checks the compact header of a copy received on the loopback, and returns its payload
+
+ The flags of the header must be the given ones, apart from the link description. Returns NULL if the header is wrong.
+*/
+char *header_check(char *copy, ssize_t size, uint8_t flags, uint32_t *seq_nb, size_t *payload_size) {
+	iprp_compact_header_t *header = (iprp_compact_header_t *) copy;
+	size_t header_size = sizeof(iprp_compact_header_t);
+	CHECK(size >= (ssize_t) header_size);
+	if (size < (ssize_t) header_size) {
+		return NULL;
+	}
+	CHECK(header->version == IPRP_VERSION_COMPACT);
+	CHECK((header->flags & ~IPRP_COMPACT_LINK) == flags);
+	CHECK(header->flow_id == FLOW_ID);
+	*seq_nb = header->seq_nb;
+
+	if (header->flags & IPRP_COMPACT_LINK) {
+		iprp_compact_link_t link;
+		memcpy(&link, copy + header_size, sizeof(link));
+		header_size += sizeof(iprp_compact_link_t);
+		CHECK(link.src_addr.s_addr == htonl(INADDR_LOOPBACK));
+		CHECK(link.src_port == TEST_SRC_PORT);
+		CHECK(link.dest_port == TEST_DEST_PORT);
+		CHECK(link.dest_addr.s_addr == htonl(INADDR_LOOPBACK));
+	}
+	CHECK(size >= (ssize_t) header_size);
+	*payload_size = size - header_size;
+	return copy + header_size;
+}
+
+/**
+ Checks that the given frame holds the given datagrams, in order
+*/
+void frame_check(char *frame, size_t frame_size, const char **datagrams, int count) {
+	size_t offset = 0;
+	for (int i = 0; i < count; ++i) {
+		uint16_t size;
+		CHECK(offset + sizeof(uint16_t) <= frame_size);
+		memcpy(&size, frame + offset, sizeof(uint16_t));
+		size = ntohs(size);
+		CHECK(size == strlen(datagrams[i]));
+		CHECK(offset + sizeof(uint16_t) + size <= frame_size);
+		CHECK(!memcmp(frame + offset + sizeof(uint16_t), datagrams[i], size));
+		offset += sizeof(uint16_t) + size;
+	}
+	CHECK(offset == frame_size);
+}
+
+/**
+ Checks that no copy is waiting on any path
+*/
+void nothing_sent() {
+	char copy[IPRP_PKTBUF_SIZE];
+	for (int i = 0; i < NB_PATHS; ++i) {
+		CHECK(recv(path_sockets[i], copy, sizeof(copy), MSG_DONTWAIT) == -1);
+	}
+}
+
+/**
+ Sends small payloads and a large one through the current engine
+
+ The small payloads are held in a frame until its hold time is over, which is then sent on each path
+ with the aggregation flag. A payload too large for a frame sends the frame first, and is sent alone.
+ All buffers are given back once the copies are sent.
+*/
+void test_engine(const char *name) {
+	iprp_isd_worker_t worker;
+	iprp_peerbase_t base;
+	fprintf(stderr, "aggregate: %s engine\n", name);
+	worker_setup(&worker);
+	flow_fill(&base, FLOW_ID, NB_PATHS);
+	flow_publish(&base);
+
+	// The small payloads wait in the frame, their packets are dropped
+	for (int i = 0; i < NB_SMALL; ++i) {
+		test_send(&worker, FLOW_ID, small[i], strlen(small[i]));
+		CHECK(verdicts.batch_verdict == NF_DROP);
+	}
+	nothing_sent();
+	CHECK(worker.aggregator->nb_frames == 1);
+	CHECK(worker.aggregator->frames[0].buf->refs == 1);
+	for (int i = 0; i < IPRP_ISD_POOL_SIZE; ++i) {
+		CHECK(worker.pool->bufs[i].refs == 0);
+	}
+
+	// The frame is sent once its hold time is over, with the same header on all paths
+	worker_wait(&worker);
+	CHECK(worker.aggregator->nb_frames == 0);
+	CHECK(copies_sent(&worker));
+	uint32_t frame_seq_nb = 0;
+	for (int i = 0; i < NB_PATHS; ++i) {
+		char copy[IPRP_PKTBUF_SIZE];
+		ssize_t size = recv(path_sockets[i], copy, sizeof(copy), 0);
+		uint32_t seq_nb;
+		size_t frame_size;
+		char *frame = header_check(copy, size, IPRP_COMPACT_AGGREGATE, &seq_nb, &frame_size);
+		if (frame) {
+			frame_check(frame, frame_size, small, NB_SMALL);
+		}
+		CHECK(i == 0 || seq_nb == frame_seq_nb);
+		frame_seq_nb = seq_nb;
+	}
+
+	// A large payload closes the frame of its flow, and follows it
+	char large[IPRP_ISD_AGG_MAX_PAYLOAD + 100];
+	for (size_t i = 0; i < sizeof(large); ++i) {
+		large[i] = i;
+	}
+	test_send(&worker, FLOW_ID, small[0], strlen(small[0]));
+	test_send(&worker, FLOW_ID, large, sizeof(large));
+	CHECK(copies_sent(&worker));
+	for (int i = 0; i < NB_PATHS; ++i) {
+		char copy[IPRP_PKTBUF_SIZE];
+		uint32_t seq_nb;
+		size_t payload_size;
+		ssize_t size = recv(path_sockets[i], copy, sizeof(copy), 0);
+		char *frame = header_check(copy, size, IPRP_COMPACT_AGGREGATE, &seq_nb, &payload_size);
+		if (frame) {
+			frame_check(frame, payload_size, small, 1);
+		}
+		CHECK(seq_nb == frame_seq_nb + 1);
+
+		size = recv(path_sockets[i], copy, sizeof(copy), 0);
+		char *payload = header_check(copy, size, 0, &seq_nb, &payload_size);
+		CHECK(payload && payload_size == sizeof(large) && !memcmp(payload, large, sizeof(large)));
+		CHECK(seq_nb == frame_seq_nb + 2);
+	}
+	nothing_sent();
+}
+
+int main() {
+	isd_setup();
+	for (int i = 0; i < NB_PATHS; ++i) {
+		path_sockets[i] = path_socket(i);
+	}
+	aggregate_hold = HOLD;
+
+	engine = IPRP_ENGINE_BATCH;
+	test_engine("batch");
+	engine = IPRP_ENGINE_PATHS;
+	test_engine("paths");
+
+	TEST_END("aggregate");
+}
\ No newline at end of file
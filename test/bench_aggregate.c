@@ -0,0 +1,152 @@
+/**\file test/bench_aggregate.c
+ * Throughput and latency of small payloads for several aggregation hold times (batch engine, loopback)
+ *
+ * The throughput is measured with back-to-back packets, the latency with packets paced at a fixed rate.
+ * The latency of a payload runs from its handling by the worker to its arrival on the path socket.
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "isd.h"
+#include "test.h"
+#include "isd_setup.h"
+
+#define FLOW_ID 1
+#define PAYLOAD_SIZE 64
+#define PACKETS 100000 // Back-to-back
+#define PACED_PACKETS 20000
+#define PACED_INTERVAL 20000 // Nanoseconds (50000 packets per second)
+
+/* Function prototypes */
+void worker_wait(iprp_isd_worker_t *worker);
+
+/* Payload of a packet */
+typedef struct {
+	uint64_t sent; // Monotonic clock (nanoseconds)
+	char pad[PAYLOAD_SIZE - sizeof(uint64_t)];
+} payload_t;
+
+/* Datagrams received on the path socket */
+typedef struct {
+	int socket;
+	unsigned long expected;
+	unsigned long payloads;
+	unsigned long copies;
+	uint64_t total_latency;
+	uint64_t max_latency;
+	uint64_t last; // Arrival of the last payload
+} receiver_t;
+
+/**
+ Counts the payloads arriving on the path socket, until all are received or none arrives for a second
+*/
+void *receiver_routine(void *arg) {
+	receiver_t *receiver = (receiver_t *) arg;
+	char copy[IPRP_PKTBUF_SIZE];
+	while (receiver->payloads < receiver->expected) {
+		ssize_t size = recv(receiver->socket, copy, sizeof(copy), 0);
+		if (size < (ssize_t) sizeof(iprp_compact_header_t)) {
+			break;
+		}
+		uint64_t now = clock_ns(CLOCK_MONOTONIC);
+		receiver->copies++;
+
+		iprp_compact_header_t *header = (iprp_compact_header_t *) copy;
+		size_t offset = sizeof(iprp_compact_header_t);
+		if (header->flags & IPRP_COMPACT_LINK) {
+			offset += sizeof(iprp_compact_link_t);
+		}
+		bool frame = header->flags & IPRP_COMPACT_AGGREGATE;
+		while (offset < (size_t) size) {
+			uint16_t payload_size = size - offset;
+			if (frame) {
+				memcpy(&payload_size, copy + offset, sizeof(uint16_t));
+				payload_size = ntohs(payload_size);
+				offset += sizeof(uint16_t);
+			}
+			payload_t payload;
+			memcpy(&payload, copy + offset, sizeof(payload));
+			offset += payload_size;
+
+			uint64_t latency = now - payload.sent;
+			receiver->total_latency += latency;
+			if (latency > receiver->max_latency) {
+				receiver->max_latency = latency;
+			}
+			receiver->payloads++;
+		}
+		receiver->last = now;
+	}
+	return NULL;
+}
+
+/**
+ Sends the given number of payloads with a new worker, each interval nanoseconds (back-to-back if 0)
+
+ The frames due are sent while waiting for the next packet, as the worker does while its queue is empty.
+ Returns the payloads received, and the time it took.
+*/
+receiver_t bench_run(int sock, unsigned long count, uint64_t interval, uint64_t *duration) {
+	iprp_isd_worker_t worker;
+	worker_setup(&worker);
+
+	receiver_t receiver = { .socket = sock, .expected = count };
+	pthread_t thread;
+	pthread_create(&thread, NULL, receiver_routine, &receiver);
+
+	payload_t payload;
+	memset(&payload, 0, sizeof(payload));
+	uint64_t start = clock_ns(CLOCK_MONOTONIC);
+	uint64_t next = start;
+	for (unsigned long i = 0; i < count; ++i) {
+		uint64_t now;
+		while ((now = clock_ns(CLOCK_MONOTONIC)) < next) {
+			bool sent = false;
+			if (worker.aggregator) {
+				aggregate_expire(&worker, now, &sent);
+			}
+			if (sent) {
+				flush_copies(&worker);
+			}
+		}
+		payload.sent = now;
+		test_send(&worker, FLOW_ID, (char *) &payload, sizeof(payload));
+		next += interval;
+	}
+	if (worker.aggregator) {
+		worker_wait(&worker);
+	}
+
+	pthread_join(thread, NULL);
+	*duration = receiver.last - start;
+	return receiver;
+}
+
+int main() {
+	uint64_t holds[] = { 0, 20, 100, 500, 2000 }; // Microseconds
+	isd_setup();
+	int sock = path_socket(0);
+	iprp_peerbase_t base;
+	flow_fill(&base, FLOW_ID, 1);
+	flow_publish(&base);
+
+	fprintf(stderr, "aggregation of %d-byte payloads (one path)\n", PAYLOAD_SIZE);
+	fprintf(stderr, "%10s %14s %14s | %14s %14s %14s %14s\n", "hold (us)", "payloads/s", "payloads/copy", "paced (pps)", "payloads/copy", "mean lat (us)", "max lat (us)");
+	for (size_t i = 0; i < sizeof(holds) / sizeof(holds[0]); ++i) {
+		aggregate_hold = holds[i] * 1000;
+		uint64_t duration, paced_duration;
+		receiver_t fast = bench_run(sock, PACKETS, 0, &duration);
+		receiver_t paced = bench_run(sock, PACED_PACKETS, PACED_INTERVAL, &paced_duration);
+		fprintf(stderr, "%10lu %14.0f %14.2f | %14d %14.2f %14.1f %14.1f%s\n", holds[i],
+			fast.payloads * 1e9 / duration, (double) fast.payloads / fast.copies,
+			1000000000 / PACED_INTERVAL, (double) paced.payloads / paced.copies,
+			paced.total_latency / 1e3 / paced.payloads, paced.max_latency / 1e3,
+			(fast.payloads < PACKETS || paced.payloads < PACED_PACKETS) ? " (payloads lost)" : "");
+	}
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,118 @@
+/**\file test/bench_fec.c
+ * Delivered packets and bandwidth of parity groups against duplication, with random losses on two paths
+ *
+ * The packets are built as the ISD sends them (see the parity test) and handed to the IRD, after dropping each copy
+ * with the given probability. Delivered packets are the ones forwarded to the application, and the ones rebuilt.
+ * The bandwidth counts the IP and UDP headers of all copies sent, lost or not.
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE IRD_HANDLE
+
+#include <string.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "ird.h"
+#include "test.h"
+#include "ird_setup.h"
+
+#define NB_PATHS 2
+#define PACKETS 50000
+#define PAYLOAD_SIZE 200
+#define LINK_FIRST 8 // Compact headers describe the link as the ISD does
+#define LINK_PERIOD 64
+
+iprp_ird_worker_t worker;
+uint16_t reboot = 0; // Each run is a new link
+
+/* Copies of a run */
+typedef struct {
+	double loss;
+	unsigned long wire_bytes;
+	unsigned long delivered;
+} run_t;
+
+/**
+ Sends a copy on the given path, unless it is lost
+*/
+void copy_send(run_t *run, iprp_ind_t ind, char *packet, size_t size) {
+	run->wire_bytes += sizeof(struct iphdr) + sizeof(struct udphdr) + size;
+	if (rand() >= run->loss * RAND_MAX) {
+		test_receive(&worker, ind, packet, size);
+	}
+}
+
+/**
+ Sends the packets of a new link, duplicated on all paths (group 0) or in parity groups of the given size
+*/
+run_t bench_run(double loss, int group) {
+	run_t run = { .loss = loss, .wire_bytes = 0, .delivered = 0 };
+	unsigned long forwarded = verdicts.forwarded;
+	reboot++;
+
+	char payloads[IPRP_FEC_MAX_GROUP][PAYLOAD_SIZE];
+	char *members[IPRP_FEC_MAX_GROUP];
+	size_t sizes[IPRP_FEC_MAX_GROUP];
+	uint32_t seq_nbs[IPRP_FEC_MAX_GROUP];
+	uint8_t flags[IPRP_FEC_MAX_GROUP];
+	int nb_members = 0;
+	unsigned int next_path = 0;
+	char packet[IRD_FEC_PARITY_SIZE + sizeof(iprp_compact_header_t) + sizeof(iprp_compact_link_t)];
+	for (uint32_t seq_nb = 1; seq_nb <= PACKETS; ++seq_nb) {
+		char *payload = payloads[nb_members];
+		memset(payload, seq_nb, PAYLOAD_SIZE);
+		uint8_t packet_flags = (seq_nb <= LINK_FIRST || seq_nb % LINK_PERIOD == 0) ? IPRP_COMPACT_LINK : 0;
+		if (group == 0) {
+			size_t size = data_fill(packet, reboot, seq_nb, packet_flags, payload, PAYLOAD_SIZE);
+			for (int i = 0; i < NB_PATHS; ++i) {
+				copy_send(&run, i, packet, size);
+			}
+			continue;
+		}
+
+		packet_flags |= IPRP_COMPACT_FEC;
+		size_t size = data_fill(packet, reboot, seq_nb, packet_flags, payload, PAYLOAD_SIZE);
+		copy_send(&run, next_path++ % NB_PATHS, packet, size);
+		members[nb_members] = payload;
+		sizes[nb_members] = PAYLOAD_SIZE;
+		seq_nbs[nb_members] = seq_nb;
+		flags[nb_members] = packet_flags;
+		if (++nb_members == group) {
+			size = parity_fill(packet, seq_nbs, flags, members, sizes, nb_members);
+			copy_send(&run, next_path % NB_PATHS, packet, size); // On the path of the next packet, without taking its turn
+			nb_members = 0;
+		}
+	}
+
+	iprp_receiver_link_t *link = test_link(reboot);
+	run.delivered = verdicts.forwarded - forwarded + ((link && link->fec) ? link->fec->recovered : 0);
+	return run;
+}
+
+int main() {
+	double losses[] = { 0.001, 0.01, 0.05, 0.1 };
+	int groups[] = { 0, 4, 8 };
+	ird_setup(&worker);
+	srand(1);
+
+	fprintf(stderr, "%d packets of %d bytes on %d paths, each copy lost with the given probability\n", PACKETS, PAYLOAD_SIZE, NB_PATHS);
+	fprintf(stderr, "%8s", "loss");
+	for (size_t j = 0; j < sizeof(groups) / sizeof(groups[0]); ++j) {
+		char name[32] = "duplication";
+		if (groups[j]) {
+			snprintf(name, sizeof(name), "parity (%d)", groups[j]);
+		}
+		fprintf(stderr, " | %-12s %10s %10s", name, "delivered", "bytes/B");
+	}
+	fprintf(stderr, "\n");
+	for (size_t i = 0; i < sizeof(losses) / sizeof(losses[0]); ++i) {
+		fprintf(stderr, "%7.1f%%", losses[i] * 100);
+		for (size_t j = 0; j < sizeof(groups) / sizeof(groups[0]); ++j) {
+			run_t run = bench_run(losses[i], groups[j]);
+			fprintf(stderr, " | %-12s %9.3f%% %10.2f", "", run.delivered * 100.0 / PACKETS, (double) run.wire_bytes / (PACKETS * PAYLOAD_SIZE));
+		}
+		fprintf(stderr, "\n");
+	}
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
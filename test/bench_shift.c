@@ -0,0 +1,171 @@
+/**\file test/bench_shift.c
+ * Decapsulation time of a packet by the IRD, moving its payload over the iPRP header (before) or its headers (now)
+ *
+ * The packets carry a compact header with the link, and a UDP checksum. Both ways update the headers in the same way:
+ * the former one is copied from create_new_packet, before the headers were moved. Each run restores the headers of
+ * the packet first (the packet stays in the cache, as after its copy from the queue).
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE IRD_HANDLE
+
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "ird.h"
+#include "test.h"
+#include "ird_setup.h"
+
+#define PACKETS 1000000
+#define ROUNDS 5 // The best round is kept
+
+/* Function prototypes */
+char *create_new_packet(struct iphdr *ip_header, struct udphdr *udp_header, iprp_receiver_link_t *link, void *iprp_header, char *payload, size_t payload_size);
+uint16_t checksum_add(uint16_t sum, const void *data, size_t size, size_t offset);
+uint16_t checksum_sub(uint16_t sum, const void *data, size_t size, size_t offset);
+uint16_t checksum_fold(uint64_t checksum);
+uint16_t pseudo_sum(struct iphdr *ip_header, uint16_t udp_len);
+
+/* Decapsulation function */
+typedef char *(*create_t)(struct iphdr *, struct udphdr *, iprp_receiver_link_t *, void *, char *, size_t);
+
+/**
+ Rewrites the headers as create_new_packet does, then moves the payload over the iPRP header (former version)
+*/
+char *create_old_packet(struct iphdr *ip_header, struct udphdr *udp_header, iprp_receiver_link_t *link, void *iprp_header, char *payload, size_t payload_size) {
+	struct iphdr old_ip = *ip_header;
+	struct udphdr old_udp = *udp_header;
+
+	// Modify IP header
+	ip_header->saddr = link->src_addr.s_addr;
+	ip_header->daddr = link->dest_addr.s_addr;
+	ip_header->tot_len = htons(payload_size + sizeof(struct iphdr) + sizeof(struct udphdr));
+	uint16_t sum = ~ntohs(old_ip.check);
+	sum = checksum_sub(sum, &old_ip.tot_len, sizeof(uint16_t), 0);
+	sum = checksum_add(sum, &ip_header->tot_len, sizeof(uint16_t), 0);
+	sum = checksum_sub(sum, &old_ip.saddr, 2 * sizeof(uint32_t), 0);
+	sum = checksum_add(sum, &ip_header->saddr, 2 * sizeof(uint32_t), 0);
+	ip_header->check = htons(~sum);
+
+	// Modify UDP headers
+	udp_header->dest = htons(link->dest_port);
+	udp_header->source = htons(link->src_port);
+	udp_header->len = htons(payload_size + sizeof(struct udphdr));
+	if (old_udp.check) {
+		size_t offset = sizeof(struct udphdr) + (payload - (char *) iprp_header);
+		size_t old_size = ntohs(old_udp.len);
+		sum = ~ntohs(old_udp.check);
+		sum = checksum_sub(sum, &old_udp, offsetof(struct udphdr, check), 0);
+		sum = checksum_sub(sum, iprp_header, offset - sizeof(struct udphdr), sizeof(struct udphdr));
+		if (old_size > offset + payload_size) {
+			sum = checksum_sub(sum, payload + payload_size, old_size - offset - payload_size, offset + payload_size);
+		}
+		sum = checksum_fold(sum + (uint16_t) ~pseudo_sum(&old_ip, old_udp.len));
+		if (offset % 2) {
+			sum = (sum << 8) | (sum >> 8);
+		}
+		sum = checksum_add(sum, udp_header, offsetof(struct udphdr, check), 0);
+		sum = checksum_fold(sum + pseudo_sum(ip_header, udp_header->len));
+		uint16_t check = ~sum;
+		udp_header->check = htons(check ? check : 0xFFFF);
+	}
+
+	// Move payload over IPRP header
+	memmove(iprp_header, payload, payload_size);
+
+	return (char *) ip_header;
+}
+
+/**
+ Returns the monotonic clock in nanoseconds
+*/
+uint64_t now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ Writes an iPRP packet with the given payload size in the given buffer, and returns the size of its headers
+*/
+size_t packet_build(char *buf, size_t payload_size) {
+	char iprp_packet[IPRP_PKTBUF_SIZE];
+	char payload[IPRP_MAX_PACKET_SIZE];
+	for (size_t i = 0; i < payload_size; ++i) {
+		payload[i] = i * 7;
+	}
+	size_t size = data_fill(iprp_packet, 1, 1, IPRP_COMPACT_LINK, payload, payload_size);
+	iprp_test_packet_t packet;
+	packet_fill(&packet, buf, 0, htonl(INADDR_LOOPBACK), htonl(INADDR_LOOPBACK), iprp_packet, size);
+	((struct udphdr *) (buf + sizeof(struct iphdr)))->check = htons(0x1234); // Any sum, so that it is updated
+	return sizeof(struct iphdr) + sizeof(struct udphdr) + size - payload_size;
+}
+
+/**
+ Decapsulates a packet with the given function, and returns the start of the new packet
+*/
+char *decapsulate(create_t create, char *buf, size_t header_size, size_t payload_size, iprp_receiver_link_t *link) {
+	struct iphdr *ip_header = (struct iphdr *) buf;
+	struct udphdr *udp_header = (struct udphdr *) (buf + sizeof(struct iphdr));
+	char *iprp_header = buf + sizeof(struct iphdr) + sizeof(struct udphdr);
+	return create(ip_header, udp_header, link, iprp_header, buf + header_size, payload_size);
+}
+
+/**
+ Returns the best time per packet (nanoseconds) of the given function, restoring the headers before each packet
+*/
+double bench_run(create_t create, char *buf, const char *headers, size_t header_size, size_t payload_size, iprp_receiver_link_t *link) {
+	double best = 0;
+	for (int round = 0; round < ROUNDS; ++round) {
+		uint64_t start = now_ns();
+		for (int i = 0; i < PACKETS; ++i) {
+			memcpy(buf, headers, header_size);
+			char *packet = decapsulate(create, buf, header_size, payload_size, link);
+			__asm__ volatile("" : : "r" (packet) : "memory"); // Keep the packet
+		}
+		double time = (double) (now_ns() - start) / PACKETS;
+		if (round == 0 || time < best) {
+			best = time;
+		}
+	}
+	return best;
+}
+
+int main() {
+	size_t sizes[] = { 64, 128, 256, 512, 1024, 1400 };
+	iprp_receiver_link_t link;
+	memset(&link, 0, sizeof(link));
+	link.src_addr.s_addr = htonl(INADDR_LOOPBACK + 1);
+	link.dest_addr.s_addr = htonl(INADDR_LOOPBACK + 2);
+	link.src_port = TEST_SRC_PORT;
+	link.dest_port = TEST_DEST_PORT;
+
+	static char buf[IPRP_PKTBUF_SIZE];
+	static char old_buf[IPRP_PKTBUF_SIZE];
+	char headers[IPRP_PKTBUF_SIZE];
+	fprintf(stderr, "decapsulation of %d packets (best of %d rounds)\n", PACKETS, ROUNDS);
+	fprintf(stderr, "%14s %14s %14s %10s\n", "payload (B)", "before (ns)", "now (ns)", "speedup");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		size_t header_size = packet_build(buf, sizes[i]);
+		memcpy(headers, buf, header_size);
+		memcpy(old_buf, buf, header_size + sizes[i]);
+
+		// Both ways give the same packet
+		size_t size = sizeof(struct iphdr) + sizeof(struct udphdr) + sizes[i];
+		char *packet = decapsulate(create_new_packet, buf, header_size, sizes[i], &link);
+		char *old_packet = decapsulate(create_old_packet, old_buf, header_size, sizes[i], &link);
+		if (memcmp(packet, old_packet, size)) {
+			fprintf(stderr, "shift: packets differ (%lu-byte payload)\n", sizes[i]);
+			return EXIT_FAILURE;
+		}
+
+		double before = bench_run(create_old_packet, old_buf, headers, header_size, sizes[i], &link);
+		double now = bench_run(create_new_packet, buf, headers, header_size, sizes[i], &link);
+		fprintf(stderr, "%14lu %14.1f %14.1f %9.2fx\n", sizes[i], before, now, before / now);
+	}
+	return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,162 @@
+/**\file test/ird_setup.c
+ * IRD state of the tests and benchmarks (in place of ird.c, the workers are called directly)
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE IRD_MAIN
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include "ird.h"
+#include "test.h"
+#include "ird_setup.h"
+
+/* Forwarding queue number (see ird.c) */
+int imd_queue_id;
+
+/* State of the workers (see handle.c) */
+extern list_t receiver_links;
+extern iprp_ird_table_t links_by_snsid;
+extern iprp_ird_table_t links_by_path;
+extern int split_socket;
+extern int nb_readers;
+
+/* Function prototypes */
+int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data);
+iprp_receiver_link_t *receiver_link_get(unsigned char *snsid);
+
+/**
+ Initializes the state shared by the workers as handle_init does, for the given worker only
+
+ The cleanup routine is not launched: the links stay, and the path statistics are not stored.
+*/
+void ird_setup(iprp_ird_worker_t *worker) {
+	list_init(&receiver_links);
+	nb_readers = 1;
+	table_init(&links_by_snsid);
+	table_init(&links_by_path);
+	if ((split_socket = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1) {
+		ERR("Unable to create split socket (the tests run as root)", errno);
+	}
+
+	memset(worker, 0, sizeof(iprp_ird_worker_t));
+	worker->nfq.fd = -1;
+}
+
+/**
+ Creates the socket of the application receiving the datagrams of the link (blocking for at most a second)
+
+ The datagrams delivered by the IRD itself (split from frames, or rebuilt from parity packets) arrive here.
+*/
+int app_socket() {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1) {
+		ERR("Unable to create application socket", errno);
+	}
+	struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	struct sockaddr_in addr;
+	struct in_addr loopback = { htonl(INADDR_LOOPBACK) };
+	sockaddr_fill(&addr, loopback, TEST_DEST_PORT);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		ERR("Unable to bind application socket", errno);
+	}
+	return sock;
+}
+
+/**
+ Writes a data packet of the link in the given buffer, as the ISD sends it (the link is described if the flags say so)
+
+ Returns the size of the packet.
+*/
+size_t data_fill(char *buf, uint16_t reboot, uint32_t seq_nb, uint8_t flags, const char *payload, size_t payload_size) {
+	iprp_compact_header_t header = {
+		.version = IPRP_VERSION_COMPACT,
+		.flags = flags,
+		.flow_id = TEST_FLOW_ID,
+		.seq_nb = seq_nb
+	};
+	memcpy(buf, &header, sizeof(header));
+	size_t size = sizeof(header);
+
+	if (flags & IPRP_COMPACT_LINK) {
+		iprp_compact_link_t link = {
+			.src_addr = { htonl(INADDR_LOOPBACK) },
+			.src_port = TEST_SRC_PORT,
+			.reboot = reboot,
+			.dest_port = TEST_DEST_PORT,
+			.dest_addr = { htonl(INADDR_LOOPBACK) }
+		};
+		memcpy(buf + size, &link, sizeof(link));
+		size += sizeof(link);
+	}
+
+	memcpy(buf + size, payload, payload_size);
+	return size + payload_size;
+}
+
+/**
+ Writes the parity packet of the given data packets in the given buffer, as the ISD sends it
+
+ Returns the size of the packet.
+*/
+size_t parity_fill(char *buf, uint32_t *seq_nbs, uint8_t *flags, char **payloads, size_t *payload_sizes, int count) {
+	iprp_compact_header_t header = {
+		.version = IPRP_VERSION_COMPACT,
+		.flags = IPRP_COMPACT_PARITY,
+		.flow_id = TEST_FLOW_ID,
+		.seq_nb = 0
+	};
+	memcpy(buf, &header, sizeof(header));
+
+	iprp_parity_header_t *parity = (iprp_parity_header_t *) (buf + sizeof(header));
+	memset(parity, 0, sizeof(iprp_parity_header_t));
+	parity->nb_members = count;
+	size_t parity_size = 0;
+	for (int i = 0; i < count; ++i) {
+		parity->members[i].seq_nb = seq_nbs[i];
+		parity->members[i].size = payload_sizes[i];
+		parity->members[i].flags = flags[i];
+		parity->members[i].pad = 0;
+		if (payload_sizes[i] > parity_size) {
+			parity_size = payload_sizes[i];
+		}
+	}
+
+	char *data = (char *) &parity->members[count];
+	memset(data, 0, parity_size);
+	for (int i = 0; i < count; ++i) {
+		for (size_t j = 0; j < payload_sizes[i]; ++j) {
+			data[j] ^= payloads[i][j];
+		}
+	}
+	return data + parity_size - buf;
+}
+
+/**
+ Handles the given iPRP packet with the given worker, as if it arrived on the given path (from 127.0.0.1 for IND 0, 127.0.0.2 for IND 1...)
+
+ The pending verdicts are sent afterwards.
+*/
+void test_receive(iprp_ird_worker_t *worker, iprp_ind_t ind, char *iprp_packet, size_t size) {
+	static char buf[IPRP_PKTBUF_SIZE];
+	iprp_test_packet_t packet;
+	packet_fill(&packet, buf, 0, htonl(INADDR_LOOPBACK + ind), htonl(INADDR_LOOPBACK), iprp_packet, size);
+	handle_packet(NULL, NULL, (struct nfq_data *) &packet, worker);
+	verdict_flush(&worker->nfq);
+}
+
+/**
+ Returns the link with the given reboot counter (NULL if unknown)
+*/
+iprp_receiver_link_t *test_link(uint16_t reboot) {
+	unsigned char snsid[IPRP_SNSID_SIZE];
+	struct in_addr loopback = { htonl(INADDR_LOOPBACK) };
+	snsid_fill(snsid, loopback, TEST_SRC_PORT, reboot);
+	return receiver_link_get(snsid);
+}
\ No newline at end of file
@@ -0,0 +1,26 @@
+/**\file ird_setup.h
+ * Header file for the IRD state of the tests and benchmarks
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+
+#ifndef __IPRP_TEST_IRD_
+#define __IPRP_TEST_IRD_
+
+#include "ird.h"
+
+#define TEST_SRC_PORT 5000 // Ports of the application datagrams
+#define TEST_DEST_PORT 6000
+#define TEST_FLOW_ID 1
+
+/* Setup functions */
+void ird_setup(iprp_ird_worker_t *worker);
+int app_socket();
+
+/* Packet functions (compact headers of the link from 127.0.0.1 to itself, with the given reboot counter) */
+size_t data_fill(char *buf, uint16_t reboot, uint32_t seq_nb, uint8_t flags, const char *payload, size_t payload_size);
+size_t parity_fill(char *buf, uint32_t *seq_nbs, uint8_t *flags, char **payloads, size_t *payload_sizes, int count);
+void test_receive(iprp_ird_worker_t *worker, iprp_ind_t ind, char *iprp_packet, size_t size);
+iprp_receiver_link_t *test_link(uint16_t reboot);
+
+#endif /* __IPRP_TEST_IRD_ */
\ No newline at end of file
@@ -0,0 +1,174 @@
+/**\file test/isd_setup.c
+ * ISD state of the tests and benchmarks (in place of isd.c, the workers are called directly)
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_MAIN
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "isd.h"
+#include "peerbase.h"
+#include "test.h"
+#include "isd_setup.h"
+
+/* Global variables (see isd.c) */
+int sockets[IPRP_MAX_INDS];
+int raw_sockets[IPRP_MAX_INDS];
+iprp_isd_peerbase_t pb = {
+	.current = NULL,
+	.version = 0,
+	.nb_readers = 0,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.loaded = false
+};
+
+iprp_isd_worker_t workers[IPRP_ISD_MAX_WORKERS];
+iprp_isd_engine_t engine = IPRP_ENGINE_BATCH;
+bool gso = false;
+bool txtime = false;
+uint64_t aggregate_hold = 0;
+iprp_isd_txtrack_t txtracks[IPRP_MAX_INDS];
+iprp_isd_path_t paths[IPRP_MAX_INDS];
+
+/* Function prototypes */
+int handle_packet(struct nfq_q_handle *queue, struct nfgenmsg *message, struct nfq_data *packet, void *data);
+void pb_publish(iprp_peerbase_t *bases, int count);
+
+/**
+ Creates the send sockets of the ISD, for a single worker
+*/
+void isd_setup() {
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		if ((sockets[i] = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+			ERR("Unable to setup socket", errno);
+		}
+	}
+	pb.nb_readers = 1;
+}
+
+/**
+ Initializes the given worker as its routine does, with the current engine and aggregation hold time
+
+ The worker has no queue: its packets are given to test_send.
+*/
+void worker_setup(iprp_isd_worker_t *worker) {
+	memset(worker, 0, sizeof(iprp_isd_worker_t));
+	worker->nfq.fd = -1;
+	for (int i = 0; i < IPRP_MAX_INDS; ++i) {
+		batch_init(&worker->batches[i], sockets[i], gso, false);
+	}
+	if (!(worker->pool = pool_create())) {
+		ERR("Unable to allocate packet pool", errno);
+	}
+	if (aggregate_hold > 0 && !(worker->aggregator = aggregator_create())) {
+		ERR("Unable to allocate aggregation frames", errno);
+	}
+}
+
+/**
+ Describes a flow from this host to itself, with one path per loopback address (127.0.0.1 for IND 0, 127.0.0.2 for IND 1...)
+
+ The receivers of the flow understand all the headers (aggregated frames and parity packets are used if enabled).
+*/
+void flow_fill(iprp_peerbase_t *base, uint16_t flow_id, int nb_paths) {
+	memset(base, 0, sizeof(iprp_peerbase_t));
+	base->flow_id = flow_id;
+	base->link.src_addr.s_addr = htonl(INADDR_LOOPBACK);
+	base->link.dest_addr.s_addr = htonl(INADDR_LOOPBACK);
+	base->link.src_port = TEST_SRC_PORT;
+	base->link.dest_port = TEST_DEST_PORT;
+	snsid_fill((unsigned char *) base->link.snsid, base->link.src_addr, base->link.src_port, 1);
+	base->host.nb_ifaces = nb_paths;
+	for (int i = 0; i < nb_paths; ++i) {
+		base->host.ifaces[i].ind = i;
+		base->host.ifaces[i].addr.s_addr = htonl(INADDR_LOOPBACK);
+		base->inds |= 1 << i;
+		base->dest_addr[i].s_addr = htonl(INADDR_LOOPBACK + i);
+	}
+	base->version = IPRP_VERSION;
+}
+
+/**
+ Publishes the given flow as the only one of the flow table, as the peerbase routine does
+*/
+void flow_publish(iprp_peerbase_t *base) {
+	if (IPRP_ENGINE_THREADED(engine)) {
+		for (int i = 0; i < base->host.nb_ifaces; ++i) {
+			tx_start(&paths[base->host.ifaces[i].ind], &base->host.ifaces[i]);
+		}
+	}
+	pb_publish(base, 1);
+}
+
+/**
+ Handles a packet of the given flow with the given worker, as if it was the only packet of its queue
+
+ The packet is written in the receive buffer of the worker, and the pending copies and verdicts are sent afterwards.
+*/
+void test_send(iprp_isd_worker_t *worker, uint16_t flow_id, const char *payload, size_t payload_size) {
+	while (!(worker->current_buf = pool_next(worker->pool))) {
+		worker->pool->exhausted++;
+		flush_copies(worker);
+		wait_copies(worker);
+	}
+
+	iprp_test_packet_t packet;
+	packet_fill(&packet, worker->current_buf->data, IPRP_FLOW_MARK | flow_id, htonl(INADDR_LOOPBACK), htonl(INADDR_LOOPBACK), payload, payload_size);
+	handle_packet(NULL, NULL, (struct nfq_data *) &packet, worker);
+
+	flush_copies(worker);
+	verdict_flush(&worker->nfq);
+}
+
+/**
+ Creates the socket receiving the copies of the given path (blocking for at most a second)
+*/
+int path_socket(iprp_ind_t ind) {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == -1) {
+		ERR("Unable to create path socket", errno);
+	}
+	int size = TEST_RCVBUF;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+	struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	struct sockaddr_in addr;
+	struct in_addr path_addr = { htonl(INADDR_LOOPBACK + ind) };
+	sockaddr_fill(&addr, path_addr, IPRP_DATA_PORT);
+	if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		ERR("Unable to bind path socket (the tests run as root)", errno);
+	}
+	return sock;
+}
+
+/**
+ Waits until the copies of all the buffers of the given worker are sent (at most a second)
+
+ Returns false if some buffers are still in use.
+*/
+bool copies_sent(iprp_isd_worker_t *worker) {
+	for (int wait = 0; wait < 1000; ++wait) {
+		bool sent = true;
+		for (int i = 0; i < IPRP_ISD_POOL_SIZE; ++i) {
+			sent = sent && __atomic_load_n(&worker->pool->bufs[i].refs, __ATOMIC_ACQUIRE) == 0;
+		}
+		for (int i = 0; worker->aggregator && i < IPRP_ISD_AGG_BUFS; ++i) {
+			sent = sent && __atomic_load_n(&worker->aggregator->bufs[i].refs, __ATOMIC_ACQUIRE) == 0;
+		}
+		for (int i = 0; worker->fec && i < IPRP_ISD_FEC_BUFS; ++i) {
+			sent = sent && __atomic_load_n(&worker->fec->bufs[i].refs, __ATOMIC_ACQUIRE) == 0;
+		}
+		if (sent) {
+			return true;
+		}
+		usleep(1000);
+	}
+	return false;
+}
\ No newline at end of file
@@ -0,0 +1,31 @@
+/**\file isd_setup.h
+ * Header file for the ISD state of the tests and benchmarks
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+
+#ifndef __IPRP_TEST_ISD_
+#define __IPRP_TEST_ISD_
+
+#include "isd.h"
+
+#define TEST_SRC_PORT 5000 // Ports of the application datagrams
+#define TEST_DEST_PORT 6000
+#define TEST_RCVBUF (8 * 1024 * 1024) // Receive buffer of the path sockets
+
+extern iprp_isd_engine_t engine;
+extern uint64_t aggregate_hold;
+extern iprp_isd_path_t paths[IPRP_MAX_INDS];
+
+/* Setup functions */
+void isd_setup();
+void worker_setup(iprp_isd_worker_t *worker);
+void flow_fill(iprp_peerbase_t *base, uint16_t flow_id, int nb_paths);
+void flow_publish(iprp_peerbase_t *base);
+
+/* Sending functions */
+void test_send(iprp_isd_worker_t *worker, uint16_t flow_id, const char *payload, size_t payload_size);
+int path_socket(iprp_ind_t ind);
+bool copies_sent(iprp_isd_worker_t *worker);
+
+#endif /* __IPRP_TEST_ISD_ */
\ No newline at end of file
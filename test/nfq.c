@@ -0,0 +1,78 @@
+/**\file test/nfq.c
+ * NFQueue packets built by the tests
+ *
+ * The functions of the library that read a packet or set its verdict are replaced here
+ * (the definitions of the program take precedence over the ones of the shared library),
+ * so that the handlers of the daemons can be called without a queue.
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#include <string.h>
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "test.h"
+
+iprp_test_verdicts_t verdicts;
+uint32_t next_packet_id = 1;
+
+/**
+ Writes an IP packet carrying the given UDP payload in the given buffer, and makes it the content of the given packet
+
+ Addresses are in network order. Returns the size of the IP packet.
+*/
+size_t packet_fill(iprp_test_packet_t *packet, char *buf, uint32_t mark, uint32_t src_addr, uint32_t dest_addr, const char *payload, size_t payload_size) {
+	struct iphdr *ip = (struct iphdr *) buf;
+	struct udphdr *udp = (struct udphdr *) (buf + sizeof(struct iphdr));
+	size_t size = sizeof(struct iphdr) + sizeof(struct udphdr) + payload_size;
+
+	memset(ip, 0, sizeof(struct iphdr));
+	ip->version = 4;
+	ip->ihl = sizeof(struct iphdr) / 4;
+	ip->tot_len = htons(size);
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->saddr = src_addr;
+	ip->daddr = dest_addr;
+	udp->source = htons(IPRP_DATA_PORT);
+	udp->dest = htons(IPRP_DATA_PORT);
+	udp->len = htons(sizeof(struct udphdr) + payload_size);
+	udp->check = 0;
+	memmove(buf + sizeof(struct iphdr) + sizeof(struct udphdr), payload, payload_size);
+
+	packet->mark = mark;
+	packet->data = (unsigned char *) buf;
+	packet->size = size;
+	packet->header.packet_id = htonl(next_packet_id++);
+	return size;
+}
+
+int nfq_get_payload(struct nfq_data *nfad, unsigned char **data) {
+	iprp_test_packet_t *packet = (iprp_test_packet_t *) nfad;
+	*data = packet->data;
+	return packet->size;
+}
+
+struct nfqnl_msg_packet_hdr *nfq_get_msg_packet_hdr(struct nfq_data *nfad) {
+	return &((iprp_test_packet_t *) nfad)->header;
+}
+
+uint32_t nfq_get_nfmark(struct nfq_data *nfad) {
+	return ((iprp_test_packet_t *) nfad)->mark;
+}
+
+int nfq_set_verdict_batch(struct nfq_q_handle *qh, uint32_t id, uint32_t verdict) {
+	verdicts.batches++;
+	verdicts.batch_id = id;
+	verdicts.batch_verdict = verdict;
+	return 0;
+}
+
+int nfq_set_verdict(struct nfq_q_handle *qh, uint32_t id, uint32_t verdict, uint32_t data_len, const unsigned char *buf) {
+	verdicts.forwarded++;
+	if (verdicts.forward) {
+		verdicts.forward(buf, data_len);
+	}
+	return 0;
+}
\ No newline at end of file
@@ -0,0 +1,217 @@
+/**\file test/parity.c
+ * Tests of the parity packets sent by the ISD, with the batch and paths engines
+ *
+ * Given a file, the copies of groups spread over all paths are stored there for the recover test.
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <string.h>
+
+#include "isd.h"
+#include "test.h"
+#include "isd_setup.h"
+
+#define FLOW_ID 1
+#define NB_PATHS 2
+#define GROUP 4
+#define SPREAD_PACKETS 8
+
+int failures = 0;
+int path_sockets[NB_PATHS];
+
+/**
+ Receives a copy on the given path, and returns its compact header and payload (the payload is NULL if none was received)
+*/
+char *copy_receive(iprp_ind_t ind, char *copy, iprp_compact_header_t *header, size_t *payload_size) {
+	ssize_t size = recv(path_sockets[ind], copy, IPRP_PKTBUF_SIZE, 0);
+	CHECK(size >= (ssize_t) sizeof(iprp_compact_header_t));
+	if (size < (ssize_t) sizeof(iprp_compact_header_t)) {
+		return NULL;
+	}
+	memcpy(header, copy, sizeof(iprp_compact_header_t));
+	size_t header_size = sizeof(iprp_compact_header_t);
+	if (header->flags & IPRP_COMPACT_LINK) {
+		header_size += sizeof(iprp_compact_link_t);
+	}
+	CHECK(header->version == IPRP_VERSION_COMPACT);
+	CHECK(header->flow_id == FLOW_ID);
+	*payload_size = size - header_size;
+	return copy + header_size;
+}
+
+/**
+ Sends a group of payloads of a protected flow through the current engine
+
+ Each packet is sent once, on the paths of the flow in turn, and the parity packet follows on the next path.
+ The parity lists the packets of the group, and is the XOR of their payloads. All buffers are given back once sent.
+*/
+void test_engine(const char *name) {
+	iprp_isd_worker_t worker;
+	iprp_peerbase_t base;
+	fprintf(stderr, "parity: %s engine\n", name);
+	worker_setup(&worker);
+	flow_fill(&base, FLOW_ID, NB_PATHS);
+	base.fec_group = GROUP;
+	flow_publish(&base);
+
+	size_t sizes[GROUP] = { 100, 300, 50, 200 };
+	char payloads[GROUP][300];
+	char parity[300];
+	memset(parity, 0, sizeof(parity));
+	for (int i = 0; i < GROUP; ++i) {
+		for (size_t j = 0; j < sizes[i]; ++j) {
+			payloads[i][j] = i * 31 + j;
+			parity[j] ^= payloads[i][j];
+		}
+		test_send(&worker, FLOW_ID, payloads[i], sizes[i]);
+	}
+	CHECK(copies_sent(&worker));
+
+	// The packets of the group, on their path
+	iprp_fec_member_t members[GROUP];
+	for (int i = 0; i < GROUP; ++i) {
+		char copy[IPRP_PKTBUF_SIZE];
+		iprp_compact_header_t header;
+		size_t size;
+		char *payload = copy_receive(i % NB_PATHS, copy, &header, &size);
+		if (!payload) {
+			return;
+		}
+		CHECK((header.flags & ~IPRP_COMPACT_LINK) == IPRP_COMPACT_FEC);
+		CHECK(size == sizes[i] && !memcmp(payload, payloads[i], size));
+		CHECK(i == 0 || header.seq_nb == members[i - 1].seq_nb + 1);
+		members[i] = (iprp_fec_member_t) { .seq_nb = header.seq_nb, .size = size, .flags = header.flags, .pad = 0 };
+	}
+
+	// The parity packet, on the next path
+	char copy[IPRP_PKTBUF_SIZE];
+	iprp_compact_header_t header;
+	size_t size;
+	char *payload = copy_receive(GROUP % NB_PATHS, copy, &header, &size);
+	if (!payload) {
+		return;
+	}
+	CHECK(header.flags == IPRP_COMPACT_PARITY);
+	CHECK(header.seq_nb == 0);
+	size_t members_size = sizeof(iprp_parity_header_t) + GROUP * sizeof(iprp_fec_member_t);
+	CHECK(size == members_size + 300);
+	CHECK(((iprp_parity_header_t *) payload)->nb_members == GROUP);
+	CHECK(!memcmp(payload + sizeof(iprp_parity_header_t), members, sizeof(members)));
+	CHECK(!memcmp(payload + members_size, parity, 300));
+
+	for (int i = 0; i < NB_PATHS; ++i) {
+		CHECK(recv(path_sockets[i], copy, sizeof(copy), MSG_DONTWAIT) == -1);
+	}
+}
+
+/**
+ Sends groups one packet smaller than the number of paths through the current engine, and stores the copies in the given file (if any)
+
+ Each path carries packets, and each parity packet goes on another path than its packets: the IRD can then find the
+ link of every parity packet. The copies are stored in sending order (each parity packet after the last of its packets).
+*/
+void test_spread(const char *name, FILE *copies) {
+	iprp_isd_worker_t worker;
+	iprp_peerbase_t base;
+	fprintf(stderr, "parity: %s engine, groups of %d\n", name, NB_PATHS - 1);
+	worker_setup(&worker);
+	flow_fill(&base, FLOW_ID, NB_PATHS);
+	snsid_fill((unsigned char *) base.link.snsid, base.link.src_addr, base.link.src_port, TEST_COPIES_REBOOT);
+	base.fec_group = NB_PATHS - 1;
+	flow_publish(&base);
+
+	char payload[SPREAD_PACKETS + 100];
+	for (int i = 0; i < SPREAD_PACKETS; ++i) {
+		memset(payload, i, sizeof(payload));
+		test_send(&worker, FLOW_ID, payload, 100 + i);
+	}
+	CHECK(copies_sent(&worker));
+
+	// Copies of each path
+	static char data[NB_PATHS][2 * SPREAD_PACKETS][IPRP_PKTBUF_SIZE];
+	ssize_t sizes[NB_PATHS][2 * SPREAD_PACKETS];
+	int nb_copies[NB_PATHS];
+	int data_paths[SPREAD_PACKETS];
+	memset(data_paths, -1, sizeof(data_paths));
+	uint32_t first_seq_nb = 0;
+	for (int i = 0; i < NB_PATHS; ++i) {
+		int nb_data = 0;
+		int nb_parities = 0;
+		nb_copies[i] = 0;
+		while (nb_copies[i] < 2 * SPREAD_PACKETS && (sizes[i][nb_copies[i]] = recv(path_sockets[i], data[i][nb_copies[i]], IPRP_PKTBUF_SIZE, MSG_DONTWAIT)) > 0) {
+			iprp_compact_header_t *header = (iprp_compact_header_t *) data[i][nb_copies[i]++];
+			if (header->flags & IPRP_COMPACT_PARITY) {
+				nb_parities++;
+				continue;
+			}
+			nb_data++;
+			if (!first_seq_nb || header->seq_nb < first_seq_nb) {
+				first_seq_nb = header->seq_nb;
+			}
+		}
+		CHECK(nb_data > 0);
+		CHECK(nb_parities > 0);
+	}
+
+	// Path of each packet, then the copies in sending order
+	for (int i = 0; i < NB_PATHS; ++i) {
+		for (int j = 0; j < nb_copies[i]; ++j) {
+			iprp_compact_header_t *header = (iprp_compact_header_t *) data[i][j];
+			if (!(header->flags & IPRP_COMPACT_PARITY) && header->seq_nb - first_seq_nb < SPREAD_PACKETS) {
+				data_paths[header->seq_nb - first_seq_nb] = i;
+			}
+		}
+	}
+	for (int step = 0; step < 2 * SPREAD_PACKETS; ++step) {
+		for (int i = 0; i < NB_PATHS; ++i) {
+			for (int j = 0; j < nb_copies[i]; ++j) {
+				iprp_compact_header_t *header = (iprp_compact_header_t *) data[i][j];
+				bool parity = header->flags & IPRP_COMPACT_PARITY;
+				if (parity != step % 2) {
+					continue; // Packet first, then its parity
+				} else if (parity) {
+					iprp_parity_header_t *members = (iprp_parity_header_t *) (data[i][j] + sizeof(iprp_compact_header_t));
+					uint32_t last = members->members[members->nb_members - 1].seq_nb - first_seq_nb;
+					if (last != (uint32_t) step / 2) {
+						continue;
+					}
+					for (int k = 0; k < members->nb_members; ++k) {
+						uint32_t member = members->members[k].seq_nb - first_seq_nb;
+						CHECK(member < SPREAD_PACKETS && data_paths[member] != i);
+					}
+				} else if (header->seq_nb - first_seq_nb != (uint32_t) step / 2) {
+					continue;
+				}
+				iprp_test_copy_t copy = { .ind = i, .size = sizes[i][j] };
+				if (copies && (fwrite(&copy, sizeof(copy), 1, copies) != 1 || fwrite(data[i][j], sizes[i][j], 1, copies) != 1)) {
+					CHECK(!"copies stored");
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	isd_setup();
+	for (int i = 0; i < NB_PATHS; ++i) {
+		path_sockets[i] = path_socket(i);
+	}
+
+	FILE *copies = (argc > 1) ? fopen(argv[1], "w") : NULL;
+	CHECK(argc <= 1 || copies);
+
+	engine = IPRP_ENGINE_BATCH;
+	test_engine("batch");
+	test_spread("batch", copies);
+	engine = IPRP_ENGINE_PATHS;
+	test_engine("paths");
+	test_spread("paths", NULL);
+
+	if (copies) {
+		fclose(copies);
+	}
+
+	TEST_END("parity");
+}
\ No newline at end of file
@@ -0,0 +1,50 @@
+/**\file test/peerbase.c
+ * Tests of the flow table snapshots of the ISD
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_PB
+
+#include <string.h>
+
+#include "isd.h"
+#include "test.h"
+#include "isd_setup.h"
+
+extern iprp_isd_peerbase_t pb;
+
+/* Function prototypes */
+bool pb_changed(iprp_peerbase_t *bases, int count);
+void pb_publish(iprp_peerbase_t *bases, int count);
+
+int failures = 0;
+
+/**
+ Checks that the peerbases left out of a snapshot do not make it change, and that the other ones do
+*/
+void test_changed() {
+	iprp_peerbase_t bases[3];
+	flow_fill(&bases[0], 0, 1); // Invalid flow IDs
+	flow_fill(&bases[1], 1, 1);
+	flow_fill(&bases[2], IPRP_MAX_FLOWS + 1, 1);
+	CHECK(pb_changed(bases, 3));
+
+	pb_publish(bases, 3);
+	CHECK(pb.current->nb_flows == 1);
+	CHECK(!pb_changed(bases, 3));
+	CHECK(!pb_changed(&bases[1], 1));
+
+	// A flow changes, goes or comes
+	bases[1].version--;
+	CHECK(pb_changed(bases, 3));
+	bases[1].version++;
+	CHECK(pb_changed(bases, 1));
+	flow_fill(&bases[2], 2, 1);
+	CHECK(pb_changed(bases, 3));
+}
+
+int main() {
+	isd_setup();
+	test_changed();
+	TEST_END("peerbase");
+}
\ No newline at end of file
@@ -0,0 +1,178 @@
+/**\file test/pool.c
+ * Tests of the ISD packet buffer pool
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <sched.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "isd.h"
+#include "test.h"
+
+#define SENDERS 4
+#define RING_SIZE 256 // Power of two
+#define PACKETS 200000
+
+int failures = 0;
+
+/* Copy handed to a sender thread, with the stamp its buffer had when it was taken */
+typedef struct {
+	iprp_pktbuf_t *buf;
+	uint64_t stamp;
+} copy_t;
+
+/* Copies of one sender (single producer, single consumer) */
+typedef struct {
+	copy_t copies[RING_SIZE];
+	uint32_t head;
+	uint32_t tail;
+	pthread_t thread;
+	unsigned long stale; // Copies whose buffer was taken again before they were sent
+} sender_t;
+
+sender_t senders[SENDERS];
+bool done = false;
+
+/**
+ Takes the next buffer of the pool for the given number of copies, as the workers do
+*/
+iprp_pktbuf_t *take(iprp_pktbuf_pool_t *pool, uint32_t copies) {
+	iprp_pktbuf_t *buf = pool_next(pool);
+	if (buf) {
+		pool_take(pool, 1);
+		__atomic_add_fetch(&buf->refs, copies, __ATOMIC_RELAXED);
+		pool_release(buf);
+	}
+	return buf;
+}
+
+/**
+ Checks the order of the buffers and their reference counts with a single thread
+*/
+void test_refs() {
+	iprp_pktbuf_pool_t *pool = pool_create();
+	CHECK(pool != NULL);
+
+	// The next buffer is free until it is taken
+	iprp_pktbuf_t *first = pool_next(pool);
+	CHECK(first == &pool->bufs[0]);
+	CHECK(pool_next(pool) == first);
+
+	// Several copies hold the buffer
+	CHECK(take(pool, 3) == first);
+	CHECK(first->refs == 3);
+	CHECK(pool_next(pool) == &pool->bufs[1]);
+	pool_release(first);
+	pool_release(first);
+	CHECK(first->refs == 1);
+
+	// Buffers are reused in order: the first one blocks the pool once it wrapped around, even if later ones are free
+	for (int i = 1; i < IPRP_ISD_POOL_SIZE; ++i) {
+		CHECK(take(pool, 2) == &pool->bufs[i]);
+	}
+	CHECK(pool->gets == IPRP_ISD_POOL_SIZE);
+	for (int i = 1; i < IPRP_ISD_POOL_SIZE; ++i) {
+		pool_release(&pool->bufs[i]);
+		pool_release(&pool->bufs[i]);
+	}
+	CHECK(pool_next(pool) == NULL);
+
+	// The last copy gives the buffer back
+	pool_release(first);
+	CHECK(pool_next(pool) == first);
+	for (int i = 0; i < IPRP_ISD_POOL_SIZE; ++i) {
+		CHECK(pool->bufs[i].refs == 0);
+	}
+
+	free(pool);
+}
+
+/**
+ Sends the copies of one sender: checks that their buffer was not taken again, and releases it
+*/
+void *sender_routine(void *arg) {
+	sender_t *sender = (sender_t *) arg;
+	while (true) {
+		uint32_t tail = sender->tail;
+		if (tail == __atomic_load_n(&sender->head, __ATOMIC_ACQUIRE)) {
+			if (__atomic_load_n(&done, __ATOMIC_ACQUIRE) && tail == __atomic_load_n(&sender->head, __ATOMIC_ACQUIRE)) {
+				return NULL;
+			}
+			sched_yield();
+			continue;
+		}
+
+		copy_t *copy = &sender->copies[tail % RING_SIZE];
+		uint64_t stamp;
+		memcpy(&stamp, copy->buf->data, sizeof(stamp));
+		if (stamp != copy->stamp) {
+			sender->stale++;
+		}
+		pool_release(copy->buf);
+		__atomic_store_n(&sender->tail, tail + 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ Hands buffers with one to SENDERS copies to the sender threads, as a worker does with the transmit threads
+
+ The worker waits for a buffer when the pool is exhausted. A buffer taken again while a copy still uses it
+ would have a new stamp when the copy is sent.
+*/
+void test_threads() {
+	iprp_pktbuf_pool_t *pool = pool_create();
+	for (int i = 0; i < SENDERS; ++i) {
+		senders[i].head = 0;
+		senders[i].tail = 0;
+		senders[i].stale = 0;
+		pthread_create(&senders[i].thread, NULL, sender_routine, &senders[i]);
+	}
+
+	unsigned int seed = 1;
+	for (uint64_t stamp = 1; stamp <= PACKETS; ++stamp) {
+		iprp_pktbuf_t *buf;
+		uint32_t inds = 1 + rand_r(&seed) % ((1 << SENDERS) - 1);
+		uint32_t copies = __builtin_popcount(inds);
+		while (!(buf = pool_next(pool))) {
+			pool->exhausted++;
+			sched_yield();
+		}
+		memcpy(buf->data, &stamp, sizeof(stamp));
+		CHECK(take(pool, copies) == buf);
+
+		for (int i = 0; i < SENDERS; ++i) {
+			if (!(inds & (1 << i))) {
+				continue;
+			}
+			sender_t *sender = &senders[i];
+			uint32_t head = sender->head;
+			while (head - __atomic_load_n(&sender->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+				sched_yield();
+			}
+			sender->copies[head % RING_SIZE] = (copy_t) { .buf = buf, .stamp = stamp };
+			__atomic_store_n(&sender->head, head + 1, __ATOMIC_RELEASE);
+		}
+	}
+
+	__atomic_store_n(&done, true, __ATOMIC_RELEASE);
+	for (int i = 0; i < SENDERS; ++i) {
+		pthread_join(senders[i].thread, NULL);
+		CHECK(senders[i].stale == 0);
+	}
+	CHECK(pool->gets == PACKETS);
+	for (int i = 0; i < IPRP_ISD_POOL_SIZE; ++i) {
+		CHECK(pool->bufs[i].refs == 0);
+	}
+	pool_log(pool, 0);
+
+	free(pool);
+}
+
+int main() {
+	test_refs();
+	test_threads();
+	TEST_END("pool");
+}
\ No newline at end of file
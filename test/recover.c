@@ -0,0 +1,243 @@
+/**\file test/recover.c
+ * Tests of the recovery of lost packets from parity packets by the IRD
+ *
+ * Given the file of copies stored by the parity test, the packets sent by the ISD are recovered as well.
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE IRD_HANDLE
+
+#include <string.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include "ird.h"
+#include "test.h"
+#include "ird_setup.h"
+
+#define REBOOT 1
+#define GROUP 4
+#define FLAGS (IPRP_COMPACT_LINK | IPRP_COMPACT_FEC)
+
+int failures = 0;
+iprp_ird_worker_t worker;
+int app;
+
+/* Packets of a parity group (sent on two paths in turn, the parity on the next one) */
+typedef struct {
+	uint32_t seq_nbs[GROUP];
+	uint8_t flags[GROUP];
+	char *payloads[GROUP];
+	size_t sizes[GROUP];
+	char data[GROUP][IPRP_FEC_MAX_SIZE];
+} group_t;
+
+/* Datagrams given back to the application with their packet */
+char forwarded[16][IPRP_FEC_MAX_SIZE];
+size_t forwarded_sizes[16];
+int nb_forwarded = 0;
+
+/**
+ Keeps the datagram of a packet forwarded to the application, after checking its headers
+*/
+void forward(const unsigned char *packet, size_t size) {
+	struct iphdr *ip = (struct iphdr *) packet;
+	struct udphdr *udp = (struct udphdr *) (packet + sizeof(struct iphdr));
+	size_t payload_size = size - sizeof(struct iphdr) - sizeof(struct udphdr);
+	CHECK(ip->saddr == htonl(INADDR_LOOPBACK));
+	CHECK(ntohs(ip->tot_len) == size);
+	CHECK(ntohs(udp->source) == TEST_SRC_PORT);
+	CHECK(ntohs(udp->dest) == TEST_DEST_PORT);
+	if (nb_forwarded < 16 && payload_size <= IPRP_FEC_MAX_SIZE) {
+		memcpy(forwarded[nb_forwarded], packet + sizeof(struct iphdr) + sizeof(struct udphdr), payload_size);
+		forwarded_sizes[nb_forwarded++] = payload_size;
+	}
+}
+
+/**
+ Fills the packets of a group, starting at the given sequence number (each payload has its own size and content)
+*/
+void group_fill(group_t *group, uint32_t first) {
+	size_t sizes[GROUP] = { 100, 300, 50, 200 };
+	for (int i = 0; i < GROUP; ++i) {
+		group->seq_nbs[i] = first + i;
+		group->flags[i] = FLAGS;
+		group->payloads[i] = group->data[i];
+		group->sizes[i] = sizes[i];
+		for (size_t j = 0; j < sizes[i]; ++j) {
+			group->data[i][j] = (first + i) * 31 + j;
+		}
+	}
+}
+
+/**
+ Receives the given packet of a group (-1 for its parity packet)
+*/
+void group_receive(group_t *group, int i) {
+	char packet[IRD_FEC_PARITY_SIZE + sizeof(iprp_compact_header_t)];
+	if (i < 0) {
+		size_t size = parity_fill(packet, group->seq_nbs, group->flags, group->payloads, group->sizes, GROUP);
+		test_receive(&worker, GROUP % 2, packet, size);
+		return;
+	}
+	size_t size = data_fill(packet, REBOOT, group->seq_nbs[i], group->flags[i], group->payloads[i], group->sizes[i]);
+	test_receive(&worker, i % 2, packet, size);
+}
+
+/**
+ Checks that the given packet of a group was forwarded
+*/
+void forwarded_check(group_t *group, int i) {
+	bool found = false;
+	for (int j = 0; j < nb_forwarded; ++j) {
+		found = found || (forwarded_sizes[j] == group->sizes[i] && !memcmp(forwarded[j], group->payloads[i], group->sizes[i]));
+	}
+	CHECK(found);
+}
+
+/**
+ Checks that the given packet of a group was rebuilt and delivered to the application
+*/
+void rebuilt_check(group_t *group, int i) {
+	char datagram[IPRP_PKTBUF_SIZE];
+	ssize_t size = recv(app, datagram, sizeof(datagram), 0);
+	CHECK(size == (ssize_t) group->sizes[i]);
+	CHECK(size > 0 && !memcmp(datagram, group->payloads[i], size));
+}
+
+/**
+ Loses one packet of a group: it is rebuilt from the parity packet, and its late copy is a duplicate
+*/
+void test_single() {
+	group_t group;
+	group_fill(&group, 1);
+	group_receive(&group, 0);
+	group_receive(&group, 1);
+	group_receive(&group, 3);
+	CHECK(nb_forwarded == 3);
+	group_receive(&group, -1);
+	CHECK(nb_forwarded == 3);
+	forwarded_check(&group, 0);
+	forwarded_check(&group, 1);
+	forwarded_check(&group, 3);
+	rebuilt_check(&group, 2);
+
+	iprp_receiver_link_t *link = test_link(REBOOT);
+	CHECK(link && link->fec && link->fec->recovered == 1);
+	CHECK(link && is_received(3, link));
+
+	group_receive(&group, 2);
+	CHECK(nb_forwarded == 3);
+	CHECK(verdicts.batch_verdict == NF_DROP);
+}
+
+/**
+ Loses two packets of a group: the parity packet waits, and rebuilds the first one when the second one arrives
+*/
+void test_double() {
+	group_t group;
+	group_fill(&group, 1 + GROUP);
+	nb_forwarded = 0;
+	group_receive(&group, 0);
+	group_receive(&group, 3);
+	group_receive(&group, -1);
+	char datagram[IPRP_PKTBUF_SIZE];
+	CHECK(recv(app, datagram, sizeof(datagram), MSG_DONTWAIT) == -1);
+
+	group_receive(&group, 2);
+	CHECK(nb_forwarded == 3);
+	forwarded_check(&group, 2);
+	rebuilt_check(&group, 1);
+
+	iprp_receiver_link_t *link = test_link(REBOOT);
+	CHECK(link && link->fec && link->fec->recovered == 2);
+}
+
+/**
+ Loses a packet of a group while another one is still handled by a worker (received, but not kept yet)
+
+ The parity packet waits for it, and rebuilds the lost packet once it is kept.
+*/
+void test_concurrent() {
+	group_t group;
+	group_fill(&group, 1 + 2 * GROUP);
+	group_receive(&group, 0);
+	group_receive(&group, 1);
+	iprp_receiver_link_t *link = test_link(REBOOT);
+	CHECK(link && is_fresh_packet(group.seq_nbs[3], link));
+	group_receive(&group, -1);
+	char datagram[IPRP_PKTBUF_SIZE];
+	CHECK(recv(app, datagram, sizeof(datagram), MSG_DONTWAIT) == -1);
+
+	char buf[IPRP_PKTBUF_SIZE];
+	iprp_test_packet_t packet;
+	packet_fill(&packet, buf, 0, htonl(INADDR_LOOPBACK + 1), htonl(INADDR_LOOPBACK), "", 0);
+	if (link) {
+		fec_store((struct iphdr *) buf, link, group.seq_nbs[3], group.payloads[3], group.sizes[3]);
+	}
+	rebuilt_check(&group, 2);
+	CHECK(link && link->fec && link->fec->recovered == 3);
+}
+
+/**
+ Hands the copies sent by the ISD in the parity test to the IRD, losing a packet on each path
+
+ Each lost packet is rebuilt from its parity packet, sent on another path.
+*/
+void test_spread(const char *file) {
+	FILE *copies = fopen(file, "r");
+	CHECK(copies);
+	if (!copies) {
+		return;
+	}
+	nb_forwarded = 0;
+	unsigned long forwarded = verdicts.forwarded;
+
+	char lost[2][IPRP_PKTBUF_SIZE];
+	size_t lost_sizes[2];
+	int nb_lost = 0;
+	int nb_data = 0;
+	iprp_test_copy_t copy;
+	char packet[IPRP_PKTBUF_SIZE];
+	while (fread(&copy, sizeof(copy), 1, copies) == 1 && copy.size <= sizeof(packet) && fread(packet, copy.size, 1, copies) == 1) {
+		iprp_compact_header_t *header = (iprp_compact_header_t *) packet;
+		if (!(header->flags & IPRP_COMPACT_PARITY) && ++nb_data > 2 && nb_lost < 2) {
+			// The third and fourth packets are lost (on different paths)
+			size_t header_size = sizeof(iprp_compact_header_t) + ((header->flags & IPRP_COMPACT_LINK) ? sizeof(iprp_compact_link_t) : 0);
+			lost_sizes[nb_lost] = copy.size - header_size;
+			memcpy(lost[nb_lost++], packet + header_size, copy.size - header_size);
+			continue;
+		}
+		test_receive(&worker, copy.ind, packet, copy.size);
+	}
+	fclose(copies);
+	CHECK(nb_lost == 2);
+	CHECK(verdicts.forwarded - forwarded == (unsigned long) nb_data - 2);
+
+	for (int i = 0; i < nb_lost; ++i) {
+		char datagram[IPRP_PKTBUF_SIZE];
+		ssize_t size = recv(app, datagram, sizeof(datagram), 0);
+		CHECK(size == (ssize_t) lost_sizes[i]);
+		CHECK(size > 0 && !memcmp(datagram, lost[i], size));
+	}
+
+	iprp_receiver_link_t *link = test_link(TEST_COPIES_REBOOT);
+	CHECK(link && link->fec && link->fec->recovered == 2);
+}
+
+int main(int argc, char *argv[]) {
+	ird_setup(&worker);
+	app = app_socket();
+	verdicts.forward = forward;
+
+	test_single();
+	test_double();
+	test_concurrent();
+	if (argc > 1) {
+		test_spread(argv[1]);
+	}
+
+	TEST_END("recover");
+}
\ No newline at end of file
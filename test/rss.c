@@ -0,0 +1,79 @@
+/**\file test/rss.c
+ * Test of the memory used by the ISD over many packets (batch engine, loopback)
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+#define IPRP_FILE ISD_HANDLE
+
+#include <string.h>
+
+#include "isd.h"
+#include "test.h"
+#include "isd_setup.h"
+
+#define FLOW_ID 1
+#define WARMUP_PACKETS 100000
+#define PACKETS 10000000
+#define MAX_GROWTH 256 // Kilobytes
+
+int failures = 0;
+
+/**
+ Returns the resident set size of the process (kilobytes, 0 if unknown)
+*/
+long rss_kb() {
+	FILE *status = fopen("/proc/self/status", "r");
+	if (!status) {
+		return 0;
+	}
+	char line[128];
+	long rss = 0;
+	while (fgets(line, sizeof(line), status)) {
+		if (!strncmp(line, "VmRSS:", 6)) {
+			rss = strtol(line + 6, NULL, 10);
+			break;
+		}
+	}
+	fclose(status);
+	return rss;
+}
+
+/**
+ Sends the given number of packets, each taking a buffer of the pool and giving it back once sent
+*/
+void packets_send(iprp_isd_worker_t *worker, unsigned long count) {
+	char payload[64];
+	memset(payload, 0, sizeof(payload));
+	for (unsigned long i = 0; i < count; ++i) {
+		memcpy(payload, &i, sizeof(i));
+		test_send(worker, FLOW_ID, payload, sizeof(payload));
+	}
+}
+
+/**
+ Checks that the resident set size stays flat once the buffers of the worker are in use
+
+ The copies are sent to a path socket that is never read: they are dropped by the kernel once its buffer is full.
+*/
+int main() {
+	iprp_isd_worker_t worker;
+	iprp_peerbase_t base;
+	isd_setup();
+	path_socket(0);
+	worker_setup(&worker);
+	flow_fill(&base, FLOW_ID, 1);
+	flow_publish(&base);
+
+	packets_send(&worker, WARMUP_PACKETS);
+	long before = rss_kb();
+	packets_send(&worker, PACKETS);
+	CHECK(copies_sent(&worker));
+	long after = rss_kb();
+
+	fprintf(stderr, "rss: %ld kB after %d packets, %ld kB after %d more\n", before, WARMUP_PACKETS, after, PACKETS);
+	CHECK(before > 0);
+	CHECK(after - before <= MAX_GROWTH);
+	CHECK(worker.pool->gets == WARMUP_PACKETS + PACKETS);
+
+	TEST_END("rss");
+}
\ No newline at end of file
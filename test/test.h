@@ -0,0 +1,55 @@
+/**\file test.h
+ * Header file for the tests and benchmarks
+ *
+ * \author Loic Ottet (loic.ottet@epfl.ch)
+ */
+
+#ifndef __IPRP_TEST_
+#define __IPRP_TEST_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "global.h"
+
+/* Results are reported on stderr (the daemon code logs on stdout) */
+#define CHECK(cond) \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	}
+
+#define TEST_END(name) \
+	fprintf(stderr, "%s: %s\n", name, failures ? "FAILED" : "passed"); \
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS
+
+/* Packet given to the handlers in place of an NFQueue packet (as a struct nfq_data) */
+typedef struct {
+	uint32_t mark;
+	unsigned char *data; // IP packet
+	size_t size;
+	struct nfqnl_msg_packet_hdr header;
+} iprp_test_packet_t;
+
+/* Verdicts set by the handlers */
+typedef struct {
+	unsigned long batches; // Batched verdicts sent (the last one applies to all packets up to its ID)
+	uint32_t batch_id;
+	uint32_t batch_verdict;
+	unsigned long forwarded; // Packets given back with a new content
+	void (*forward)(const unsigned char *packet, size_t size); // Called for each of them (if set)
+} iprp_test_verdicts_t;
+
+extern iprp_test_verdicts_t verdicts;
+
+/* Copies sent by the ISD in the parity test, and handed to the IRD in the recover test (file given to both) */
+#define TEST_COPIES_REBOOT 2 // Reboot counter of their link
+typedef struct {
+	uint32_t ind; // Path of the copy
+	uint32_t size; // Followed by the iPRP packet
+} iprp_test_copy_t;
+
+/* Packet functions */
+size_t packet_fill(iprp_test_packet_t *packet, char *buf, uint32_t mark, uint32_t src_addr, uint32_t dest_addr, const char *payload, size_t payload_size);
+
+#endif /* __IPRP_TEST_ */
\ No newline at end of file